@@ -13,6 +13,8 @@
 // limitations under the License.
 #include <cassert>
 #include <cmath>
+#include <cstring>
+#include <memory>
 #include <iostream>
 #include <ostream>
 #include <tiff.h>
@@ -20,15 +22,41 @@
 #include <vips/vips.h>
 #include <vips/vips8>
 #include <map>
+#include <numeric>
+#include <set>
 #include <sstream>
 
 #include "utils.h"
 #include "spinners.h"
+#include "box-downsampler.h"
+#include "jpeg-encoder.h"
+#include "encoding-stats.h"
+#include "output-sink.h"
+#include "pyramid-builder.h"
+#include "tiff-utils.h"
+#include "tile-dedup.h"
+#include "tile-encoder.h"
 #include "tile-generator.h"
+#include "tile-order.h"
+#include "tile-pipeline.h"
+#include "page-writer.h"
 #include "aperio-svs-encoding.h"
 
 #define TILE_SIZE 256
 
+// Tiles waiting to be written, per worker, and pixel buffers a worker holds:
+// the tile it reads, a copy for libtiff and the encoded tile, plus two for
+// each tile in flight.
+#define TILES_IN_FLIGHT_PER_WORKER 4
+#define TILES_PER_WORKER (3 + 2 * TILES_IN_FLIGHT_PER_WORKER)
+
+// Native tiles compressed to estimate the size of the output.
+#define SIZE_ESTIMATE_SAMPLES 16
+
+// Classic TIFF offsets are 32 bits, switch to BigTIFF with enough headroom
+// for the inaccuracy of the size estimate.
+#define BIGTIFF_THRESHOLD (3ULL << 30)
+
 #ifdef WITH_SPINNER
 static spinners::Spinner *spinner = nullptr;
 
@@ -47,7 +75,7 @@ static inline struct sigaction* get_sigaction(int signo) {
 
 static void receive_signal(int signo) {
   if (spinner)
-    spinner->Stop();
+    spinner->Interrupt();
   struct sigaction *old = get_sigaction(signo);
   sigaction(signo, old, nullptr);
   kill(0, signo);
@@ -62,8 +90,6 @@ static void arm_signal_handler() {
 
 #endif
 
-enum class PageType { kTiled, kStriped };
-
 enum class AperioDescriptionType { kThumbnailLayer, kNativeLayer, kSubLayer };
 
 static inline int plateau(int idx, float k = 6.0) {
@@ -82,8 +108,8 @@ static void init_tiff_page(TIFF *out, uint32_t width, uint32_t height,
   TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 8);
   TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 3);
   TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  // Codecs storing YCbCr override it.
   TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-  TIFFSetField(out, TIFFTAG_YCBCRSUBSAMPLING, 2, 2);
   TIFFSetField(out, TIFFTAG_SUBFILETYPE, subfile_type);
 }
 
@@ -91,7 +117,8 @@ static void aperio_describe_layer(AperioDescriptionType layer_type,
                                   const VImage &layer, const uint32_t native_width,
                                   const uint32_t native_height,
                                   const std::optional<unsigned> tile_size,
-                                  const std::optional<int> jpeg_quality,
+                                  const TileCompression compression,
+                                  const std::optional<int> quality,
                                   const std::optional<Metadata> metadata, TIFF *out) {
   std::ostringstream ss;
   ss << aperio_header << std::endl;
@@ -106,9 +133,9 @@ static void aperio_describe_layer(AperioDescriptionType layer_type,
 
   if (layer_type == AperioDescriptionType::kNativeLayer ||
       layer_type == AperioDescriptionType::kSubLayer) {
-    ss << " JPEG/RGB ";
-    if (jpeg_quality)
-      ss << "Q=" << *jpeg_quality;
+    ss << " " << aperio_compression_name(compression) << " ";
+    if (quality && !is_lossless(compression))
+      ss << "Q=" << *quality;
   } else
     ss << " - ";
 
@@ -124,48 +151,732 @@ static void aperio_describe_layer(AperioDescriptionType layer_type,
   TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, ss.str().c_str());
 }
 
-static void write_page(const VImage &in, const unsigned tile_size,
-                       const std::optional<int> jpeg_quality,
-                       PageType page_type, TIFF *out) {
+static CodecSettings codec_settings(const EncodingContext &context,
+                                    TileCompression compression, int quality) {
+  CodecSettings settings = {};
+  settings.encoder = context.encoder;
+  settings.compression = compression;
+  settings.quality = quality;
+  settings.optimize_coding = context.optimize_coding;
+  settings.colorspace = context.colorspace;
+  return settings;
+}
+
+// Sets the tags of a page, but its description.
+static bool setup_page(uint32_t width, uint32_t height, unsigned tile_size,
+                       PageType page_type, const TileCodec &codec, TIFF *out) {
+  init_tiff_page(out, width, height, 0, 0);
+
+  if (page_type == PageType::kTiled) {
+    TIFFSetField(out, TIFFTAG_TILEWIDTH, tile_size);
+    TIFFSetField(out, TIFFTAG_TILELENGTH, tile_size);
+  } else
+    TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, tile_size);
+  return codec.SetupPage(out);
+}
+
+// A tile extracted and compressed by a pipeline worker.
+typedef struct {
+  Buffer encoded;
+  // Raw pixels, when libtiff compresses the tile itself.
+  Buffer pixels;
+  TileReduction reduction;
+  // Set when deduplicating, `encoded` is then held by the entry.
+  std::shared_ptr<TileDeduplicator::Entry> entry;
+  bool copied;  // from the previous version of the page.
+  const Strile *resumed;  // written by an interrupted conversion.
+} EncodedTile;
+
+// Writes the bytes of the first occurrence of a deduplicated tile, and
+// points the later ones at them.
+static bool write_deduplicated_tile(TileDeduplicator::Entry *entry,
+                                    unsigned index, TIFF *out) {
+  if (entry->written)
+    return set_strile(out, index, *entry->written);
+
+  if (!entry->Wait())
+    return false;
+  const Buffer &buffer = entry->encoded;
+  if (TIFFWriteRawTile(out, index, buffer.data.get(), buffer.size) !=
+      static_cast<tmsize_t>(buffer.size))
+    return false;
+  Strile strile;
+  if (!get_strile(out, index, &strile))
+    return false;
+  entry->written = strile;
+  entry->encoded = Buffer{};
+  return true;
+}
+
+// Whether tiles compressed for `previous` can be copied as they are into
+// `out`, both set up for their page.
+static bool same_compression(TIFF *previous, TIFF *out) {
+  uint16_t previous_compression = 0, compression = 0;
+  uint16_t previous_photometric = 0, photometric = 0;
+  TIFFGetField(previous, TIFFTAG_COMPRESSION, &previous_compression);
+  TIFFGetField(out, TIFFTAG_COMPRESSION, &compression);
+  TIFFGetField(previous, TIFFTAG_PHOTOMETRIC, &previous_photometric);
+  TIFFGetField(out, TIFFTAG_PHOTOMETRIC, &photometric);
+  if (previous_compression != compression || previous_photometric != photometric)
+    return false;
+  if (compression != COMPRESSION_JPEG)
+    return true;
+
+  // Abbreviated JPEG tiles need the tables they were encoded with.
+  uint32_t previous_size = 0, size = 0;
+  void *previous_tables = nullptr, *tables = nullptr;
+  return TIFFGetField(previous, TIFFTAG_JPEGTABLES, &previous_size, &previous_tables) &&
+    TIFFGetField(out, TIFFTAG_JPEGTABLES, &size, &tables) &&
+    previous_size == size && memcmp(previous_tables, tables, size) == 0;
+}
+
+// Copies `rows` rows of a tile into a contiguous buffer it owns.
+static Buffer own_pixels(Tile *tile, unsigned width, unsigned rows) {
+  const size_t line_size = static_cast<size_t>(width) * 3;
+  if (tile->buffer.data && tile->stride == line_size)
+    return std::move(tile->buffer);
+
+  Buffer pixels = allocate_buffer(line_size * rows);
+  for (unsigned y = 0; y < rows; ++y)
+    memcpy(pixels.data.get() + y * line_size, tile->pixels + y * tile->stride, line_size);
+  return pixels;
+}
+
+bool write_page(const VImage &in, const unsigned tile_size,
+                const TileCompression compression,
+                const std::optional<int> quality,
+                PageType page_type, const EncodingContext &context,
+                TIFF *out, PyramidBuilder *pyramid, PageStats *stats,
+                const PageReuse *reuse) {
   const uint32_t width = in.width();
   const uint32_t height = in.height();
+  const auto start = std::chrono::steady_clock::now();
 
 #ifdef WITH_SPINNER
-  spinner->SetText("Generating layer with size (" + std::to_string(width) + ", " + std::to_string(height) + ")");
+  if (context.spinner)
+    context.spinner->SetText("Generating layer with size (" + std::to_string(width) + ", " + std::to_string(height) + ")");
 #endif
 
   const int tile_width = (page_type == PageType::kStriped) ? width : tile_size;
 
-  VImage cached = in.tilecache(
+  // Strips span the whole page, a budget may only afford a few of them.
+  const uint64_t cached_tile_bytes = static_cast<uint64_t>(tile_width) * tile_size * 3;
+  const int max_cached_tiles = context.tile_cache_bytes
+    ? std::clamp<uint64_t>(context.tile_cache_bytes / cached_tile_bytes, 2,
+                           VIPS_TILECACHE_TILES)
+    : VIPS_TILECACHE_TILES;
+  VImage cached;
+  if (context.sequential) {
+    // Whole rows of tiles, enough for every tile in flight, computed in
+    // order and dropped once the workers are past them.
+    const int rows = partition(context.max_tiles_in_flight, partition(width, tile_width)) + 2;
+    cached = in.tilecache(
+      VImage::option()
+      ->set("tile_width", static_cast<int>(width))
+      ->set("tile_height", static_cast<int>(tile_size))
+      ->set("max_tiles", rows)
+      ->set("access", VIPS_ACCESS_SEQUENTIAL)
+      ->set("threaded", true)
+      ->set("persistent", false));
+  } else {
+    cached = in.tilecache(
       VImage::option()
       ->set("tile_width", tile_width)
       ->set("tile_height", static_cast<int>(tile_size))
+      ->set("max_tiles", max_cached_tiles)
+      // Workers compute missing tiles concurrently, not one at a time.
+      ->set("threaded", true)
       ->set("persistent", false));
+  }
+
+  const std::unique_ptr<TileCodec> codec = make_tile_codec(
+    codec_settings(context, compression, quality.value_or(DEFAULT_JPEG_QUALITY)));
+  if (!codec || (!context.directory_written &&
+                 !setup_page(width, height, tile_size, page_type, *codec, out)))
+    return false;
+
+  TilePipeline<EncodedTile> pipeline(context.num_threads, context.max_tiles_in_flight);
+  std::vector<std::unique_ptr<TileEncoder>> encoders;
+  for (unsigned i = 0; i < pipeline.num_workers(); ++i)
+    encoders.push_back(codec->NewEncoder());
+  // Without encoders libtiff compresses tiles on the writer thread.
+  const bool raw = encoders[0] != nullptr;
+  if (reuse && (!raw || !same_compression(reuse->previous, out))) {
+    fprintf(stderr, "The previous tiles were compressed differently, they cannot be reused.\n");
+    return false;
+  }
+
+  const VipsImageTileGenerator tiles(cached, tile_width, tile_size);
+  const unsigned num_tiles = tiles.size();
+  // The pipeline runs through the tiles in the order they are stored. A
+  // pyramid accumulates them, and a sequential input yields them, by rows.
+  std::vector<uint32_t> order;
+  if (page_type == PageType::kTiled && !pyramid && !context.sequential &&
+      context.tile_order != TileOrder::kRowMajor)
+    order = tile_order(context.tile_order, partition(width, tile_width),
+                       partition(height, tile_size));
+  PageCounters counters;
+  std::atomic<uint64_t> raw_bytes{0};
+#ifdef WITH_SPINNER
+  if (context.spinner)
+    context.spinner->SetTotal(num_tiles);
+#endif
+  // Only tiles are deduplicated, strips are too few to matter.
+  std::unique_ptr<TileDeduplicator> dedup;
+  if (context.dedup && raw && page_type == PageType::kTiled)
+    dedup.reset(new TileDeduplicator());
+  // Readers are created lazily so that each one belongs to its worker thread.
+  std::vector<std::unique_ptr<VipsImageTileGenerator::Reader>> readers(pipeline.num_workers());
+  auto produce = [&](unsigned worker, unsigned position, EncodedTile *out) {
+    const unsigned index = order.empty() ? position : order[position];
+    if (reuse && !reuse->dirty[index]) {
+      out->copied = true;
+      return true;
+    }
+    if (context.journal) {
+      out->resumed = context.journal->Find(context.page, index);
+      if (out->resumed)
+        return true;
+    }
+    if (!readers[worker])
+      readers[worker].reset(new VipsImageTileGenerator::Reader(tiles));
+    Tile tile;
+    {
+      StageTimer timer(&counters.extract_ns);
+      if (!readers[worker]->Read(index, &tile))
+        return false;
+    }
+    if (pyramid) {
+      StageTimer timer(&counters.reduce_ns);
+      pyramid->Reduce(index, tile.pixels, tile.stride, &out->reduction);
+    }
+
+    // Strips are not padded, the last one only holds the remaining rows.
+    const unsigned y = (index / partition(width, tile_width)) * tile_size;
+    const unsigned rows = (page_type == PageType::kStriped)
+      ? std::min(tile_size, height - y)
+      : tile_size;
+    raw_bytes.fetch_add(static_cast<uint64_t>(tile_width) * rows * 3,
+                        std::memory_order_relaxed);
+    if (!raw) {
+      out->pixels = own_pixels(&tile, tile_width, rows);
+      return true;
+    }
+    StageTimer timer(&counters.encode_ns);
+    if (!dedup)
+      return encoders[worker]->Encode(tile.pixels, tile_width, rows, tile.stride,
+                                      &out->encoded);
+
+    bool owner = false;
+    const TileDigest digest = digest_tile(tile.pixels, tile.stride, tile_width, rows, 3);
+    out->entry = dedup->Claim(digest, tile.pixels, tile.stride, tile_width, rows, 3, &owner);
+    if (!out->entry)
+      return encoders[worker]->Encode(tile.pixels, tile_width, rows, tile.stride,
+                                      &out->encoded);
+    if (!owner) {
+      dedup->CountDuplicate();
+      return true;
+    }
+    Buffer encoded;
+    const bool ok = encoders[worker]->Encode(tile.pixels, tile_width, rows,
+                                             tile.stride, &encoded);
+    out->entry->Publish(std::move(encoded), ok);
+    return ok;
+  };
+  // Previous tiles already copied, by their offset in the previous file, so
+  // that tiles it stored once still are.
+  std::map<uint64_t, Strile> copies;
+  std::vector<uint8_t> copy_buffer;
+  unsigned num_copied = 0;
+  unsigned num_resumed = 0;
+  auto copy_tile = [&](unsigned index, uint64_t *bytes) {
+    Strile previous;
+    if (!get_strile(reuse->previous, index, &previous))
+      return false;
+    const auto copy = copies.find(previous.offset);
+    if (copy != copies.end())
+      return set_strile(out, index, copy->second);
 
+    copy_buffer.resize(previous.bytecount);
+    if (TIFFReadRawTile(reuse->previous, index, copy_buffer.data(), copy_buffer.size()) !=
+        static_cast<tmsize_t>(previous.bytecount) ||
+        TIFFWriteRawTile(out, index, copy_buffer.data(), copy_buffer.size()) !=
+        static_cast<tmsize_t>(previous.bytecount))
+      return false;
+    Strile strile;
+    if (!get_strile(out, index, &strile))
+      return false;
+    copies[previous.offset] = strile;
+    *bytes = strile.bytecount;
+    return true;
+  };
+  // Writes the tile, and reports the bytes it added to the file.
+  auto write_tile = [&](unsigned index, EncodedTile &tile, uint64_t *bytes) {
+    if (tile.resumed) {
+      ++num_resumed;
+      return set_strile(out, index, *tile.resumed);
+    }
+    if (tile.copied) {
+      ++num_copied;
+      return copy_tile(index, bytes);
+    }
+    if (tile.entry) {
+      const bool first = !tile.entry->written;
+      if (!write_deduplicated_tile(tile.entry.get(), index, out))
+        return false;
+      *bytes = first ? tile.entry->written->bytecount : 0;
+      return true;
+    }
+
+    const bool tiled = page_type == PageType::kTiled;
+    if (!raw) {
+      Buffer &pixels = tile.pixels;
+      Strile strile;
+      if ((tiled
+           ? TIFFWriteEncodedTile(out, index, pixels.data.get(), pixels.size)
+           : TIFFWriteEncodedStrip(out, index, pixels.data.get(), pixels.size)) < 0 ||
+          !get_strile(out, index, &strile))
+        return false;
+      *bytes = strile.bytecount;
+      return true;
+    }
+    const Buffer &buffer = tile.encoded;
+    const tmsize_t written = tiled
+      ? TIFFWriteRawTile(out, index, buffer.data.get(), buffer.size)
+      : TIFFWriteRawStrip(out, index, buffer.data.get(), buffer.size);
+    *bytes = buffer.size;
+    return written == static_cast<tmsize_t>(buffer.size);
+  };
+  auto consume = [&](unsigned position, EncodedTile &tile) {
+    const unsigned index = order.empty() ? position : order[position];
+    if (pyramid) {
+      StageTimer timer(&counters.reduce_ns);
+      if (!pyramid->Accumulate(index, tile.reduction))
+        return false;
+    }
+    uint64_t bytes = 0;
+    {
+      StageTimer timer(&counters.write_ns);
+      if (!write_tile(index, tile, &bytes))
+        return false;
+      Strile strile;
+      if (context.journal && !tile.resumed &&
+          (!get_strile(out, index, &strile) ||
+           !context.journal->Record(context.page, index, strile)))
+        return false;
+    }
+    counters.encoded_bytes.fetch_add(bytes, std::memory_order_relaxed);
+#ifdef WITH_SPINNER
+    if (context.spinner)
+      context.spinner->Advance();
+#endif
+    if (context.on_progress)
+      context.on_progress(position + 1, num_tiles);
+    return true;
+  };
+
+  if (!pipeline.Run(num_tiles, produce, consume)) {
+    fprintf(stderr, "Unable to encode layer with size (%u, %u).\n", width, height);
+    return false;
+  }
+  // Directories written up front only have their tile arrays left.
+  if (!(context.directory_written ? TIFFForceStrileArrayWriting(out) : TIFFWriteDirectory(out)))
+    return false;
+  // Checkpoints each completed page.
+  if (context.journal && !context.journal->Checkpoint())
+    return false;
+
+  if (stats) {
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    stats->width = width;
+    stats->height = height;
+    stats->tiles = num_tiles;
+    stats->duplicates = dedup ? dedup->num_duplicates() : 0;
+    stats->copied = num_copied;
+    stats->resumed = num_resumed;
+    stats->raw_bytes = raw_bytes.load();
+    stats->encoded_bytes = counters.encoded_bytes.load();
+    stats->extract_seconds = to_seconds(counters.extract_ns);
+    stats->reduce_seconds = to_seconds(counters.reduce_ns);
+    stats->encode_seconds = to_seconds(counters.encode_ns);
+    stats->write_seconds = to_seconds(counters.write_ns);
+    stats->wall_seconds = elapsed.count();
+  }
+  return true;
+}
+
+// Sets the tags of `out` for the tiles of the current page of `source` as
+// they are compressed: its geometry, compression and what decoding needs.
+static bool copy_page_tags(TIFF *source, TIFF *out) {
+  uint32_t width = 0, height = 0, tile_width = 0, tile_height = 0;
+  uint16_t compression = 0, photometric = 0;
+  if (!TIFFGetField(source, TIFFTAG_IMAGEWIDTH, &width) ||
+      !TIFFGetField(source, TIFFTAG_IMAGELENGTH, &height) ||
+      !TIFFGetField(source, TIFFTAG_TILEWIDTH, &tile_width) ||
+      !TIFFGetField(source, TIFFTAG_TILELENGTH, &tile_height) ||
+      !TIFFGetField(source, TIFFTAG_COMPRESSION, &compression) ||
+      !TIFFGetField(source, TIFFTAG_PHOTOMETRIC, &photometric))
+    return false;
   init_tiff_page(out, width, height, 0, 0);
+  TIFFSetField(out, TIFFTAG_TILEWIDTH, tile_width);
+  TIFFSetField(out, TIFFTAG_TILELENGTH, tile_height);
+  TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
+  TIFFSetField(out, TIFFTAG_PHOTOMETRIC, photometric);
+  if (photometric == PHOTOMETRIC_YCBCR) {
+    uint16_t horizontal = 2, vertical = 2;
+    float *reference_black_white = nullptr;
+    TIFFGetFieldDefaulted(source, TIFFTAG_YCBCRSUBSAMPLING, &horizontal, &vertical);
+    TIFFSetField(out, TIFFTAG_YCBCRSUBSAMPLING, horizontal, vertical);
+    if (TIFFGetField(source, TIFFTAG_REFERENCEBLACKWHITE, &reference_black_white))
+      TIFFSetField(out, TIFFTAG_REFERENCEBLACKWHITE, reference_black_white);
+  }
+  uint16_t predictor = 0;
+  if (TIFFGetField(source, TIFFTAG_PREDICTOR, &predictor) &&
+      !TIFFSetField(out, TIFFTAG_PREDICTOR, predictor))
+    return false;
+  // Abbreviated JPEG tiles only decode with the tables they were encoded with.
+  uint32_t tables_size = 0;
+  void *tables = nullptr;
+  if (TIFFGetField(source, TIFFTAG_JPEGTABLES, &tables_size, &tables) &&
+      !TIFFSetField(out, TIFFTAG_JPEGTABLES, tables_size, tables))
+    return false;
+  return true;
+}
 
-  // Set jpeg compression
-  TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_JPEG);
-  if (jpeg_quality)
-    TIFFSetField(out, TIFFTAG_JPEGQUALITY, *jpeg_quality);
+// Writes the tiles of the current page of `source` as the next directory of
+// `out`, copied as they are compressed. Tiles `source` stores once are
+// stored once too. Like write_page, the description must be set beforehand,
+// and a directory already written only gets its tile arrays updated.
+static bool copy_page(TIFF *source, const EncodingContext &context, TIFF *out,
+                      PageStats *stats) {
+  const auto start = std::chrono::steady_clock::now();
+  uint32_t width = 0, height = 0, tile_size = 0;
+  TIFFGetField(source, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetField(source, TIFFTAG_IMAGELENGTH, &height);
+  TIFFGetField(source, TIFFTAG_TILEWIDTH, &tile_size);
+  if (!context.directory_written && !copy_page_tags(source, out))
+    return false;
 
-  if (page_type == PageType::kTiled) {
-    TIFFSetField(out, TIFFTAG_TILEWIDTH, tile_size);
-    TIFFSetField(out, TIFFTAG_TILELENGTH, tile_size);
-  } else
-    TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, tile_size);
+#ifdef WITH_SPINNER
+  if (context.spinner)
+    context.spinner->SetText("Copying layer with size (" + std::to_string(width) + ", " + std::to_string(height) + ")");
+#endif
+  const uint32_t num_tiles = TIFFNumberOfTiles(source);
+  std::vector<uint32_t> order;
+  if (context.tile_order != TileOrder::kRowMajor)
+    order = tile_order(context.tile_order, partition(width, tile_size),
+                       partition(height, tile_size));
+#ifdef WITH_SPINNER
+  if (context.spinner)
+    context.spinner->SetTotal(num_tiles);
+#endif
+
+  // Tiles already copied, by their offset in `source`.
+  std::map<uint64_t, Strile> copies;
+  std::vector<uint8_t> buffer;
+  PageCounters counters;
+  unsigned duplicates = 0;
+  for (uint32_t position = 0; position < num_tiles; ++position) {
+    const uint32_t index = order.empty() ? position : order[position];
+    const uint64_t offset = TIFFGetStrileOffset(source, index);
+    const uint64_t bytecount = TIFFGetStrileByteCount(source, index);
+    const auto copy = copies.find(offset);
+    StageTimer timer(&counters.write_ns);
+    if (!bytecount) {
+      // Left empty, like in `source`.
+    } else if (copy != copies.end()) {
+      if (!set_strile(out, index, copy->second))
+        return false;
+      ++duplicates;
+    } else {
+      buffer.resize(bytecount);
+      Strile strile;
+      if (TIFFReadRawTile(source, index, buffer.data(), buffer.size()) !=
+          static_cast<tmsize_t>(bytecount) ||
+          TIFFWriteRawTile(out, index, buffer.data(), buffer.size()) !=
+          static_cast<tmsize_t>(bytecount) ||
+          !get_strile(out, index, &strile)) {
+        fprintf(stderr, "Unable to copy tile %u of layer with size (%u, %u).\n",
+                index, width, height);
+        return false;
+      }
+      copies[offset] = strile;
+      counters.encoded_bytes += bytecount;
+    }
+#ifdef WITH_SPINNER
+    if (context.spinner)
+      context.spinner->Advance();
+#endif
+    if (context.on_progress)
+      context.on_progress(position + 1, num_tiles);
+  }
+  if (!(context.directory_written ? TIFFForceStrileArrayWriting(out) : TIFFWriteDirectory(out)))
+    return false;
+
+  if (stats) {
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    stats->width = width;
+    stats->height = height;
+    stats->tiles = num_tiles;
+    stats->duplicates = duplicates;
+    stats->copied = num_tiles;
+    stats->encoded_bytes = counters.encoded_bytes.load();
+    stats->write_seconds = to_seconds(counters.write_ns);
+    stats->wall_seconds = elapsed.count();
+  }
+  return true;
+}
+
+// Renders `image` once so that smaller levels can be computed from its
+// pixels instead of re-running the whole pipeline that produced it. Images
+// larger than `max_in_memory_size` bytes go to a scratch file.
+static VImage materialize(const VImage &image, uint64_t max_in_memory_size) {
+  const size_t size = static_cast<size_t>(image.width()) * image.height() * image.bands();
+  if (size <= max_in_memory_size)
+    return image.copy_memory();
+
+  VImage scratch = VImage::new_temp_file("%s.v");
+  image.write(scratch);
+  return scratch;
+}
+
+VImage resize_to(const VImage &from, uint32_t width, uint32_t height) {
+  return from.resize(static_cast<double>(width) / from.width(),
+                     VImage::option()->set("vscale", static_cast<double>(height) / from.height()));
+}
+
+VImage downsample(const VImage &in, double scaling) {
+  if (box_shrink_supports(in, scaling))
+    return box_shrink(in, scaling);
+  return in.resize(1 / scaling);
+}
+
+static inline uint32_t downscaled(uint32_t length, double scaling) {
+  return std::max(1L, std::lround(length / scaling));
+}
+
+// Builds every sublayer in `scalings` from the previous, already
+// materialized one, so the native image is only resampled once.
+// Returns the layers in the same order as `scalings`.
+static std::vector<VImage> cascade_layers(const VImage &in,
+                                          const std::vector<double> &scalings,
+                                          uint64_t max_in_memory_size) {
+  std::vector<VImage> layers;
+  layers.reserve(scalings.size());
+  const VImage *previous = &in;
+  double previous_scaling = 1;
+  for (const double scaling : scalings) {
+    // Whole blocks of the previous layer are whole blocks of the native one
+    // only when it was itself averaged from whole blocks.
+    const double ratio = scaling / previous_scaling;
+    VImage layer = previous_scaling == std::floor(previous_scaling) &&
+                   box_shrink_supports(*previous, ratio)
+      ? box_shrink(*previous, ratio)
+      : resize_to(*previous, downscaled(in.width(), scaling),
+                  downscaled(in.height(), scaling));
+    previous_scaling = scaling;
+    layers.push_back(materialize(layer, max_in_memory_size));
+    previous = &layers.back();
+  }
+  return layers;
+}
+
+// Estimates the compressed size of the whole pyramid from its geometry and
+// the compression ratio of a few native tiles spread over the image, or the
+// worst case when the image cannot be sampled. A native layer copied as it
+// is compressed counts as its `copied_size` bytes.
+static uint64_t estimate_svs_size(const VImage &in, const std::vector<double> &scalings,
+                                  const CodecSettings &settings, bool sample,
+                                  std::optional<uint64_t> copied_size = {}) {
+  const uint64_t width = in.width();
+  const uint64_t height = in.height();
+  uint64_t raw_size = copied_size ? 0 : width * height * 3;
+  // Sublayers are encoded at a higher quality, count them twice.
+  for (const double scaling : scalings)
+    raw_size += 2 * (width / scaling) * (height / scaling) * 3;
+  const uint64_t copied = copied_size.value_or(0);
+
+  if (!sample)
+    return copied + raw_size;
+  const VipsImageTileGenerator tiles(in, TILE_SIZE, TILE_SIZE);
+  const unsigned num_samples = std::min<unsigned>(SIZE_ESTIMATE_SAMPLES, tiles.size());
+  // Sampled with our own encoder even when libtiff compresses the tiles.
+  CodecSettings sampling = settings;
+  sampling.encoder = TileEncoderType::kLibjpeg;
+  const std::unique_ptr<TileCodec> codec = make_tile_codec(sampling);
+  const std::unique_ptr<TileEncoder> encoder = codec ? codec->NewEncoder() : nullptr;
+  if (!encoder)
+    return copied + raw_size;
+  uint64_t sampled_raw = 0;
+  uint64_t sampled_encoded = 0;
+  for (unsigned i = 0; i < num_samples; ++i) {
+    const std::optional<Tile> tile = tiles[(i * 2 + 1) * tiles.size() / (num_samples * 2)];
+    Buffer encoded;
+    if (!tile || !encoder->Encode((*tile).pixels, TILE_SIZE, TILE_SIZE,
+                                  (*tile).stride, &encoded))
+      continue;
+    sampled_raw += (*tile).buffer.size;
+    sampled_encoded += encoded.size;
+  }
+
+  // Without any sample, assume the worst.
+  if (!sampled_raw)
+    return copied + raw_size;
+  // Half again on top, samples may all fall on a sparse background.
+  return copied + raw_size * sampled_encoded * 3 / (sampled_raw * 2);
+}
+
+// Picks the pyramid level the thumbnail is resampled from, adding a
+// dedicated one to `factors` when no level is close enough in size.
+// Returns nothing when the thumbnail is best taken from the native layer.
+static std::optional<size_t> add_thumbnail_factor(double thumbnail_scale,
+                                                  std::vector<unsigned> *factors) {
+  const unsigned largest = std::floor(1 / thumbnail_scale);
+  std::optional<size_t> base;
+  for (size_t i = 0; i < factors->size(); ++i)
+    if ((*factors)[i] <= largest && (!base || (*factors)[i] > (*factors)[*base]))
+      base = i;
+
+  // A multiple of an existing factor is summed from its level for free.
+  const unsigned base_factor = base ? (*factors)[*base] : 1;
+  const unsigned factor = (largest / base_factor) * base_factor;
+  if (factor < 2 || factor == base_factor)
+    return base;
+  factors->push_back(factor);
+  return factors->size() - 1;
+}
+
+// A page of the pyramid, with how it is described and compressed.
+typedef struct {
+  VImage image;
+  AperioDescriptionType type;
+  unsigned tile_size;  // rows per strip of striped pages.
+  PageType page_type;
+  TileCompression compression;
+  std::optional<int> quality;
+  const char *kind;  // in the stats.
+  TIFF *source;  // on the page its tiles are copied from, or nullptr.
+} PyramidPage;
+
+// Sets the ImageDescription of `page`, only the native layer and the
+// thumbnail carry the metadata.
+static void describe_page(const PyramidPage &page, uint32_t native_width,
+                          uint32_t native_height, const Metadata &metadata, TIFF *out) {
+  std::optional<Metadata> page_metadata;
+  if (page.type != AperioDescriptionType::kSubLayer)
+    page_metadata = metadata;
+  aperio_describe_layer(page.type, page.image, native_width, native_height,
+                        page.tile_size, page.compression, page.quality,
+                        page_metadata, out);
+}
+
+// Writes the directories of `pages` first, in their order, with room for
+// their tile arrays right after them. The tiles follow, those of the
+// smallest pages first, and the arrays are filled in place as each page is
+// done. `*tiff` is reopened for that, and may be left null on failure.
+static bool write_viewer_layout(const std::vector<PyramidPage> &pages,
+                                uint32_t native_width, uint32_t native_height,
+                                const Metadata &metadata, EncodingContext *context,
+                                OutputSink *out, TIFF **tiff, EncodingStats *stats) {
+  for (const PyramidPage &page : pages) {
+    describe_page(page, native_width, native_height, metadata, *tiff);
+    bool ok = page.source && copy_page_tags(page.source, *tiff);
+    if (!page.source) {
+      const std::unique_ptr<TileCodec> codec = make_tile_codec(codec_settings(
+        *context, page.compression, page.quality.value_or(DEFAULT_JPEG_QUALITY)));
+      ok = codec && setup_page(page.image.width(), page.image.height(), page.tile_size,
+                               page.page_type, *codec, *tiff);
+    }
+    // The arrays are only part of the directory once they are set up.
+    if (!ok || !TIFFDeferStrileArrayWriting(*tiff) ||
+        !TIFFWriteCheck(*tiff, page.page_type == PageType::kTiled, "write_viewer_layout") ||
+        !TIFFWriteDirectory(*tiff))
+      return false;
+  }
+
+  // libtiff only fills deferred arrays in directories it reads back.
+  TIFFClose(*tiff);
+  *tiff = open_tiff_sink(out, "svs", "r+");
+  if (!*tiff)
+    return false;
+  for (size_t i = 0; i < pages.size(); ++i)
+    if (!TIFFSetDirectory(*tiff, i) || !TIFFForceStrileArrayWriting(*tiff))
+      return false;
+
+  std::vector<size_t> order(pages.size());
+  std::iota(order.begin(), order.end(), 0);
+  auto pixels = [&pages](size_t i) {
+    return static_cast<uint64_t>(pages[i].image.width()) * pages[i].image.height();
+  };
+  std::stable_sort(order.begin(), order.end(),
+                   [&pixels](size_t a, size_t b) { return pixels(a) < pixels(b); });
 
-  VipsImageTileGenerator tiles(cached, tile_width, tile_size);
-  for (const std::optional<Tile> &tile : tiles) {
-    assert(tile);
-    const Buffer &buffer = (*tile).buffer;
-    const unsigned index = (*tile).index;
-    if (page_type == PageType::kTiled)
-      TIFFWriteEncodedTile(out, index, buffer.data.get(), buffer.size);
-    else
-      TIFFWriteEncodedStrip(out, index, buffer.data.get(), buffer.size);
+  context->directory_written = true;
+  bool ok = true;
+  for (size_t i = 0; ok && i < order.size(); ++i) {
+    const PyramidPage &page = pages[order[i]];
+    context->page = order[i] + 1;
+    PageStats *page_stats = nullptr;
+    if (stats) {
+      stats->pages.push_back({});
+      page_stats = &stats->pages.back();
+      page_stats->kind = page.kind;
+    }
+    ok = TIFFSetDirectory(*tiff, order[i]) &&
+      (page.source
+       ? copy_page(page.source, *context, *tiff, page_stats)
+       : write_page(page.image, page.tile_size, page.compression, page.quality,
+                    page.page_type, *context, *tiff, nullptr, page_stats));
   }
-  TIFFWriteDirectory(out);
+  context->directory_written = false;
+  return ok;
+}
+
+// Checks that the current page of `source` holds the tiles of `in`, in a
+// way an Aperio pyramid can store as they are, and reads how they are
+// compressed.
+static bool check_transcode_source(TIFF *source, const VImage &in,
+                                   TileCompression *compression,
+                                   std::optional<int> *quality) {
+  uint32_t width = 0, height = 0, tile_width = 0, tile_height = 0;
+  uint16_t samples = 0, bits = 0, planar = PLANARCONFIG_CONTIG, tiff_compression = 0;
+  TIFFGetField(source, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetField(source, TIFFTAG_IMAGELENGTH, &height);
+  TIFFGetField(source, TIFFTAG_TILEWIDTH, &tile_width);
+  TIFFGetField(source, TIFFTAG_TILELENGTH, &tile_height);
+  TIFFGetFieldDefaulted(source, TIFFTAG_SAMPLESPERPIXEL, &samples);
+  TIFFGetFieldDefaulted(source, TIFFTAG_BITSPERSAMPLE, &bits);
+  TIFFGetFieldDefaulted(source, TIFFTAG_PLANARCONFIG, &planar);
+  TIFFGetFieldDefaulted(source, TIFFTAG_COMPRESSION, &tiff_compression);
+  if (!TIFFIsTiled(source) || !tile_width || tile_width != tile_height) {
+    fprintf(stderr, "The transcoded page is not made of square tiles.\n");
+    return false;
+  }
+  if (samples != 3 || bits != 8 || planar != PLANARCONFIG_CONTIG) {
+    fprintf(stderr, "The transcoded page is not 8-bit RGB.\n");
+    return false;
+  }
+  if (width != static_cast<uint32_t>(in.width()) ||
+      height != static_cast<uint32_t>(in.height())) {
+    fprintf(stderr, "The transcoded page is %ux%u, but was decoded as %dx%d.\n",
+            width, height, in.width(), in.height());
+    return false;
+  }
+  if (!tile_compression_from_tiff(tiff_compression, compression)) {
+    fprintf(stderr, "The transcoded page uses compression %u, unknown to Aperio readers.\n",
+            tiff_compression);
+    return false;
+  }
+
+  // Aperio descriptions give the quality of lossy layers.
+  const char *description = nullptr;
+  quality->reset();
+  if (TIFFGetField(source, TIFFTAG_IMAGEDESCRIPTION, &description)) {
+    const char *position = strstr(description, " Q=");
+    if (position)
+      *quality = atoi(position + 3);
+  }
+  return true;
 }
 
 // In case we need to implement some specific conversions.
@@ -179,18 +890,178 @@ static bool SvsMetadata2StringsMap(const SvsMetadata &data, Metadata *out) {
   return true;
 }
 
-bool vips2svs_encoder(const VImage &in, const char *svs_out_filepath,
-                      const std::vector<double> &scalings, SvsMetadata svs_metadata) {
-  // Create our svs file
-  errno = 0;
-  TIFF* tiff = TIFFOpen(svs_out_filepath, "w");
-  if (!tiff) {
-    perror("TIFFOpen()");
+// Compression of the `layer`-th tiled layer, the native one being 0.
+static TileCompression layer_compression(const SvsEncoderOptions &options, size_t layer) {
+  if (options.compressions.empty())
+    return TileCompression::kJpeg;
+  return options.compressions[std::min(layer, options.compressions.size() - 1)];
+}
+
+EncodingContext encoding_context(const SvsEncoderOptions &options) {
+  EncodingContext context = {};
+  context.num_threads = options.threads.value_or(default_num_workers());
+  context.max_in_memory_level = MAX_IN_MEMORY_LEVEL_SIZE;
+  if (options.max_memory) {
+    // Materialized levels get a quarter of the budget and tiles half of it,
+    // the rest is left to libvips' buffers and the rasterizer.
+    const uint64_t budget = *options.max_memory;
+    context.max_in_memory_level = std::min<uint64_t>(MAX_IN_MEMORY_LEVEL_SIZE, budget / 4);
+    const uint64_t tiles = budget / 2 / TILE_BYTES;
+    // Fewer threads rather than no cached tile left for each.
+    context.num_threads = std::clamp<uint64_t>(tiles / (TILES_PER_WORKER + 1), 1,
+                                               context.num_threads);
+    const uint64_t held = static_cast<uint64_t>(context.num_threads) * TILES_PER_WORKER;
+    context.tile_cache_bytes =
+      std::max<uint64_t>(tiles > held ? tiles - held : 0, context.num_threads) * TILE_BYTES;
+  }
+  context.max_tiles_in_flight =
+    options.max_tiles_in_flight.value_or(context.num_threads * TILES_IN_FLIGHT_PER_WORKER);
+  context.dedup = options.dedup.value_or(true);
+  context.encoder = options.encoder.value_or(TileEncoderType::kLibjpeg);
+  context.optimize_coding = options.optimize_coding.value_or(false);
+  context.colorspace = options.jpeg_colorspace.value_or(JpegColorspace::kYCbCr);
+  context.journal = options.journal;
+  context.tile_order = options.tile_order.value_or(TileOrder::kRowMajor);
+  return context;
+}
+
+// Rejects the options `in` cannot be encoded with, before the output is
+// created: an existing file must not be truncated by a conversion that
+// cannot start.
+static bool check_encoder_options(const VImage &in, const std::vector<double> &scalings,
+                                  const SvsEncoderOptions &options) {
+  const bool sequential = options.sequential.value_or(false);
+  const bool viewer_layout = options.viewer_layout.value_or(false);
+  const EncodingContext context = encoding_context(options);
+
+  // Every layer of a sequential input comes from its single read.
+  if (sequential && options.journal) {
+    fprintf(stderr, "Sequential inputs cannot be resumed.\n");
+    return false;
+  }
+  if (sequential && !PyramidBuilder::Supports(scalings)) {
+    fprintf(stderr, "Sequential inputs need integral layers factors.\n");
+    return false;
+  }
+  // The viewer layout writes the native layer last, and fills the tile
+  // arrays of directories already in the file.
+  if (viewer_layout && (sequential || options.journal)) {
+    fprintf(stderr, "The viewer layout cannot be written from sequential inputs or resumed.\n");
+    return false;
+  }
+  if (viewer_layout && context.encoder == TileEncoderType::kLibtiff) {
+    fprintf(stderr, "The viewer layout needs tiles compressed by our encoders.\n");
     return false;
   }
 
+  if (options.transcode_from) {
+    if (sequential || options.journal) {
+      fprintf(stderr, "Transcoded slides cannot be read sequentially or resumed.\n");
+      return false;
+    }
+    const char *path = options.transcode_from->c_str();
+    std::unique_ptr<TIFF, decltype(&TIFFClose)> source(TIFFOpen(path, "r"), TIFFClose);
+    TileCompression compression;
+    std::optional<int> quality;
+    if (!source || !check_transcode_source(source.get(), in, &compression, &quality)) {
+      fprintf(stderr, "%s: its native tiles cannot be copied.\n", path);
+      return false;
+    }
+  }
+
+  // Copied native tiles need no codec.
+  for (size_t i = options.transcode_from ? 1 : 0; i <= scalings.size(); ++i)
+    if (!make_tile_codec(codec_settings(context, layer_compression(options, i),
+                                        DEFAULT_JPEG_QUALITY)))
+      return false;
+  return true;
+}
+
+// Encodes the pyramid of `in` into `out`, with options already checked.
+static bool encode_svs(const VImage &in, OutputSink *out,
+                       const std::vector<double> &scalings, SvsMetadata svs_metadata,
+                       const SvsEncoderOptions &options, EncodingStats *stats) {
   // native layer, subsampling layers and a thumbnail
   const int kNativeJpegQuality = plateau(1);
+  const auto start = std::chrono::steady_clock::now();
+  const bool sequential = options.sequential.value_or(false);
+  const bool viewer_layout = options.viewer_layout.value_or(false);
+
+  EncodingContext context = encoding_context(options);
+  // Numbers the next page, and appends its measurements when they are
+  // requested.
+  auto next_page = [stats, &context](const char *kind) -> PageStats * {
+    ++context.page;
+    if (!stats)
+      return nullptr;
+    stats->pages.push_back({});
+    stats->pages.back().kind = kind;
+    return &stats->pages.back();
+  };
+  if (options.on_progress)
+    context.on_progress = [&options, &context](unsigned done, unsigned total) {
+      options.on_progress(context.page, done, total);
+    };
+
+  // Native tiles are copied from the first page of the source as they are.
+  std::unique_ptr<TIFF, decltype(&TIFFClose)> source(nullptr, TIFFClose);
+  TileCompression native_compression = layer_compression(options, 0);
+  std::optional<int> native_quality = kNativeJpegQuality;
+  unsigned native_tile_size = TILE_SIZE;
+  std::optional<uint64_t> copied_size;
+  if (options.transcode_from) {
+    const char *path = options.transcode_from->c_str();
+    source.reset(TIFFOpen(path, "r"));
+    if (!source ||
+        !check_transcode_source(source.get(), in, &native_compression, &native_quality)) {
+      fprintf(stderr, "%s: its native tiles cannot be copied.\n", path);
+      return false;
+    }
+    TIFFGetField(source.get(), TIFFTAG_TILEWIDTH, &native_tile_size);
+    // Tiles stored once in the source are copied once.
+    std::set<uint64_t> offsets;
+    copied_size = 0;
+    for (uint32_t i = 0; i < TIFFNumberOfTiles(source.get()); ++i)
+      if (offsets.insert(TIFFGetStrileOffset(source.get(), i)).second)
+        *copied_size += TIFFGetStrileByteCount(source.get(), i);
+  }
+
+  // Decide on the offsets size before anything is written.
+  bool bigtiff = options.bigtiff.value_or(false);
+  const bool preallocate = options.preallocate.value_or(false);
+  if (!options.bigtiff || preallocate) {
+    // Transcoding only encodes the sublayers, sampled with their compression.
+    const uint64_t estimated_size = estimate_svs_size(
+      in, scalings,
+      codec_settings(context, layer_compression(options, source ? 1 : 0), kNativeJpegQuality),
+      !sequential, copied_size);
+    if (preallocate)
+      out->Reserve(estimated_size);
+    if (!options.bigtiff) {
+      bigtiff = estimated_size > BIGTIFF_THRESHOLD;
+      // Copies of a BigTIFF's tiles stay in a BigTIFF.
+      if (source && TIFFIsBigTIFF(source.get()))
+        bigtiff = true;
+      else if (bigtiff)
+        fprintf(stderr, "Estimated output size is %.1f GiB, writing a BigTIFF.\n",
+                estimated_size / static_cast<double>(1ULL << 30));
+    }
+  }
+
+  // A resumed file keeps the offsets it was started with.
+  if (options.journal) {
+    if (options.journal->bigtiff())
+      bigtiff = *options.journal->bigtiff();
+    else if (!options.journal->SetBigTiff(bigtiff))
+      return false;
+  }
+
+  // Create our svs file
+  TIFF* tiff = open_tiff_sink(out, "svs", bigtiff ? "w8" : "w");
+  if (!tiff) {
+    fprintf(stderr, "Could not start the svs file.\n");
+    return false;
+  }
 
   const uint32_t native_width = in.width();
   const uint32_t native_height = in.height();
@@ -198,49 +1069,159 @@ bool vips2svs_encoder(const VImage &in, const char *svs_out_filepath,
   Metadata metadata = {};
   if (!SvsMetadata2StringsMap(svs_metadata, &metadata)) {
     fprintf(stderr, "Could not encode metadata.");
+    TIFFClose(tiff);
     return false;
   }
 
 #ifdef WITH_SPINNER
-  spinner = new spinners::Spinner();
-  arm_signal_handler();
-  spinner->Start();
+  // Concurrent conversions cannot share the terminal.
+  if (options.progress.value_or(true)) {
+    spinner = new spinners::Spinner();
+    arm_signal_handler();
+    spinner->Start();
+    context.spinner = spinner;
+  }
 #endif
 
+  const double thumbnail_scale = (native_height > native_width)
+    ? 768.0 / native_height
+    : 1024.0 / native_width;
+
+  // Single pass pyramids are accumulated while the native layer is written.
+  std::unique_ptr<PyramidBuilder> pyramid;
+  std::optional<size_t> thumbnail_level;
+  // Copied native tiles are not decoded again, each layer is decoded once
+  // to build the next one.
+  bool cascade = options.cascade.value_or(false) || source;
+  if (options.single_pass.value_or(false) || sequential) {
+    if (source) {
+      fprintf(stderr, "Transcoded slides cascade their layers, not in a single pass.\n");
+    } else if (options.journal) {
+      // Tiles kept from an interrupted conversion are never read again.
+      fprintf(stderr, "Resumable conversions resample each layer, not in a single pass.\n");
+    } else if (viewer_layout) {
+      // Its layers are written before the native one they would come from.
+      fprintf(stderr, "The viewer layout resamples each layer, not in a single pass.\n");
+    } else if (PyramidBuilder::Supports(scalings)) {
+      std::vector<unsigned> factors(scalings.begin(), scalings.end());
+      thumbnail_level = add_thumbnail_factor(thumbnail_scale, &factors);
+      pyramid.reset(new PyramidBuilder(native_width, native_height, TILE_SIZE, factors,
+                                       context.max_in_memory_level));
+    } else {
+      fprintf(stderr, "Single pass needs integral factors, cascading layers instead.\n");
+      cascade = true;
+    }
+  }
+
+  // A thumbnail taken from the native layer needs it twice. It is then
+  // small enough to be read into memory.
+  VImage native = in;
+  if (sequential && !thumbnail_level)
+    native = in.copy_memory();
+
+  // Pages are written as they come, or all at once in the viewer layout.
+  std::vector<PyramidPage> pages;
+  auto add_page = [&](const PyramidPage &page, PyramidBuilder *builder) {
+    if (viewer_layout) {
+      pages.push_back(page);
+      return true;
+    }
+    describe_page(page, native_width, native_height, metadata, tiff);
+    if (page.source)
+      return copy_page(page.source, context, tiff, next_page(page.kind));
+    return write_page(page.image, page.tile_size, page.compression, page.quality,
+                      page.page_type, context, tiff, builder, next_page(page.kind));
+  };
+
   // Generate first tiff directory.
-  aperio_describe_layer(AperioDescriptionType::kNativeLayer,
-                        in, native_width, native_height, TILE_SIZE,
-                        kNativeJpegQuality, metadata, tiff);
-  write_page(in, TILE_SIZE, kNativeJpegQuality, PageType::kTiled, tiff);
+  context.sequential = sequential && thumbnail_level;
+  bool ok = add_page({native, AperioDescriptionType::kNativeLayer, native_tile_size,
+                      PageType::kTiled, native_compression, native_quality, "native",
+                      source.get()},
+                     pyramid.get());
+  context.sequential = false;
 
-  // Generate the thumbnail.
-  {
-    const double scale_factor = (native_height > native_width)
-      ? 768.0 / native_height
-      : 1024.0 / native_width;
-    VImage thumbnail = in.resize(scale_factor);
-    aperio_describe_layer(AperioDescriptionType::kThumbnailLayer,
-                          thumbnail, native_width, native_height, {},
-                          {}, metadata, tiff);
+  // Sublayers are either resampled lazily from the native image, cascaded
+  // from one another or already built alongside the native layer.
+  std::vector<VImage> layers;
+  if (ok && pyramid) {
+    ok = pyramid->Finish();
+    for (size_t i = 0; ok && i < scalings.size(); ++i)
+      layers.push_back(pyramid->Layer(i));
+  } else if (ok && cascade) {
+#ifdef WITH_SPINNER
+    if (context.spinner)
+      context.spinner->SetText("Cascading pyramid layers");
+#endif
+    layers = cascade_layers(in, scalings, context.max_in_memory_level);
+  } else if (ok) {
+    for (const double scaling : scalings)
+      layers.push_back(downsample(in, scaling));
+  }
 
-    write_page(thumbnail, 16, {}, PageType::kStriped, tiff);
+  // Generate the thumbnail.
+  if (ok) {
+    // Start from the smallest layer that is still larger than the thumbnail.
+    VImage thumbnail_source = native;
+    if (pyramid && thumbnail_level)
+      thumbnail_source = pyramid->Layer(*thumbnail_level);
+    for (size_t i = 0; i < layers.size() && cascade && !pyramid; ++i)
+      if (thumbnail_scale * scalings[i] <= 1.0)
+        thumbnail_source = layers[i];
+    VImage thumbnail = resize_to(thumbnail_source, downscaled(native_width, 1 / thumbnail_scale),
+                                           downscaled(native_height, 1 / thumbnail_scale));
+    // Like Aperio's, the thumbnail is always a JPEG.
+    ok = add_page({thumbnail, AperioDescriptionType::kThumbnailLayer, 16,
+                   PageType::kStriped, TileCompression::kJpeg, {}, "thumbnail", nullptr},
+                  nullptr);
   }
 
-  for (size_t i = 0; i < scalings.size(); ++i) {
-    VImage new_layer = in.resize(1 / scalings[i]);
-    const int jpeg_quality = plateau(i + 2);
-    aperio_describe_layer(AperioDescriptionType::kSubLayer,
-                          new_layer, native_width, native_height, TILE_SIZE,
-                          jpeg_quality, {}, tiff);
+  for (size_t i = 0; ok && i < layers.size(); ++i)
+    ok = add_page({layers[i], AperioDescriptionType::kSubLayer, TILE_SIZE,
+                   PageType::kTiled, layer_compression(options, i + 1),
+                   plateau(i + 2), "sublayer", nullptr},
+                  nullptr);
 
-    write_page(new_layer, TILE_SIZE, jpeg_quality, PageType::kTiled, tiff);
-  }
+  if (ok && viewer_layout)
+    ok = write_viewer_layout(pages, native_width, native_height, metadata, &context,
+                             out, &tiff, stats);
 
 #ifdef WITH_SPINNER
-  spinner->Stop();
+  if (context.spinner)
+    context.spinner->Stop();
 #endif
 
   // Close the file
-  TIFFClose(tiff);
-  return true;
+  if (tiff)
+    TIFFClose(tiff);
+
+  if (stats) {
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    stats->total_seconds = elapsed.count();
+    stats->peak_rss_bytes = peak_rss_bytes();
+  }
+  return ok;
+}
+
+bool vips2svs_encoder(const VImage &in, OutputSink *out,
+                      const std::vector<double> &scalings, SvsMetadata svs_metadata,
+                      const SvsEncoderOptions &options, EncodingStats *stats) {
+  return check_encoder_options(in, scalings, options) &&
+         encode_svs(in, out, scalings, svs_metadata, options, stats);
+}
+
+bool vips2svs_encoder(const VImage &in, const char *svs_out_filepath,
+                      const std::vector<double> &scalings, SvsMetadata svs_metadata,
+                      const SvsEncoderOptions &options, EncodingStats *stats) {
+  // Fail before creating, or truncating, the file.
+  if (!check_encoder_options(in, scalings, options))
+    return false;
+  // libtiff writes each tile, and each directory entry, on its own.
+  std::unique_ptr<OutputSink> sink = open_file_sink(
+    svs_out_filepath, options.write_buffer_size.value_or(DEFAULT_WRITE_BUFFER_SIZE),
+    options.direct_io.value_or(false));
+  if (!sink)
+    return false;
+  const bool ok = encode_svs(in, sink.get(), scalings, svs_metadata, options, stats);
+  return sink->Close() && ok;
 }
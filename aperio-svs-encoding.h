@@ -13,6 +13,7 @@
 // limitations under the License.
 #ifndef __APERIO_SVS_ENCODING_H_
 #define __APERIO_SVS_ENCODING_H_
+#include <functional>
 #include <map>
 #include <optional>
 #include <string>
@@ -20,12 +21,68 @@
 #include <vips/vips.h>
 #include <vips/vips8>
 
+#include "encoding-stats.h"
+#include "output-sink.h"
+#include "tile-encoder.h"
+#include "tile-order.h"
+
+class ConversionJournal;
+
 // Set of supported svs Aperio metadata.
 typedef struct {
   std::optional<double> mpp;  // microns per pixel.
   std::optional<int> app_mag;  // apparent magnification.
 } SvsMetadata;
 
+// Tuning of the encoding process, unset values pick sensible defaults.
+typedef struct {
+  std::optional<unsigned> threads;  // tile encoding workers, one per core by default.
+  std::optional<unsigned> max_tiles_in_flight;  // bounds the tiles held in memory.
+  // Bytes the encoding may hold, libvips' operation cache aside. Threads,
+  // tiles in flight, tile caches and in-memory levels are sized to fit.
+  // Unbounded by default.
+  std::optional<uint64_t> max_memory;
+  std::optional<bool> cascade;  // build each sublayer from the previous one.
+  std::optional<bool> single_pass;  // build all sublayers while writing the native one.
+  // The input can only be read once, top to bottom, like a file opened with
+  // sequential access. Implies a single pass, with integral factors.
+  std::optional<bool> sequential;
+  std::optional<bool> bigtiff;  // 64-bit offsets, picked from the estimated size by default.
+  std::optional<bool> dedup;  // store identical tiles once, enabled by default.
+  std::optional<TileEncoderType> encoder;  // libjpeg by default.
+  std::optional<bool> optimize_coding;  // optimal Huffman tables for each tile.
+  std::optional<JpegColorspace> jpeg_colorspace;  // YCbCr 4:2:0 by default.
+  // Compression of each tiled layer, native first. The last one also applies
+  // to the remaining layers, JPEG by default. The thumbnail is always JPEG.
+  std::vector<TileCompression> compressions;
+  // Spinner on the terminal, enabled by default. Must be disabled when
+  // several pyramids are encoded at once.
+  std::optional<bool> progress;
+  // Called from the thread writing the file as the tiles of each page are
+  // written, pages numbered from 1.
+  std::function<void(unsigned page, unsigned done, unsigned total)> on_progress;
+  // Every directory and tile array at the start of the file, then the tiles
+  // of the smallest pages first, directories staying in Aperio's order. A
+  // viewer gets the thumbnail and the lower levels from the first bytes.
+  // Tiles must be compressed by our encoders, the layers are resampled.
+  std::optional<bool> viewer_layout;
+  // Copies the compressed tiles of the native layer, and what decoding them
+  // needs, from the first page of this tiled TIFF instead of encoding `in`,
+  // which must be its decoded pixels, e.g. when `in` was loaded from an
+  // existing slide. Only the sublayers and the thumbnail are computed, each
+  // from the previous layer.
+  std::optional<std::string> transcode_from;
+  std::optional<TileOrder> tile_order;  // within each tiled layer, row major by default.
+  std::optional<bool> preallocate;  // reserve the estimated size of the output up front.
+  // Output files only.
+  std::optional<size_t> write_buffer_size;  // coalesces writes, 4MiB by default.
+  std::optional<bool> direct_io;  // bypass the page cache for full buffers.
+  // When set, tiles an interrupted conversion already wrote to the output
+  // are kept and the others recorded. The output must be continued from
+  // the journal's checkpoint.
+  ConversionJournal *journal;
+} SvsEncoderOptions;
+
 // Encodes a generic vips in .svs format.
 // libvips already supports pyramidal formats, but
 // is impossible to customize its behavior.
@@ -35,7 +92,19 @@ typedef struct {
 // for a value of 4.0, the resulting image width and height
 // will be multiplied by 1 / 4.0 to compute the resulting layer size.
 // `metadata` are any additional supported metadata that you want to include.
+// `options` tunes how the pyramid is produced and compressed.
+// `stats`, when set, receives where the time of each page went.
 bool vips2svs_encoder(const vips::VImage &in, const char *svs_out_filepath,
                       const std::vector<double> &scalings,
-                      SvsMetadata svs_metadata);
+                      SvsMetadata svs_metadata,
+                      const SvsEncoderOptions &options = {},
+                      EncodingStats *stats = nullptr);
+
+// Same, writing to `out` instead of a file, e.g. a MemorySink to get the
+// svs as bytes. `out` is not closed.
+bool vips2svs_encoder(const vips::VImage &in, OutputSink *out,
+                      const std::vector<double> &scalings,
+                      SvsMetadata svs_metadata,
+                      const SvsEncoderOptions &options = {},
+                      EncodingStats *stats = nullptr);
 #endif // __APERIO_SVS_ENCODING_H_
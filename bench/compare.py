@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# Copyright 2021 Ellogon BV.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compare benchmark results against a stored baseline.
+
+Both files are the JSON written by conversion-bench --json. Exits with a
+non-zero status when a benchmark got slower than the tolerance allows.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path: str) -> dict:
+    """Map benchmark names to their results."""
+    with open(path) as f:
+        return {b['name']: b for b in json.load(f)['benchmarks']}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('baseline', help='Stored results.')
+    parser.add_argument('current', help='Results to check.')
+    parser.add_argument('--tolerance', type=float, default=0.10,
+                        help='Accepted slowdown, as a fraction of the baseline (default 0.10).')
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+
+    regressions = 0
+    print(f'{"benchmark":40} {"baseline MB/s":>14} {"current MB/s":>14} {"change":>8}')
+    for name, result in current.items():
+        if name not in baseline:
+            print(f'{name:40} {"-":>14} {result["mb_per_second"]:14.1f} {"new":>8}')
+            continue
+        before = baseline[name]['mb_per_second']
+        after = result['mb_per_second']
+        change = (after - before) / before if before else 0.0
+        slower = change < -args.tolerance
+        regressions += slower
+        print(f'{name:40} {before:14.1f} {after:14.1f} {change:+8.1%}{"  SLOWER" if slower else ""}')
+
+    if regressions:
+        print(f'{regressions} benchmark(s) slower than the baseline.', file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,255 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks the conversion hot paths on rasterized fixtures, e.g. the
+// outputs of generate_svg_checkerboard.py:
+//   rasterize/  svg rendering at the base width, with svgload and, when
+//               built with librsvg, on every thread.
+//   extract/    reading every native tile with VipsImageTileGenerator.
+//   page/       write_page, for a tiled and for a striped page.
+//   encode/     a whole vips2svs_encoder run with the default pyramid.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <tiffio.h>
+#include <vips/vips8>
+
+#include "../utils.h"
+#include "../aperio-svs-encoding.h"
+#include "../box-downsampler.h"
+#include "../page-writer.h"
+#ifdef WITH_RSVG
+#include "../svg-rasterizer.h"
+#endif
+#include "../tile-generator.h"
+#include "../tile-pipeline.h"
+#include "harness.h"
+
+using namespace vips;
+
+#define TILE_SIZE 256
+// Factor of the downsampling cases, the first sublayer's by default.
+#define DOWNSAMPLE_FACTOR 4
+
+typedef struct {
+  std::string name;
+  std::string path;
+  int base_width;
+  VImage image;  // rasterized once, in memory.
+  bool rasterized;
+} Fixture;
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [--json <path>] [--filter <substring>] [--min-seconds <s>] "
+          "<fixture-svg>:<base-width> [...]\n", prog);
+  return 1;
+}
+
+static VImage rasterize(const Fixture &fixture) {
+  const double default_width = VImage::svgload(fixture.path.c_str()).width();
+  VImage in = VImage::svgload(
+    fixture.path.c_str(), VImage::option()
+    ->set("dpi", fixture.base_width * 72 / default_width)
+    ->set("unlimited", true));
+  if (in.has_alpha())
+    in = in.extract_band(0, VImage::option()->set("n", 3));
+  return in.copy_memory();
+}
+
+#ifdef WITH_RSVG
+static bool rasterize_threaded(const Fixture &fixture, VImage *out) {
+  std::ifstream file(fixture.path, std::ios::binary);
+  std::ostringstream svg;
+  svg << file.rdbuf();
+  std::unique_ptr<ThreadedSvg> document = ThreadedSvg::Parse(svg.str(), fixture.path.c_str());
+  VImage in;
+  if (!document ||
+      !document->Render(fixture.base_width * 72 / document->width(), &in))
+    return false;
+  *out = in.copy_memory();
+  return true;
+}
+#endif
+
+// The image of `fixture`, rasterized on first use.
+static const VImage &fixture_image(Fixture *fixture) {
+  if (!fixture->rasterized) {
+    fixture->image = rasterize(*fixture);
+    fixture->rasterized = true;
+  }
+  return fixture->image;
+}
+
+static BenchWork image_work(const VImage &image) {
+  const uint64_t tiles = partition(image.width(), TILE_SIZE) *
+    static_cast<uint64_t>(partition(image.height(), TILE_SIZE));
+  return {tiles, static_cast<uint64_t>(image.width()) * image.height() * 3};
+}
+
+static std::string scratch_path() {
+  const char *tmpdir = getenv("TMPDIR");
+  return std::string(tmpdir ? tmpdir : "/tmp") + "/conversion-bench-" +
+    std::to_string(getpid()) + ".svs";
+}
+
+static void add_fixture_cases(BenchHarness *harness, Fixture *fixture) {
+  const std::string output = scratch_path();
+  const std::string suffix = "/" + fixture->name;
+
+  harness->Add("rasterize" + suffix, [fixture](BenchWork *work) {
+    fixture->image = rasterize(*fixture);
+    fixture->rasterized = true;
+    *work = image_work(fixture->image);
+    return true;
+  });
+
+#ifdef WITH_RSVG
+  harness->Add("rasterize-threaded" + suffix, [fixture](BenchWork *work) {
+    VImage image;
+    if (!rasterize_threaded(*fixture, &image))
+      return false;
+    *work = image_work(image);
+    return true;
+  });
+#endif
+
+  harness->Add("extract" + suffix, [fixture](BenchWork *work) {
+    const VipsImageTileGenerator tiles(fixture_image(fixture), TILE_SIZE, TILE_SIZE);
+    VipsImageTileGenerator::Reader reader(tiles);
+    for (unsigned i = 0; i < tiles.size(); ++i) {
+      Tile tile;
+      if (!reader.Read(i, &tile))
+        return false;
+    }
+    *work = image_work(fixture->image);
+    return true;
+  });
+
+  // Sublayers reduced from the native layer in memory: libvips' resampler
+  // against the box kernel, through libvips and on its own with each
+  // instruction set, single threaded.
+  const std::string factor = "-x" + std::to_string(DOWNSAMPLE_FACTOR);
+  harness->Add("downsample/resize" + factor + suffix, [fixture](BenchWork *work) {
+    fixture_image(fixture).resize(1.0 / DOWNSAMPLE_FACTOR).copy_memory();
+    *work = image_work(fixture->image);
+    return true;
+  });
+  harness->Add("downsample/box" + factor + suffix, [fixture](BenchWork *work) {
+    box_shrink(fixture_image(fixture), DOWNSAMPLE_FACTOR).copy_memory();
+    *work = image_work(fixture->image);
+    return true;
+  });
+  const BoxKernel kernels[] = { BoxKernel::kScalar, BoxKernel::kSse2, BoxKernel::kAvx2 };
+  for (const BoxKernel kernel : kernels) {
+    if (!box_kernel_supported(kernel))
+      continue;
+    harness->Add(std::string("downsample/kernel-") + box_kernel_name(kernel) + factor + suffix,
+                 [fixture, kernel](BenchWork *work) {
+      const VImage &image = fixture_image(fixture);
+      const unsigned width = image.width();
+      const unsigned height = image.height();
+      const size_t stride = static_cast<size_t>(width) * 3;
+      std::vector<uint8_t> out(partition(width, DOWNSAMPLE_FACTOR) * 3 *
+                               static_cast<size_t>(partition(height, DOWNSAMPLE_FACTOR)));
+      box_downsample(static_cast<const uint8_t *>(VIPS_IMAGE_ADDR(image.get_image(), 0, 0)),
+                     stride, width, height, DOWNSAMPLE_FACTOR, out.data(),
+                     partition(width, DOWNSAMPLE_FACTOR) * 3, kernel);
+      *work = image_work(image);
+      return true;
+    });
+  }
+
+  const PageType page_types[] = { PageType::kTiled, PageType::kStriped };
+  for (const PageType page_type : page_types) {
+    const bool tiled = page_type == PageType::kTiled;
+    harness->Add(std::string(tiled ? "page/tiled" : "page/striped") + suffix,
+                 [fixture, page_type, tiled, output](BenchWork *work) {
+      EncodingContext context = {};
+      context.num_threads = default_num_workers();
+      context.max_tiles_in_flight = context.num_threads * 4;
+      context.dedup = true;
+      context.encoder = TileEncoderType::kLibjpeg;
+      context.colorspace = JpegColorspace::kYCbCr;
+      TIFF *out = TIFFOpen(output.c_str(), "w8");
+      if (!out)
+        return false;
+      const bool ok = write_page(fixture_image(fixture), tiled ? TILE_SIZE : 16,
+                                 TileCompression::kJpeg, {}, page_type, context, out);
+      TIFFClose(out);
+      unlink(output.c_str());
+      *work = image_work(fixture->image);
+      return ok;
+    });
+  }
+
+  harness->Add("encode" + suffix, [fixture, output](BenchWork *work) {
+    SvsEncoderOptions options = {};
+    options.progress = false;
+    const bool ok = vips2svs_encoder(fixture_image(fixture), output.c_str(), {4.0, 16.0, 64.0},
+                                     {}, options);
+    unlink(output.c_str());
+    *work = image_work(fixture->image);
+    return ok;
+  });
+}
+
+int main(int argc, char *argv[]) {
+  const char *json = nullptr;
+  std::string filter;
+  double min_seconds = 1.0;
+  std::vector<Fixture> fixtures;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json = argv[++i];
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (strcmp(argv[i], "--min-seconds") == 0 && i + 1 < argc) {
+      min_seconds = atof(argv[++i]);
+    } else {
+      const std::string spec(argv[i]);
+      const size_t colon = spec.rfind(':');
+      if (colon == std::string::npos || atoi(spec.c_str() + colon + 1) <= 0)
+        return usage(argv[0]);
+      Fixture fixture = {};
+      fixture.path = spec.substr(0, colon);
+      fixture.base_width = atoi(spec.c_str() + colon + 1);
+      const size_t slash = fixture.path.rfind('/');
+      const std::string file = fixture.path.substr(slash == std::string::npos ? 0 : slash + 1);
+      fixture.name = file.substr(0, file.rfind('.')) + "@" + std::to_string(fixture.base_width);
+      fixtures.push_back(fixture);
+    }
+  }
+  if (fixtures.empty())
+    return usage(argv[0]);
+
+  if (VIPS_INIT(argv[0]))
+    vips_error_exit(nullptr);
+
+  // Cases capture their fixture, which must not move anymore.
+  BenchHarness harness(min_seconds, 1);
+  for (Fixture &fixture : fixtures)
+    add_fixture_cases(&harness, &fixture);
+
+  bool ok = harness.Run(filter);
+  if (json)
+    ok = harness.WriteJson(json) && ok;
+
+  vips_shutdown();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the tile encoder backends of vips2svs_encoder on a rasterized
+// fixture, e.g. the output of generate_svg_checkerboard.py.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vips/vips8>
+
+#include "../aperio-svs-encoding.h"
+
+using namespace vips;
+
+typedef struct {
+  const char *name;
+  TileEncoderType encoder;
+  unsigned threads;
+  bool optimize_coding;
+  JpegColorspace colorspace;
+} BenchCase;
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <fixture-svg> [<base-width>]\n", argv[0]);
+    return 1;
+  }
+  const int base_width = (argc > 2) ? atoi(argv[2]) : 16000;
+
+  if (VIPS_INIT(argv[0]))
+    vips_error_exit(nullptr);
+
+  // Rasterize once up front, only encoding is measured.
+  const double default_width = VImage::svgload(argv[1]).width();
+  VImage in = VImage::svgload(
+    argv[1], VImage::option()
+    ->set("dpi", base_width * 72 / default_width)
+    ->set("unlimited", true));
+  if (in.has_alpha())
+    in = in.extract_band(0, VImage::option()->set("n", 3));
+  in = in.copy_memory();
+
+  const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  const BenchCase cases[] = {
+    { "libtiff", TileEncoderType::kLibtiff, 1, false, JpegColorspace::kYCbCr },
+    { "libjpeg-1-thread", TileEncoderType::kLibjpeg, 1, false, JpegColorspace::kYCbCr },
+    { "libjpeg", TileEncoderType::kLibjpeg, cores, false, JpegColorspace::kYCbCr },
+    { "libjpeg-optimized", TileEncoderType::kLibjpeg, cores, true, JpegColorspace::kYCbCr },
+    { "libjpeg-rgb", TileEncoderType::kLibjpeg, cores, false, JpegColorspace::kRgb },
+  };
+
+  const std::string output = std::string(getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp") +
+    "/encoder-bench.svs";
+  const double megapixels = in.width() * static_cast<double>(in.height()) / 1e6;
+  printf("%-20s %8s %10s %12s %10s\n", "encoder", "threads", "seconds", "Mpixels/s", "MiB");
+  for (const BenchCase &bench : cases) {
+    SvsEncoderOptions options = {};
+    options.encoder = bench.encoder;
+    options.threads = bench.threads;
+    options.optimize_coding = bench.optimize_coding;
+    options.jpeg_colorspace = bench.colorspace;
+    // Deduplication would hide the cost of encoding.
+    options.dedup = false;
+
+    const auto start = std::chrono::steady_clock::now();
+    if (!vips2svs_encoder(in, output.c_str(), {}, {}, options)) {
+      fprintf(stderr, "%s failed.\n", bench.name);
+      return 1;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    struct stat st = {};
+    stat(output.c_str(), &st);
+    printf("%-20s %8u %10.3f %12.1f %10.2f\n", bench.name, bench.threads,
+           elapsed.count(), megapixels / elapsed.count(), st.st_size / 1048576.0);
+  }
+  unlink(output.c_str());
+
+  vips_shutdown();
+  return 0;
+}
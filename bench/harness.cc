@@ -0,0 +1,92 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <thread>
+#include <unistd.h>
+
+#include "harness.h"
+
+void BenchHarness::Add(const std::string &name, const Body &body) {
+  cases_.push_back({name, body});
+}
+
+bool BenchHarness::Run(const std::string &filter) {
+  bool ok = true;
+  results_.clear();
+  printf("%-40s %8s %12s %12s %10s\n", "benchmark", "iters", "ms/iter", "tiles/s", "MB/s");
+  for (const Case &bench : cases_) {
+    if (bench.name.find(filter) == std::string::npos)
+      continue;
+
+    unsigned iterations = 0;
+    BenchWork total = {};
+    std::chrono::duration<double> elapsed(0);
+    while (iterations < min_iterations_ || elapsed.count() < min_seconds_) {
+      BenchWork work = {};
+      const auto start = std::chrono::steady_clock::now();
+      if (!bench.body(&work)) {
+        fprintf(stderr, "%s failed.\n", bench.name.c_str());
+        ok = false;
+        break;
+      }
+      elapsed += std::chrono::steady_clock::now() - start;
+      total.tiles += work.tiles;
+      total.bytes += work.bytes;
+      ++iterations;
+    }
+    if (!iterations)
+      continue;
+
+    const double seconds = elapsed.count();
+    Result result = {bench.name, iterations, seconds / iterations,
+                     total.tiles / seconds, total.bytes / seconds / 1e6};
+    printf("%-40s %8u %12.3f %12.1f %10.1f\n", result.name.c_str(), result.iterations,
+           result.seconds * 1e3, result.tiles_per_second, result.mb_per_second);
+    fflush(stdout);
+    results_.push_back(result);
+  }
+  return ok;
+}
+
+void BenchHarness::Record(const std::string &name, unsigned iterations, double seconds,
+                          const BenchWork &work) {
+  results_.push_back({name, iterations, seconds / iterations, work.tiles / seconds,
+                      work.bytes / seconds / 1e6});
+}
+
+bool BenchHarness::WriteJson(const char *path) const {
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror(path);
+    return false;
+  }
+
+  char host[256] = {};
+  gethostname(host, sizeof(host) - 1);
+  fprintf(out, "{\n  \"context\": {\"host\": \"%s\", \"time\": %ld, \"num_cpus\": %u},\n",
+          host, static_cast<long>(time(nullptr)), std::thread::hardware_concurrency());
+  fprintf(out, "  \"benchmarks\": [\n");
+  for (size_t i = 0; i < results_.size(); ++i) {
+    const Result &result = results_[i];
+    fprintf(out, "    {\"name\": \"%s\", \"iterations\": %u, \"seconds\": %.6f, "
+            "\"tiles_per_second\": %.3f, \"mb_per_second\": %.3f}%s\n",
+            result.name.c_str(), result.iterations, result.seconds,
+            result.tiles_per_second, result.mb_per_second,
+            (i + 1 < results_.size()) ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+  return fclose(out) == 0;
+}
@@ -0,0 +1,72 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __BENCH_HARNESS_H_
+#define __BENCH_HARNESS_H_
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Work done by one iteration of a benchmark, to report throughputs.
+typedef struct {
+  uint64_t tiles;
+  uint64_t bytes;  // uncompressed pixels.
+} BenchWork;
+
+// A minimal benchmark runner: every case is repeated until it ran for
+// `min_seconds` and at least `min_iterations` times, and is reported with
+// its mean time per iteration, tiles/s and MB/s.
+class BenchHarness {
+public:
+  // Returns false when the iteration failed, which fails the whole case.
+  using Body = std::function<bool(BenchWork *work)>;
+
+  BenchHarness(double min_seconds, unsigned min_iterations)
+    : min_seconds_(min_seconds), min_iterations_(min_iterations) {}
+
+  void Add(const std::string &name, const Body &body);
+
+  // Runs the cases whose name contains `filter`, printing a table on stdout.
+  // Returns false when any case failed.
+  bool Run(const std::string &filter);
+
+  // Adds a case timed elsewhere, `work` being what all its iterations did
+  // in `seconds`, so that WriteJson reports it with the others.
+  void Record(const std::string &name, unsigned iterations, double seconds,
+              const BenchWork &work);
+
+  // Writes the results of the last run as JSON.
+  bool WriteJson(const char *path) const;
+
+private:
+  typedef struct {
+    std::string name;
+    Body body;
+  } Case;
+
+  typedef struct {
+    std::string name;
+    unsigned iterations;
+    double seconds;  // per iteration.
+    double tiles_per_second;
+    double mb_per_second;
+  } Result;
+
+  const double min_seconds_;
+  const unsigned min_iterations_;
+  std::vector<Case> cases_;
+  std::vector<Result> results_;
+};
+#endif // __BENCH_HARNESS_H_
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# Copyright 2021 Ellogon BV.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Measure the latency and throughput of an `svg2svs --serve` server.
+
+Sends the same fixture from several concurrent clients, e.g.
+  ./svg2svs --serve /tmp/svg2svs.sock &
+  bench/server-load.py bench/fixtures/checkerboard-5x5.svg -b 2048 -n 200 -c 8
+"""
+
+import argparse
+import json
+import os
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import svg2svs_client  # noqa: E402
+
+
+def percentile(values, fraction: float) -> float:
+    """Nearest rank percentile of sorted values."""
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('fixture', help='svg to convert.')
+    parser.add_argument('-S', '--socket', default='/tmp/svg2svs.sock')
+    parser.add_argument('-b', '--base-width', type=int, default=2048)
+    parser.add_argument('-n', '--requests', type=int, default=100)
+    parser.add_argument('-c', '--concurrency', type=int, default=4,
+                        help='Clients sending requests at once.')
+    parser.add_argument('--upload', action='store_true',
+                        help='Send the svg bytes instead of its path.')
+    parser.add_argument('--json', help='Also write the results to this file.')
+    args = parser.parse_args()
+
+    path = os.path.abspath(args.fixture)
+    with open(path, 'rb') as f:
+        svg = f.read() if args.upload else None
+
+    lock = threading.Lock()
+    remaining = [args.requests]
+    latencies, server_seconds, errors = [], [], {}
+
+    def client():
+        while True:
+            with lock:
+                if not remaining[0]:
+                    return
+                remaining[0] -= 1
+            start = time.perf_counter()
+            try:
+                seconds, _, _ = svg2svs_client.convert(
+                    args.socket, input_svg=None if svg else path, svg=svg,
+                    base_width=args.base_width)
+            except (OSError, svg2svs_client.ServerError) as error:
+                with lock:
+                    errors[str(error)] = errors.get(str(error), 0) + 1
+                continue
+            with lock:
+                latencies.append(time.perf_counter() - start)
+                server_seconds.append(seconds)
+
+    start = time.perf_counter()
+    threads = [threading.Thread(target=client) for _ in range(args.concurrency)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.perf_counter() - start
+
+    latencies.sort()
+    results = {
+        'requests': args.requests,
+        'concurrency': args.concurrency,
+        'completed': len(latencies),
+        'errors': errors,
+        'seconds': elapsed,
+        'requests_per_second': len(latencies) / elapsed,
+    }
+    if latencies:
+        results.update({
+            'latency_p50': percentile(latencies, 0.50),
+            'latency_p90': percentile(latencies, 0.90),
+            'latency_p99': percentile(latencies, 0.99),
+            'latency_max': latencies[-1],
+            'conversion_mean': sum(server_seconds) / len(server_seconds),
+        })
+    for key, value in results.items():
+        print(f'{key:20} {value:.4f}' if isinstance(value, float) else f'{key:20} {value}')
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+    sys.exit(1 if errors else 0)
+
+
+if __name__ == '__main__':
+    main()
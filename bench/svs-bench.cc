@@ -0,0 +1,510 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// Checks that a pyramid written by svg2svs is laid out as the encoder
+// intended, then times how its tiles read back: in the order they are
+// stored and at random, raw or decoded, from threads each opening the file.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <tiff.h>
+#include <tiffio.h>
+
+#include "../tile-encoder.h"
+#include "harness.h"
+
+// Reads of each random case, spread over the threads.
+#define DEFAULT_RANDOM_READS 1000
+
+// Rows per strip of the thumbnail, as write_page is asked for them.
+#define THUMBNAIL_ROWS_PER_STRIP 16
+
+static const char *aperio_header_prefix = "Aperio Image Library";
+
+// What the ImageDescription of a page says about it, e.g.
+// "16000x16000 (256x256) -> 4000x4000 JPEG/RGB Q=94".
+typedef struct {
+  std::string header;
+  uint32_t native_width;
+  uint32_t native_height;
+  std::optional<uint32_t> tile_size;
+  std::optional<uint32_t> width;  // of the page, unless it is the native one.
+  std::optional<uint32_t> height;
+  std::string compression;  // "-" for the thumbnail.
+  std::optional<int> quality;
+  bool metadata;  // followed by ";Mirax Digital Slide|...".
+} AperioDescription;
+
+// A page as stored in the file.
+typedef struct {
+  uint16_t directory;
+  const char *kind;
+  uint32_t width;
+  uint32_t height;
+  bool tiled;
+  uint32_t tile_width;  // the page width for strips.
+  uint32_t tile_height;  // rows per strip for strips.
+  uint32_t count;  // tiles or strips.
+  uint16_t compression;
+  uint16_t photometric;
+} PageInfo;
+
+typedef struct {
+  std::string name;
+  bool decoded;
+  unsigned threads;
+  uint64_t reads;
+  uint64_t bytes;  // compressed, as stored.
+  double seconds;
+  std::vector<double> latencies;  // of each read, sorted.
+} ReadResult;
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <svs>\n"
+          "Options:\n"
+          "  --threads <count>  : Readers, each with its own handle on the file. (Default one per core)\n"
+          "  --random <count>   : Tiles read at random from each page. (Default %d)\n"
+          "  --raw              : Only read the compressed tiles, without decoding them.\n"
+          "  --cold             : Drop the file from the page cache before each case.\n"
+          "  --validate         : Only check the layout of the file.\n"
+          "  --json <path>      : Write the results as JSON, like conversion-bench.\n",
+          prog, DEFAULT_RANDOM_READS);
+  return 1;
+}
+
+// Reports a problem with the page in `directory`.
+static void problem(unsigned *problems, uint16_t directory, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "page %u: ", directory);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  ++*problems;
+}
+
+static bool parse_description(const char *text, AperioDescription *out) {
+  const char *newline = strchr(text, '\n');
+  if (!newline)
+    return false;
+  out->header.assign(text, newline);
+  std::string layer(newline + 1);
+  const size_t semicolon = layer.find(';');
+  out->metadata = semicolon != std::string::npos;
+  if (out->metadata)
+    layer.resize(semicolon);
+
+  std::istringstream tokens(layer);
+  std::string token;
+  if (!(tokens >> token) ||
+      sscanf(token.c_str(), "%ux%u", &out->native_width, &out->native_height) != 2 ||
+      !(tokens >> token))
+    return false;
+  uint32_t tile_width, tile_height;
+  if (sscanf(token.c_str(), "(%ux%u)", &tile_width, &tile_height) == 2) {
+    if (tile_width != tile_height)
+      return false;
+    out->tile_size = tile_width;
+    if (!(tokens >> token))
+      return false;
+  }
+  if (token == "->") {
+    uint32_t width, height;
+    if (!(tokens >> token) || sscanf(token.c_str(), "%ux%u", &width, &height) != 2 ||
+        !(tokens >> token))
+      return false;
+    out->width = width;
+    out->height = height;
+  }
+  out->compression = token;
+  int quality;
+  if (tokens >> token && sscanf(token.c_str(), "Q=%d", &quality) == 1)
+    out->quality = quality;
+  return true;
+}
+
+// Checks the current directory of `tiff` against what vips2svs_encoder
+// writes as page `directory`, given the native page when it is not the one.
+static void validate_page(TIFF *tiff, uint16_t directory, const PageInfo *native,
+                          uint64_t file_size, PageInfo *page, unsigned *problems) {
+  page->directory = directory;
+  page->kind = (directory == 0) ? "native" : (directory == 1) ? "thumbnail" : "sublayer";
+  uint16_t samples = 0, bits = 0, planar = PLANARCONFIG_CONTIG;
+  TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &page->width);
+  TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &page->height);
+  TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &samples);
+  TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &bits);
+  TIFFGetField(tiff, TIFFTAG_PLANARCONFIG, &planar);
+  TIFFGetField(tiff, TIFFTAG_COMPRESSION, &page->compression);
+  TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &page->photometric);
+  if (samples != 3 || bits != 8 || planar != PLANARCONFIG_CONTIG)
+    problem(problems, directory, "%u samples of %u bits, 3 contiguous bytes expected.",
+            samples, bits);
+
+  page->tiled = TIFFIsTiled(tiff);
+  if (page->tiled) {
+    TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &page->tile_width);
+    TIFFGetField(tiff, TIFFTAG_TILELENGTH, &page->tile_height);
+    page->count = TIFFNumberOfTiles(tiff);
+  } else {
+    page->tile_width = page->width;
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &page->tile_height);
+    page->count = TIFFNumberOfStrips(tiff);
+  }
+  if (!page->tile_width || !page->tile_height) {
+    problem(problems, directory, "no tile size.");
+    return;
+  }
+  const uint64_t expected_count =
+    static_cast<uint64_t>((page->width + page->tile_width - 1) / page->tile_width) *
+    ((page->height + page->tile_height - 1) / page->tile_height);
+  if (page->count != expected_count)
+    problem(problems, directory, "%u tiles, %llu expected for its size.", page->count,
+            static_cast<unsigned long long>(expected_count));
+  if ((directory == 1) == page->tiled)
+    problem(problems, directory, "%s, only the thumbnail is striped.",
+            page->tiled ? "tiled" : "striped");
+  if (directory == 1 && page->tile_height != THUMBNAIL_ROWS_PER_STRIP)
+    problem(problems, directory, "%u rows per strip, %d expected.", page->tile_height,
+            THUMBNAIL_ROWS_PER_STRIP);
+
+  for (uint32_t i = 0; i < page->count; ++i) {
+    const uint64_t offset = TIFFGetStrileOffset(tiff, i);
+    const uint64_t bytecount = TIFFGetStrileByteCount(tiff, i);
+    // Transcoded sources may leave tiles out, stored with no offset nor bytes.
+    if ((!offset && bytecount) || (offset && !bytecount) || offset + bytecount > file_size) {
+      problem(problems, directory, "tile %u at %llu, of %llu bytes, is missing or past the end.",
+              i, static_cast<unsigned long long>(offset),
+              static_cast<unsigned long long>(bytecount));
+      break;
+    }
+  }
+
+  // Abbreviated JPEG tiles cannot be decoded without the page's tables.
+  uint32_t tables_size = 0;
+  void *tables = nullptr;
+  if (page->compression == COMPRESSION_JPEG &&
+      (!TIFFGetField(tiff, TIFFTAG_JPEGTABLES, &tables_size, &tables) || !tables_size))
+    problem(problems, directory, "JPEG tiles without JPEGTables.");
+
+  const char *text = nullptr;
+  AperioDescription description = {};
+  if (!TIFFGetField(tiff, TIFFTAG_IMAGEDESCRIPTION, &text) ||
+      !parse_description(text, &description)) {
+    problem(problems, directory, "no Aperio ImageDescription.");
+    return;
+  }
+  if (description.header.compare(0, strlen(aperio_header_prefix), aperio_header_prefix) != 0)
+    problem(problems, directory, "description starts with \"%s\".", description.header.c_str());
+  const uint32_t native_width = native ? native->width : page->width;
+  const uint32_t native_height = native ? native->height : page->height;
+  if (description.native_width != native_width || description.native_height != native_height)
+    problem(problems, directory, "described native size %ux%u, the native page is %ux%u.",
+            description.native_width, description.native_height, native_width, native_height);
+  if ((directory == 0) == description.width.has_value())
+    problem(problems, directory, "%s its own size.",
+            description.width ? "describes" : "does not describe");
+  else if (description.width &&
+           (*description.width != page->width || *description.height != page->height))
+    problem(problems, directory, "described as %ux%u, but is %ux%u.",
+            *description.width, *description.height, page->width, page->height);
+  if ((directory == 1) == description.tile_size.has_value())
+    problem(problems, directory, "%s a tile size.",
+            description.tile_size ? "describes" : "does not describe");
+  else if (description.tile_size &&
+           (*description.tile_size != page->tile_width ||
+            *description.tile_size != page->tile_height))
+    problem(problems, directory, "described with %ux%u tiles, but has %ux%u ones.",
+            *description.tile_size, *description.tile_size, page->tile_width, page->tile_height);
+  if ((directory <= 1) != description.metadata)
+    problem(problems, directory, "metadata %s.",
+            description.metadata ? "only belongs to the native page and the thumbnail"
+            : "missing");
+
+  // The thumbnail is a JPEG, described with a dash.
+  TileCompression compression;
+  if (directory == 1) {
+    if (page->compression != COMPRESSION_JPEG || description.compression != "-")
+      problem(problems, directory, "thumbnail compressed with %u, described as %s.",
+              page->compression, description.compression.c_str());
+  } else if (!tile_compression_from_tiff(page->compression, &compression)) {
+    problem(problems, directory, "unknown compression %u.", page->compression);
+  } else {
+    if (description.compression != aperio_compression_name(compression))
+      problem(problems, directory, "compressed as %s, described as %s.",
+              aperio_compression_name(compression), description.compression.c_str());
+    // Pages copied from another scanner describe no quality, even lossy ones.
+    if (is_lossless(compression) && description.quality)
+      problem(problems, directory, "lossless pages have no quality.");
+  }
+
+  // Sublayers are the native page scaled down by the same factor both ways.
+  if (native && directory != 1) {
+    const double factor = static_cast<double>(native->width) / page->width;
+    if (std::fabs(native->height / factor - page->height) > 1.0)
+      problem(problems, directory, "%ux%u is not the native page scaled %.2f times.",
+              page->width, page->height, factor);
+  }
+}
+
+// Validates every page, filling `pages` in directory order.
+static unsigned validate(TIFF *tiff, uint64_t file_size, std::vector<PageInfo> *pages) {
+  unsigned problems = 0;
+  const uint16_t count = TIFFNumberOfDirectories(tiff);
+  if (count < 2)
+    problem(&problems, 0, "%u directories, a native page and a thumbnail at least expected.",
+            count);
+  for (uint16_t directory = 0; directory < count; ++directory) {
+    if (!TIFFSetDirectory(tiff, directory)) {
+      problem(&problems, directory, "unreadable directory.");
+      break;
+    }
+    PageInfo page = {};
+    validate_page(tiff, directory, pages->empty() ? nullptr : &pages->front(),
+                  file_size, &page, &problems);
+    // Smaller and smaller layers, after the thumbnail.
+    if (directory > 2 && page.width >= (*pages)[directory - 1].width)
+      problem(&problems, directory, "not smaller than the previous layer.");
+    pages->push_back(page);
+  }
+  return problems;
+}
+
+// Evicts the file from the page cache, so that reads go to the storage.
+static void drop_cache(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Reads the tiles `order` lists, split in contiguous runs between threads,
+// each reading through its own handle.
+static bool time_reads(const char *path, const PageInfo &page,
+                       const std::vector<uint32_t> &order, unsigned threads,
+                       bool decode, ReadResult *out) {
+  std::vector<TIFF *> handles;
+  bool ok = true;
+  for (unsigned i = 0; ok && i < threads; ++i) {
+    // Without memory mapping, reads go through read(2) like on network storage.
+    TIFF *tiff = TIFFOpen(path, "rm");
+    ok = tiff && TIFFSetDirectory(tiff, page.directory);
+    if (tiff)
+      handles.push_back(tiff);
+    // libtiff hands YCbCr JPEG tiles over as they are stored otherwise.
+    if (ok && decode && page.compression == COMPRESSION_JPEG &&
+        page.photometric == PHOTOMETRIC_YCBCR)
+      ok = TIFFSetField(tiff, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+  }
+
+  std::vector<std::vector<double>> latencies(handles.size());
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<bool> failed{false};
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (size_t t = 0; ok && t < handles.size(); ++t) {
+    workers.emplace_back([&, t]() {
+      TIFF *tiff = handles[t];
+      const size_t begin = order.size() * t / handles.size();
+      const size_t end = order.size() * (t + 1) / handles.size();
+      std::vector<uint8_t> buffer(
+        decode ? (page.tiled ? TIFFTileSize(tiff) : TIFFStripSize(tiff)) : 0);
+      latencies[t].reserve(end - begin);
+      for (size_t i = begin; i < end; ++i) {
+        const uint32_t index = order[i];
+        const uint64_t bytecount = TIFFGetStrileByteCount(tiff, index);
+        // Nothing to read for the tiles a transcoded source left empty.
+        if (!bytecount)
+          continue;
+        if (!decode)
+          buffer.resize(std::max<size_t>(buffer.size(), bytecount));
+        const auto read_start = std::chrono::steady_clock::now();
+        tmsize_t read;
+        if (decode)
+          read = page.tiled
+            ? TIFFReadEncodedTile(tiff, index, buffer.data(), buffer.size())
+            : TIFFReadEncodedStrip(tiff, index, buffer.data(), buffer.size());
+        else
+          read = page.tiled
+            ? TIFFReadRawTile(tiff, index, buffer.data(), buffer.size())
+            : TIFFReadRawStrip(tiff, index, buffer.data(), buffer.size());
+        const std::chrono::duration<double> latency =
+          std::chrono::steady_clock::now() - read_start;
+        if (read < 0) {
+          failed = true;
+          return;
+        }
+        latencies[t].push_back(latency.count());
+        bytes.fetch_add(bytecount, std::memory_order_relaxed);
+      }
+    });
+  }
+  for (std::thread &worker : workers)
+    worker.join();
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  for (TIFF *tiff : handles)
+    TIFFClose(tiff);
+  if (!ok || failed)
+    return false;
+
+  out->threads = handles.size();
+  out->decoded = decode;
+  out->bytes = bytes.load();
+  out->seconds = elapsed.count();
+  for (const std::vector<double> &thread_latencies : latencies)
+    out->latencies.insert(out->latencies.end(), thread_latencies.begin(),
+                          thread_latencies.end());
+  std::sort(out->latencies.begin(), out->latencies.end());
+  out->reads = out->latencies.size();
+  return true;
+}
+
+// Nearest rank percentile of sorted values.
+static double percentile(const std::vector<double> &values, double fraction) {
+  if (values.empty())
+    return 0;
+  const size_t rank = std::ceil(fraction * values.size());
+  return values[std::clamp<size_t>(rank, 1, values.size()) - 1];
+}
+
+static void print_result(const ReadResult &result) {
+  printf("%-28s %7s %7u %8llu %10.1f %8.1f %8.3f %8.3f %8.3f %8.3f\n", result.name.c_str(),
+         result.decoded ? "decode" : "raw", result.threads,
+         static_cast<unsigned long long>(result.reads), result.reads / result.seconds,
+         result.bytes / result.seconds / 1e6, percentile(result.latencies, 0.50) * 1e3,
+         percentile(result.latencies, 0.90) * 1e3, percentile(result.latencies, 0.99) * 1e3,
+         result.latencies.empty() ? 0.0 : result.latencies.back() * 1e3);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  unsigned random_reads = DEFAULT_RANDOM_READS;
+  bool raw = false;
+  bool cold = false;
+  bool validate_only = false;
+  const char *json = nullptr;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--random") == 0 && i + 1 < argc) {
+      random_reads = std::max(0, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--raw") == 0) {
+      raw = true;
+    } else if (strcmp(argv[i], "--cold") == 0) {
+      cold = true;
+    } else if (strcmp(argv[i], "--validate") == 0) {
+      validate_only = true;
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json = argv[++i];
+    } else if (argv[i][0] != '-' && !path) {
+      path = argv[i];
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (!path)
+    return usage(argv[0]);
+
+  struct stat file_stat;
+  if (stat(path, &file_stat) != 0) {
+    perror(path);
+    return 1;
+  }
+  TIFF *tiff = TIFFOpen(path, "r");
+  if (!tiff)
+    return 1;
+  std::vector<PageInfo> pages;
+  const unsigned problems = validate(tiff, file_stat.st_size, &pages);
+  // Where each tile is stored, to read them in file order.
+  std::vector<std::vector<uint32_t>> stored_order(pages.size());
+  for (size_t i = 0; !problems && i < pages.size(); ++i) {
+    std::vector<uint32_t> &order = stored_order[i];
+    std::vector<uint64_t> offsets(pages[i].count);
+    TIFFSetDirectory(tiff, pages[i].directory);
+    for (uint32_t index = 0; index < pages[i].count; ++index) {
+      offsets[index] = TIFFGetStrileOffset(tiff, index);
+      order.push_back(index);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&offsets](uint32_t a, uint32_t b) { return offsets[a] < offsets[b]; });
+  }
+  TIFFClose(tiff);
+
+  for (const PageInfo &page : pages)
+    printf("page %u %-9s %6ux%-6u %s %ux%u x %u, compression %u\n", page.directory,
+           page.kind, page.width, page.height, page.tiled ? "tiles" : "strips",
+           page.tile_width, page.tile_height, page.count, page.compression);
+  if (problems) {
+    fprintf(stderr, "%s: %u problem(s).\n", path, problems);
+    return 1;
+  }
+  printf("%s: valid.\n", path);
+  if (validate_only)
+    return 0;
+
+  printf("\n%-28s %7s %7s %8s %10s %8s %8s %8s %8s %8s\n", "benchmark", "read", "threads",
+         "tiles", "tiles/s", "MB/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+  // Only holds the results, each case being timed once by time_reads.
+  BenchHarness harness(0, 1);
+  std::mt19937 random(0);
+  bool ok = true;
+  for (size_t i = 0; i < pages.size(); ++i) {
+    const PageInfo &page = pages[i];
+    // Pages libtiff cannot decompress, e.g. Aperio's JPEG 2000, are read raw.
+    const bool decode = !raw && TIFFIsCODECConfigured(page.compression);
+    std::vector<uint32_t> random_order(random_reads);
+    std::uniform_int_distribution<uint32_t> tile(0, page.count - 1);
+    for (uint32_t &index : random_order)
+      index = tile(random);
+
+    const std::string name = std::to_string(page.directory) + "-" + page.kind;
+    for (const auto &[mode, order] : {std::make_pair("sequential", &stored_order[i]),
+                                      std::make_pair("random", &random_order)}) {
+      if (order->empty())
+        continue;
+      if (cold)
+        drop_cache(path);
+      ReadResult result = {};
+      result.name = name + "/" + mode;
+      if (!time_reads(path, page, *order, threads, decode, &result)) {
+        fprintf(stderr, "%s: reading page %u failed.\n", path, page.directory);
+        ok = false;
+        continue;
+      }
+      print_result(result);
+      harness.Record(result.name, 1, result.seconds, {result.reads, result.bytes});
+    }
+  }
+  if (json)
+    ok = harness.WriteJson(json) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,245 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WITH_X86_KERNELS
+#endif
+
+#include "utils.h"
+#include "box-downsampler.h"
+
+// Column sums of up to this many rows of bytes fit 16 bits.
+#define MAX_U16_ROWS 257u
+// Above this factor a block sum could overflow 32 bits.
+#define MAX_FACTOR 4096
+
+using namespace vips;
+
+// Sums `rows` rows of `count` bytes, `stride` bytes apart, column by column.
+// The kernels keep each run of sums in registers while going down the rows.
+typedef void (*ColumnSums)(const uint8_t *src, size_t stride, unsigned rows, size_t count,
+                           uint16_t *sums);
+
+static void column_sums_scalar(const uint8_t *src, size_t stride, unsigned rows,
+                               size_t count, uint16_t *sums) {
+  std::fill(sums, sums + count, 0);
+  for (unsigned y = 0; y < rows; ++y) {
+    const uint8_t *row = src + y * stride;
+    for (size_t i = 0; i < count; ++i)
+      sums[i] += row[i];
+  }
+}
+
+#ifdef WITH_X86_KERNELS
+__attribute__((target("sse2")))
+static void column_sums_sse2(const uint8_t *src, size_t stride, unsigned rows, size_t count,
+                             uint16_t *sums) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i low = zero, high = zero;
+    for (unsigned y = 0; y < rows; ++y) {
+      const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + y * stride + i));
+      low = _mm_add_epi16(low, _mm_unpacklo_epi8(bytes, zero));
+      high = _mm_add_epi16(high, _mm_unpackhi_epi8(bytes, zero));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + i), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + i + 8), high);
+  }
+  if (i < count)
+    column_sums_scalar(src + i, stride, rows, count - i, sums + i);
+}
+
+__attribute__((target("avx2")))
+static void column_sums_avx2(const uint8_t *src, size_t stride, unsigned rows, size_t count,
+                             uint16_t *sums) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i low = _mm256_setzero_si256(), high = _mm256_setzero_si256();
+    for (unsigned y = 0; y < rows; ++y) {
+      const uint8_t *bytes = src + y * stride + i;
+      low = _mm256_add_epi16(low, _mm256_cvtepu8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes))));
+      high = _mm256_add_epi16(high, _mm256_cvtepu8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + 16))));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(sums + i), low);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(sums + i + 16), high);
+  }
+  if (i < count)
+    column_sums_sse2(src + i, stride, rows, count - i, sums + i);
+}
+#endif
+
+bool box_kernel_supported(BoxKernel kernel) {
+  switch (kernel) {
+    case BoxKernel::kScalar:
+      return true;
+#ifdef WITH_X86_KERNELS
+    case BoxKernel::kSse2:
+      return __builtin_cpu_supports("sse2");
+    case BoxKernel::kAvx2:
+      return __builtin_cpu_supports("avx2");
+#else
+    case BoxKernel::kSse2:
+    case BoxKernel::kAvx2:
+      break;
+#endif
+  }
+  return false;
+}
+
+BoxKernel best_box_kernel() {
+  static const BoxKernel best = box_kernel_supported(BoxKernel::kAvx2)
+    ? BoxKernel::kAvx2
+    : box_kernel_supported(BoxKernel::kSse2) ? BoxKernel::kSse2 : BoxKernel::kScalar;
+  return best;
+}
+
+const char *box_kernel_name(BoxKernel kernel) {
+  switch (kernel) {
+    case BoxKernel::kScalar:
+      return "scalar";
+    case BoxKernel::kSse2:
+      return "sse2";
+    case BoxKernel::kAvx2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+static ColumnSums column_sums(BoxKernel kernel) {
+#ifdef WITH_X86_KERNELS
+  if (kernel == BoxKernel::kAvx2)
+    return column_sums_avx2;
+  if (kernel == BoxKernel::kSse2)
+    return column_sums_sse2;
+#endif
+  return column_sums_scalar;
+}
+
+// Rounded `sum / count`, shifting when `count` is a power of two as it is
+// for whole blocks of the usual factors.
+static inline uint8_t average(uint32_t sum, uint32_t count, int shift) {
+  return shift >= 0 ? (sum + count / 2) >> shift : (sum + count / 2) / count;
+}
+
+static inline int power_of_two_shift(uint32_t count) {
+  return (count & (count - 1)) ? -1 : __builtin_ctz(count);
+}
+
+// Sums the column sums of a row of blocks `factor` pixels at a time.
+template <typename T>
+static void reduce_columns(const T *sums, unsigned width, unsigned factor, unsigned rows,
+                           uint8_t *dst) {
+  const uint32_t full_count = rows * factor;
+  const int full_shift = power_of_two_shift(full_count);
+  for (unsigned x = 0; x < width; x += factor, dst += 3) {
+    const unsigned columns = std::min(factor, width - x);
+    uint32_t r = 0, g = 0, b = 0;
+    for (const T *sum = sums + x * 3, *end = sum + columns * 3; sum < end; sum += 3) {
+      r += sum[0];
+      g += sum[1];
+      b += sum[2];
+    }
+    const uint32_t count = rows * columns;
+    const int shift = count == full_count ? full_shift : power_of_two_shift(count);
+    dst[0] = average(r, count, shift);
+    dst[1] = average(g, count, shift);
+    dst[2] = average(b, count, shift);
+  }
+}
+
+void box_downsample(const uint8_t *src, size_t src_stride, unsigned width, unsigned height,
+                    unsigned factor, uint8_t *dst, size_t dst_stride, BoxKernel kernel) {
+  const ColumnSums sum_columns = column_sums(kernel);
+  const size_t count = static_cast<size_t>(width) * 3;
+  std::vector<uint16_t> sums(count);
+  // Taller blocks are summed a slice of rows at a time.
+  std::vector<uint32_t> wide_sums(factor > MAX_U16_ROWS ? count : 0);
+
+  for (unsigned y = 0; y < height; y += factor, dst += dst_stride) {
+    const unsigned rows = std::min(factor, height - y);
+    const uint8_t *block_row = src + y * src_stride;
+    if (rows <= MAX_U16_ROWS) {
+      sum_columns(block_row, src_stride, rows, count, sums.data());
+      reduce_columns(sums.data(), width, factor, rows, dst);
+      continue;
+    }
+    std::fill(wide_sums.begin(), wide_sums.end(), 0);
+    for (unsigned slice = 0; slice < rows; slice += MAX_U16_ROWS) {
+      sum_columns(block_row + slice * src_stride, src_stride,
+                  std::min(MAX_U16_ROWS, rows - slice), count, sums.data());
+      for (size_t i = 0; i < count; ++i)
+        wide_sums[i] += sums[i];
+    }
+    reduce_columns(wide_sums.data(), width, factor, rows, dst);
+  }
+}
+
+bool box_shrink_supports(const VImage &in, double scaling) {
+  return scaling >= 1.0 && scaling <= MAX_FACTOR && std::floor(scaling) == scaling &&
+    in.bands() == 3 && in.format() == VIPS_FORMAT_UCHAR;
+}
+
+// Computes an output region row by row, each from the row of blocks under
+// it: the input region of a thread never holds more than `factor` rows.
+static int box_generate(VipsRegion *out, void *seq, void *a, void *b, gboolean *stop) {
+  VipsRegion *ir = static_cast<VipsRegion *>(seq);
+  const VipsImage *in = static_cast<const VipsImage *>(a);
+  const int factor = GPOINTER_TO_UINT(b);
+  const VipsRect &rect = out->valid;
+  const VipsRect image = {0, 0, in->Xsize, in->Ysize};
+
+  for (int y = rect.top; y < rect.top + rect.height; ++y) {
+    VipsRect source = {rect.left * factor, y * factor, rect.width * factor, factor};
+    vips_rect_intersectrect(&source, &image, &source);
+    if (vips_region_prepare(ir, &source))
+      return -1;
+    box_downsample(VIPS_REGION_ADDR(ir, source.left, source.top), VIPS_REGION_LSKIP(ir),
+                   source.width, source.height, factor,
+                   VIPS_REGION_ADDR(out, rect.left, y), VIPS_REGION_LSKIP(out));
+  }
+  return 0;
+}
+
+static void release_input(VipsImage *image, VipsImage *in) {
+  g_object_unref(in);
+}
+
+VImage box_shrink(const VImage &in, unsigned factor) {
+  VipsImage *input = in.get_image();
+  VipsImage *image = vips_image_new();
+  // The input outlives the regions computed from it.
+  g_object_ref(input);
+  g_signal_connect(image, "close", G_CALLBACK(release_input), input);
+  if (vips_image_pipelinev(image, VIPS_DEMAND_STYLE_SMALLTILE, input, nullptr)) {
+    g_object_unref(image);
+    throw VError();
+  }
+  image->Xsize = partition(input->Xsize, factor);
+  image->Ysize = partition(input->Ysize, factor);
+  image->Xres = input->Xres / factor;
+  image->Yres = input->Yres / factor;
+  if (vips_image_generate(image, vips_start_one, box_generate, vips_stop_one, input,
+                          GUINT_TO_POINTER(factor))) {
+    g_object_unref(image);
+    throw VError();
+  }
+  return VImage(image);
+}
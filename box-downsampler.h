@@ -0,0 +1,48 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __BOX_DOWNSAMPLER_H_
+#define __BOX_DOWNSAMPLER_H_
+#include <cstddef>
+#include <cstdint>
+#include <vips/vips8>
+
+// Instruction sets the box kernel is written for.
+enum class BoxKernel {
+  kScalar,
+  kSse2,
+  kAvx2,
+};
+
+// The fastest kernel the CPU runs, checked once.
+BoxKernel best_box_kernel();
+bool box_kernel_supported(BoxKernel kernel);
+const char *box_kernel_name(BoxKernel kernel);
+
+// Averages the `factor` x `factor` blocks of the `width` x `height` RGB
+// `src`, rows `src_stride` bytes apart, into the partition(width, factor) x
+// partition(height, factor) pixels of `dst`, rows `dst_stride` bytes apart.
+// Blocks on the right and bottom edges average the pixels they have, like
+// PyramidBuilder. `kernel` must be supported.
+void box_downsample(const uint8_t *src, size_t src_stride, unsigned width, unsigned height,
+                    unsigned factor, uint8_t *dst, size_t dst_stride,
+                    BoxKernel kernel = best_box_kernel());
+
+// Whether box_shrink can reduce `in` by `scaling`: an integral factor, on
+// 8-bit RGB pixels.
+bool box_shrink_supports(const vips::VImage &in, double scaling);
+
+// `in` reduced `factor` times with box_downsample, computed lazily and on
+// every thread like other libvips operations.
+vips::VImage box_shrink(const vips::VImage &in, unsigned factor);
+#endif // __BOX_DOWNSAMPLER_H_
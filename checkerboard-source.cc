@@ -0,0 +1,292 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "checkerboard-source.h"
+
+// Line widths of the grids, in user units.
+#define DIVISIONS_LINE_WIDTH 16
+#define SUBDIVISIONS_LINE_WIDTH (DIVISIONS_LINE_WIDTH / 4)
+// Label font size, relative to the side.
+#define FONT_SIZE 0.01
+// Rows of the built-in glyphs, and font units per em.
+#define GLYPH_ROWS 9
+#define GLYPH_UNITS_PER_EM 10
+// Samples per pixel side of the labels.
+#define LABEL_SAMPLES 4
+
+using namespace vips;
+
+// The script's gradient, from the top left to the bottom right corner.
+typedef struct {
+  double offset;
+  double rgb[3];
+} ColorStop;
+
+static const ColorStop kGradient[] = {
+  {0.0, {0.059, 0.294, 0.643}},
+  {0.25, {0.0, 0.502, 0.831}},
+  {0.5, {0.0, 0.678, 0.769}},
+  {0.75, {0.0, 0.827, 0.498}},
+  {1.0, {0.659, 0.922, 0.071}},
+};
+
+static const uint8_t kSubgridGray = 77;  // 0.3
+
+// 5 columns wide glyphs, the most significant bit on the left. Digits sit
+// on the baseline under row 7, the comma hangs below it.
+typedef struct {
+  unsigned advance;  // in font units, the gap after the ink included.
+  uint8_t rows[GLYPH_ROWS];
+} Glyph;
+
+static const Glyph kDigits[10] = {
+  {6, {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}},
+  {6, {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e}},
+  {6, {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}},
+  {6, {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e}},
+  {6, {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}},
+  {6, {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e}},
+  {6, {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}},
+  {6, {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}},
+  {6, {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}},
+  {6, {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c}},
+};
+static const Glyph kComma = {3, {0, 0, 0, 0, 0, 0x18, 0x18, 0x08, 0x10}};
+
+// What the regions are drawn from, freed with the image.
+typedef struct {
+  CheckerboardSpec spec;
+  int side;  // in pixels.
+  double scale;  // pixels per user unit.
+  std::vector<uint8_t> gradient;  // RGB, indexed by x + y.
+} Checkerboard;
+
+// Parses the positive decimal count at `*text`, and moves past it.
+static bool parse_count(const char **text, unsigned *out) {
+  // strtoul() would take signs and spaces.
+  if (!isdigit(static_cast<unsigned char>(**text)))
+    return false;
+  char *end;
+  errno = 0;
+  const unsigned long count = strtoul(*text, &end, 10);
+  if (errno || count == 0 || count > UINT_MAX)
+    return false;
+  *out = count;
+  *text = end;
+  return true;
+}
+
+bool parse_checkerboard(const std::string &name, CheckerboardSpec *out) {
+  static const char prefix[] = "checkerboard:";
+  if (name.compare(0, sizeof(prefix) - 1, prefix) != 0)
+    return false;
+  const char *text = name.c_str() + sizeof(prefix) - 1;
+  unsigned divisions, subdivisions;
+  if (!parse_count(&text, &divisions) || *text++ != 'x' ||
+      !parse_count(&text, &subdivisions) || *text != '\0' ||
+      static_cast<uint64_t>(divisions) * subdivisions > MAX_CHECKERBOARD_LINES)
+    return false;
+  *out = {divisions, subdivisions};
+  return true;
+}
+
+// The gradient along the diagonal, sampled at the pixel centres.
+static void fill_gradient(Checkerboard *board) {
+  const size_t count = 2 * static_cast<size_t>(board->side) - 1;
+  board->gradient.resize(count * 3);
+  for (size_t i = 0; i < count; ++i) {
+    const double t = (i + 1.0) / (2.0 * board->side);
+    size_t stop = 1;
+    while (stop + 1 < sizeof(kGradient) / sizeof(kGradient[0]) && t > kGradient[stop].offset)
+      ++stop;
+    const ColorStop &from = kGradient[stop - 1];
+    const ColorStop &to = kGradient[stop];
+    const double f = std::clamp((t - from.offset) / (to.offset - from.offset), 0.0, 1.0);
+    for (int c = 0; c < 3; ++c)
+      board->gradient[i * 3 + c] =
+        std::lround(255 * (from.rgb[c] + f * (to.rgb[c] - from.rgb[c])));
+  }
+}
+
+// Coverage, out of 255, of the pixels [start, start + count) by `lines`
+// evenly spaced lines across the side, `line_width` pixels wide.
+static void line_coverage(int start, int count, int side, unsigned lines, double line_width,
+                          uint8_t *out) {
+  const double spacing = static_cast<double>(side) / lines;
+  for (int i = 0; i < count; ++i) {
+    const double from = start + i;
+    double covered = 0;
+    const long first = std::max(0L, std::lround(std::floor((from - line_width / 2) / spacing)));
+    const long last = std::min<long>(lines, std::lround(std::ceil((from + 1 + line_width / 2) / spacing)));
+    for (long line = first; line <= last; ++line) {
+      const double centre = line * spacing;
+      covered += std::max(0.0, std::min(from + 1, centre + line_width / 2) -
+                                 std::max(from, centre - line_width / 2));
+    }
+    out[i] = std::lround(255 * std::min(1.0, covered));
+  }
+}
+
+static inline void blend(uint8_t *pixel, uint8_t value, unsigned alpha) {
+  for (int c = 0; c < 3; ++c)
+    pixel[c] = (pixel[c] * (255 - alpha) + value * alpha + 127) / 255;
+}
+
+// The ink of "<column>,<row>", one byte per font unit.
+static std::vector<uint8_t> label_bitmap(unsigned column, unsigned row, unsigned *width) {
+  const std::string text = std::to_string(column) + "," + std::to_string(row);
+  std::vector<const Glyph *> glyphs;
+  *width = 0;
+  for (const char c : text) {
+    glyphs.push_back(c == ',' ? &kComma : &kDigits[c - '0']);
+    *width += glyphs.back()->advance;
+  }
+  // The gap after the last glyph is not ink.
+  *width -= 1;
+  std::vector<uint8_t> bitmap(static_cast<size_t>(*width) * GLYPH_ROWS);
+  unsigned x = 0;
+  for (const Glyph *glyph : glyphs) {
+    for (unsigned y = 0; y < GLYPH_ROWS; ++y)
+      for (unsigned i = 0; i < 5 && x + i < *width; ++i)
+        bitmap[y * *width + x + i] = (glyph->rows[y] >> (4 - i)) & 1;
+    x += glyph->advance;
+  }
+  return bitmap;
+}
+
+// Draws the labels of the cells overlapping the region, antialiased.
+static void draw_labels(VipsRegion *out, const Checkerboard *board) {
+  const VipsRect &rect = out->valid;
+  const unsigned divisions = board->spec.divisions;
+  const double cell = static_cast<double>(board->side) / divisions;
+  const double unit = FONT_SIZE * board->side / GLYPH_UNITS_PER_EM;  // pixels per font unit.
+  // Only the labels of the cells around the region can touch it.
+  unsigned widest;
+  label_bitmap(divisions - 1, divisions - 1, &widest);
+  const double margin_x = widest * unit / 2 + 1;
+  const double margin_y = GLYPH_ROWS * unit / 2 + 1;
+  const unsigned first_column = std::clamp((rect.left - margin_x) / cell, 0.0, divisions - 1.0);
+  const unsigned last_column =
+    std::clamp((rect.left + rect.width + margin_x) / cell, 0.0, divisions - 1.0);
+  const unsigned first_row = std::clamp((rect.top - margin_y) / cell, 0.0, divisions - 1.0);
+  const unsigned last_row =
+    std::clamp((rect.top + rect.height + margin_y) / cell, 0.0, divisions - 1.0);
+  for (unsigned row = first_row; row <= last_row; ++row) {
+    for (unsigned column = first_column; column <= last_column; ++column) {
+      unsigned width;
+      const std::vector<uint8_t> bitmap = label_bitmap(column, row, &width);
+      const double left = (column + 0.5) * cell - width * unit / 2;
+      const double top = (row + 0.5) * cell - GLYPH_ROWS * unit / 2;
+      const int x0 = std::max<int>(rect.left, std::floor(left));
+      const int x1 = std::min<int>(rect.left + rect.width, std::ceil(left + width * unit));
+      const int y0 = std::max<int>(rect.top, std::floor(top));
+      const int y1 = std::min<int>(rect.top + rect.height, std::ceil(top + GLYPH_ROWS * unit));
+      for (int y = y0; y < y1; ++y) {
+        uint8_t *pixel = VIPS_REGION_ADDR(out, x0, y);
+        for (int x = x0; x < x1; ++x, pixel += 3) {
+          unsigned hits = 0;
+          for (int sy = 0; sy < LABEL_SAMPLES; ++sy) {
+            const double gy = (y + (sy + 0.5) / LABEL_SAMPLES - top) / unit;
+            if (gy < 0 || gy >= GLYPH_ROWS)
+              continue;
+            for (int sx = 0; sx < LABEL_SAMPLES; ++sx) {
+              const double gx = (x + (sx + 0.5) / LABEL_SAMPLES - left) / unit;
+              if (gx >= 0 && gx < width)
+                hits += bitmap[static_cast<size_t>(gy) * width + static_cast<size_t>(gx)];
+            }
+          }
+          if (hits)
+            blend(pixel, 0, hits * 255 / (LABEL_SAMPLES * LABEL_SAMPLES));
+        }
+      }
+    }
+  }
+}
+
+static int generate_region(VipsRegion *out, void *seq, void *a, void *b, gboolean *stop) {
+  const Checkerboard *board = static_cast<const Checkerboard *>(a);
+  const VipsRect &rect = out->valid;
+  const unsigned fine_lines = board->spec.divisions * board->spec.subdivisions;
+  const double fine_width = SUBDIVISIONS_LINE_WIDTH * board->scale;
+  const double coarse_width = DIVISIONS_LINE_WIDTH * board->scale;
+
+  std::vector<uint8_t> fine_x(rect.width), coarse_x(rect.width);
+  std::vector<uint8_t> fine_y(rect.height), coarse_y(rect.height);
+  line_coverage(rect.left, rect.width, board->side, fine_lines, fine_width, fine_x.data());
+  line_coverage(rect.left, rect.width, board->side, board->spec.divisions, coarse_width,
+                coarse_x.data());
+  line_coverage(rect.top, rect.height, board->side, fine_lines, fine_width, fine_y.data());
+  line_coverage(rect.top, rect.height, board->side, board->spec.divisions, coarse_width,
+                coarse_y.data());
+
+  for (int y = 0; y < rect.height; ++y) {
+    uint8_t *pixel = VIPS_REGION_ADDR(out, rect.left, rect.top + y);
+    const uint8_t *gradient = &board->gradient[(rect.left + rect.top + y) * 3];
+    std::copy(gradient, gradient + rect.width * 3, pixel);
+    // Stroked in the script's order: the fine grid, rows then columns, then
+    // the coarse one.
+    for (int x = 0; x < rect.width; ++x, pixel += 3) {
+      if (fine_y[y])
+        blend(pixel, kSubgridGray, fine_y[y]);
+      if (fine_x[x])
+        blend(pixel, kSubgridGray, fine_x[x]);
+      if (coarse_y[y])
+        blend(pixel, 0, coarse_y[y]);
+      if (coarse_x[x])
+        blend(pixel, 0, coarse_x[x]);
+    }
+  }
+  draw_labels(out, board);
+  return 0;
+}
+
+static void free_checkerboard(VipsImage *image, Checkerboard *board) {
+  delete board;
+}
+
+bool checkerboard_image(const CheckerboardSpec &spec, int width, VImage *out) {
+  const uint64_t fine_lines = static_cast<uint64_t>(spec.divisions) * spec.subdivisions;
+  if (width <= 0 || fine_lines > static_cast<uint64_t>(width)) {
+    fprintf(stderr, "checkerboard: %llu cells across do not fit in %d pixels.\n",
+            static_cast<unsigned long long>(fine_lines), width);
+    return false;
+  }
+  Checkerboard *board = new Checkerboard{spec, width, static_cast<double>(width) / CHECKERBOARD_SIDE, {}};
+  fill_gradient(board);
+
+  // The svg at the dpi giving `width`, in pixels per millimetre.
+  const double resolution = board->scale * 72 / 25.4;
+  VipsImage *image = vips_image_new();
+  vips_image_init_fields(image, width, width, 3, VIPS_FORMAT_UCHAR, VIPS_CODING_NONE,
+                         VIPS_INTERPRETATION_sRGB, resolution, resolution);
+  g_signal_connect(image, "close", G_CALLBACK(free_checkerboard), board);
+  if (vips_image_pipelinev(image, VIPS_DEMAND_STYLE_SMALLTILE, nullptr) ||
+      vips_image_generate(image, nullptr, generate_region, nullptr, board, nullptr)) {
+    fprintf(stderr, "checkerboard: %s\n", vips_error_buffer());
+    vips_error_clear();
+    g_object_unref(image);
+    return false;
+  }
+  *out = VImage(image);
+  return true;
+}
@@ -0,0 +1,46 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __CHECKERBOARD_SOURCE_H_
+#define __CHECKERBOARD_SOURCE_H_
+#include <string>
+#include <vips/vips8>
+
+// Side of the checkerboard canvas, in svg user units.
+#define CHECKERBOARD_SIDE 16000
+
+// The checkerboard generate_svg_checkerboard.py draws: a gradient
+// background, a grid of `divisions` cells each split by a finer grid of
+// `subdivisions`, and the coordinates of the cells at their centre.
+typedef struct {
+  unsigned divisions;
+  unsigned subdivisions;
+} CheckerboardSpec;
+
+// Fine lines across a checkerboard at most, each fine cell being then as
+// wide as the coarse lines.
+#define MAX_CHECKERBOARD_LINES (CHECKERBOARD_SIDE / 16)
+
+// Parses the input names standing for a generated checkerboard,
+// "checkerboard:<divisions>x<subdivisions>", with positive counts whose
+// product is MAX_CHECKERBOARD_LINES at most.
+bool parse_checkerboard(const std::string &name, CheckerboardSpec *out);
+
+// The checkerboard `width` pixels wide and high, RGB. Each region is drawn
+// on demand by the thread asking for it, without any svg to parse: tiles
+// come at the speed of the encoders. Labels use a small built-in font, so
+// they are placed like the script's but their glyphs differ. Fine cells
+// must be a pixel wide at least.
+// Returns false after reporting why.
+bool checkerboard_image(const CheckerboardSpec &spec, int width, vips::VImage *out);
+#endif // __CHECKERBOARD_SOURCE_H_
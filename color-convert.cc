@@ -0,0 +1,227 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "color-convert.h"
+
+// Coefficients scaled by 2^15, shared by every implementation so that they
+// produce exactly the same output.
+#define FIX_SHIFT 15
+#define FIX_HALF (1 << (FIX_SHIFT - 1))
+#define Y_R 9798    // 0.299
+#define Y_G 19235   // 0.587
+#define Y_B 3735    // 0.114
+#define CB_R -5529  // -0.168736
+#define CB_G -10855 // -0.331264
+#define CB_B 16384  // 0.5
+#define CR_R 16384  // 0.5
+#define CR_G -13720 // -0.418688
+#define CR_B -2664  // -0.081312
+#define CHROMA_OFFSET ((128 << FIX_SHIFT) + FIX_HALF)
+
+static inline uint8_t clamp(int32_t v) {
+  return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+static inline uint8_t luma(int32_t r, int32_t g, int32_t b) {
+  return clamp((Y_R * r + Y_G * g + Y_B * b + FIX_HALF) >> FIX_SHIFT);
+}
+
+static inline uint8_t cb(int32_t r, int32_t g, int32_t b) {
+  return clamp((CB_R * r + CB_G * g + CB_B * b + CHROMA_OFFSET) >> FIX_SHIFT);
+}
+
+static inline uint8_t cr(int32_t r, int32_t g, int32_t b) {
+  return clamp((CR_R * r + CR_G * g + CR_B * b + CHROMA_OFFSET) >> FIX_SHIFT);
+}
+
+// Converts columns [x_begin, width) of the row pair (row0, row1).
+static void convert_row_pair(const uint8_t *row0, const uint8_t *row1,
+                             unsigned x_begin, unsigned width,
+                             uint8_t *y0, uint8_t *y1, uint8_t *cb_row,
+                             uint8_t *cr_row) {
+  for (unsigned x = x_begin; x < width; ++x) {
+    const uint8_t *p = row0 + x * 3;
+    y0[x] = luma(p[0], p[1], p[2]);
+    if (y1) {
+      const uint8_t *q = row1 + x * 3;
+      y1[x] = luma(q[0], q[1], q[2]);
+    }
+  }
+
+  for (unsigned x = x_begin; x < width; x += 2) {
+    const unsigned x1 = (x + 1 < width) ? x + 1 : x;
+    const uint8_t *a = row0 + x * 3;
+    const uint8_t *b = row0 + x1 * 3;
+    const uint8_t *c = row1 + x * 3;
+    const uint8_t *d = row1 + x1 * 3;
+    const int32_t r = (a[0] + b[0] + c[0] + d[0] + 2) >> 2;
+    const int32_t g = (a[1] + b[1] + c[1] + d[1] + 2) >> 2;
+    const int32_t bl = (a[2] + b[2] + c[2] + d[2] + 2) >> 2;
+    cb_row[x / 2] = cb(r, g, bl);
+    cr_row[x / 2] = cr(r, g, bl);
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+// Splits 16 interleaved RGB pixels into one vector per channel.
+__attribute__((target("ssse3")))
+static inline void deinterleave_rgb(const uint8_t *p, __m128i *r, __m128i *g, __m128i *b) {
+  const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+  const __m128i z = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 32));
+  const char x = -1;
+  *r = _mm_or_si128(_mm_or_si128(
+         _mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, x, x, x, x, x, x, x, x, x, x)),
+         _mm_shuffle_epi8(m, _mm_setr_epi8(x, x, x, x, x, x, 2, 5, 8, 11, 14, x, x, x, x, x))),
+         _mm_shuffle_epi8(z, _mm_setr_epi8(x, x, x, x, x, x, x, x, x, x, x, 1, 4, 7, 10, 13)));
+  *g = _mm_or_si128(_mm_or_si128(
+         _mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, x, x, x, x, x, x, x, x, x, x, x)),
+         _mm_shuffle_epi8(m, _mm_setr_epi8(x, x, x, x, x, 0, 3, 6, 9, 12, 15, x, x, x, x, x))),
+         _mm_shuffle_epi8(z, _mm_setr_epi8(x, x, x, x, x, x, x, x, x, x, x, 2, 5, 8, 11, 14)));
+  *b = _mm_or_si128(_mm_or_si128(
+         _mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, x, x, x, x, x, x, x, x, x, x, x)),
+         _mm_shuffle_epi8(m, _mm_setr_epi8(x, x, x, x, x, 1, 4, 7, 10, 13, x, x, x, x, x, x))),
+         _mm_shuffle_epi8(z, _mm_setr_epi8(x, x, x, x, x, x, x, x, x, x, 0, 3, 6, 9, 12, 15)));
+}
+
+// Computes (c0 * u + c1 * v + c2 * w + offset) >> FIX_SHIFT for 8 pixels
+// held in 16-bit lanes, and packs the result into 16-bit lanes.
+__attribute__((target("ssse3")))
+static inline __m128i weighted_sum(__m128i u, __m128i v, __m128i w,
+                                   __m128i c01, __m128i c2_one, __m128i offset) {
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i lo = _mm_add_epi32(
+    _mm_madd_epi16(_mm_unpacklo_epi16(u, v), c01),
+    _mm_madd_epi16(_mm_unpacklo_epi16(w, one), c2_one));
+  const __m128i hi = _mm_add_epi32(
+    _mm_madd_epi16(_mm_unpackhi_epi16(u, v), c01),
+    _mm_madd_epi16(_mm_unpackhi_epi16(w, one), c2_one));
+  return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, offset), FIX_SHIFT),
+                         _mm_srai_epi32(_mm_add_epi32(hi, offset), FIX_SHIFT));
+}
+
+static inline __m128i pair(int16_t a, int16_t b) {
+  return _mm_set1_epi32((static_cast<uint16_t>(b) << 16) | static_cast<uint16_t>(a));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i luma16(__m128i r, __m128i g, __m128i b) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rg = pair(Y_R, Y_G);
+  const __m128i b1 = pair(Y_B, 0);
+  const __m128i offset = _mm_set1_epi32(FIX_HALF);
+  const __m128i lo = weighted_sum(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero),
+                                  _mm_unpacklo_epi8(b, zero), rg, b1, offset);
+  const __m128i hi = weighted_sum(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero),
+                                  _mm_unpackhi_epi8(b, zero), rg, b1, offset);
+  return _mm_packus_epi16(lo, hi);
+}
+
+// Averages the 2x2 blocks of two rows of 16 pixels into 8 16-bit lanes.
+__attribute__((target("ssse3")))
+static inline __m128i average_2x2(__m128i top, __m128i bottom) {
+  const __m128i ones = _mm_set1_epi8(1);
+  const __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(top, ones),
+                                    _mm_maddubs_epi16(bottom, ones));
+  return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("ssse3")))
+static void rgb_to_ycbcr420_ssse3(const uint8_t *rgb, size_t stride, unsigned width,
+                                  unsigned height, const YCbCrPlanes &out) {
+  const __m128i cb_rg = pair(CB_R, CB_G);
+  const __m128i cb_b1 = pair(CB_B, 0);
+  const __m128i cr_rg = pair(CR_R, CR_G);
+  const __m128i cr_b1 = pair(CR_B, 0);
+  const __m128i offset = _mm_set1_epi32(CHROMA_OFFSET);
+  const unsigned simd_width = width & ~15u;
+
+  for (unsigned y = 0; y < height; y += 2) {
+    const uint8_t *row0 = rgb + y * stride;
+    const bool has_row1 = y + 1 < height;
+    const uint8_t *row1 = has_row1 ? row0 + stride : row0;
+    uint8_t *y0 = out.y + y * out.y_stride;
+    uint8_t *y1 = has_row1 ? y0 + out.y_stride : nullptr;
+    uint8_t *cb_row = out.cb + (y / 2) * out.chroma_stride;
+    uint8_t *cr_row = out.cr + (y / 2) * out.chroma_stride;
+
+    for (unsigned x = 0; x < simd_width; x += 16) {
+      __m128i r0, g0, b0, r1, g1, b1;
+      deinterleave_rgb(row0 + x * 3, &r0, &g0, &b0);
+      deinterleave_rgb(row1 + x * 3, &r1, &g1, &b1);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(y0 + x), luma16(r0, g0, b0));
+      if (y1)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y1 + x), luma16(r1, g1, b1));
+
+      const __m128i r = average_2x2(r0, r1);
+      const __m128i g = average_2x2(g0, g1);
+      const __m128i b = average_2x2(b0, b1);
+      const __m128i cb16 = weighted_sum(r, g, b, cb_rg, cb_b1, offset);
+      const __m128i cr16 = weighted_sum(r, g, b, cr_rg, cr_b1, offset);
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(cb_row + x / 2), _mm_packus_epi16(cb16, cb16));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(cr_row + x / 2), _mm_packus_epi16(cr16, cr16));
+    }
+    convert_row_pair(row0, row1, simd_width, width, y0, y1, cb_row, cr_row);
+  }
+}
+#endif
+
+void rgb_to_ycbcr420_scalar(const uint8_t *rgb, size_t stride, unsigned width,
+                            unsigned height, const YCbCrPlanes &out) {
+  for (unsigned y = 0; y < height; y += 2) {
+    const uint8_t *row0 = rgb + y * stride;
+    const bool has_row1 = y + 1 < height;
+    uint8_t *y0 = out.y + y * out.y_stride;
+    convert_row_pair(row0, has_row1 ? row0 + stride : row0, 0, width, y0,
+                     has_row1 ? y0 + out.y_stride : nullptr,
+                     out.cb + (y / 2) * out.chroma_stride,
+                     out.cr + (y / 2) * out.chroma_stride);
+  }
+}
+
+void rgb_to_ycbcr444(const uint8_t *rgb, size_t stride, unsigned width,
+                     unsigned height, const YCbCrPlanes &out) {
+  for (unsigned y = 0; y < height; ++y) {
+    const uint8_t *row = rgb + y * stride;
+    uint8_t *y_row = out.y + y * out.y_stride;
+    uint8_t *cb_row = out.cb + y * out.chroma_stride;
+    uint8_t *cr_row = out.cr + y * out.chroma_stride;
+    for (unsigned x = 0; x < width; ++x) {
+      const uint8_t *p = row + x * 3;
+      y_row[x] = luma(p[0], p[1], p[2]);
+      cb_row[x] = cb(p[0], p[1], p[2]);
+      cr_row[x] = cr(p[0], p[1], p[2]);
+    }
+  }
+}
+
+void rgb_to_ycbcr420(const uint8_t *rgb, size_t stride, unsigned width,
+                     unsigned height, const YCbCrPlanes &out) {
+#ifdef HAVE_X86_SIMD
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  if (has_ssse3) {
+    rgb_to_ycbcr420_ssse3(rgb, stride, width, height, out);
+    return;
+  }
+#endif
+  rgb_to_ycbcr420_scalar(rgb, stride, width, height, out);
+}
@@ -0,0 +1,44 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __COLOR_CONVERT_H_
+#define __COLOR_CONVERT_H_
+#include <cstddef>
+#include <cstdint>
+
+// Planes of a YCbCr 4:2:0 image. Chroma planes have half the width and
+// height of the luma plane, rounded up.
+typedef struct {
+  uint8_t *y;
+  size_t y_stride;
+  uint8_t *cb;
+  uint8_t *cr;
+  size_t chroma_stride;
+} YCbCrPlanes;
+
+// Converts `width` x `height` RGB pixels, `stride` bytes apart, into JFIF
+// (full range BT.601) YCbCr. Chroma is averaged over 2x2 pixel blocks, odd
+// edges repeat their last row or column.
+// Uses SSSE3 when the CPU supports it, results are identical either way.
+void rgb_to_ycbcr420(const uint8_t *rgb, size_t stride, unsigned width,
+                     unsigned height, const YCbCrPlanes &out);
+
+// Same conversion without subsampling, chroma planes are as large as the
+// luma one.
+void rgb_to_ycbcr444(const uint8_t *rgb, size_t stride, unsigned width,
+                     unsigned height, const YCbCrPlanes &out);
+
+// The portable implementation, for reference and testing.
+void rgb_to_ycbcr420_scalar(const uint8_t *rgb, size_t stride, unsigned width,
+                            unsigned height, const YCbCrPlanes &out);
+#endif // __COLOR_CONVERT_H_
@@ -0,0 +1,170 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cinttypes>
+#include <cstdarg>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#include "conversion-journal.h"
+
+// Tiles, or seconds, between checkpoints.
+#define CHECKPOINT_TILES 4096
+#define CHECKPOINT_SECONDS 10
+
+static const char *kJournalHeader = "svg2svs-journal 1";
+
+ConversionJournal::~ConversionJournal() {
+  if (file_)
+    fclose(file_);
+}
+
+std::unique_ptr<ConversionJournal> ConversionJournal::Create(const char *path,
+                                                             const std::string &fingerprint) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    return nullptr;
+  }
+  std::unique_ptr<ConversionJournal> journal(new ConversionJournal(path, file));
+  if (!journal->Append("%s\nfingerprint %s\n", kJournalHeader, fingerprint.c_str()))
+    return nullptr;
+  return journal;
+}
+
+std::unique_ptr<ConversionJournal> ConversionJournal::Resume(const char *path,
+                                                             const std::string &fingerprint) {
+  std::ifstream in(path);
+  if (!in)
+    return nullptr;
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  const std::string text = contents.str();
+
+  // Only complete lines count, the last one may have been cut short.
+  std::vector<std::vector<Strile>> tiles, pending_tiles;
+  std::optional<bool> bigtiff, pending_bigtiff;
+  uint64_t checkpoint_size = 0;
+  size_t checkpoint_end = 0;
+  unsigned number = 0;
+  for (size_t begin = 0, end; (end = text.find('\n', begin)) != std::string::npos;
+       begin = end + 1) {
+    const std::string line = text.substr(begin, end - begin);
+    ++number;
+    if (number == 1 || number == 2) {
+      if (line != ((number == 1) ? kJournalHeader : "fingerprint " + fingerprint)) {
+        fprintf(stderr, "%s is not the journal of this conversion.\n", path);
+        return nullptr;
+      }
+      continue;
+    }
+
+    unsigned page;
+    uint32_t index;
+    unsigned long long offset, bytecount, size;
+    int value;
+    if (sscanf(line.c_str(), "tile %u %" SCNu32 " %llu %llu", &page, &index, &offset,
+               &bytecount) == 4) {
+      if (page >= pending_tiles.size())
+        pending_tiles.resize(page + 1);
+      if (index >= pending_tiles[page].size())
+        pending_tiles[page].resize(index + 1);
+      pending_tiles[page][index] = {offset, bytecount};
+    } else if (sscanf(line.c_str(), "bigtiff %d", &value) == 1) {
+      pending_bigtiff = value != 0;
+    } else if (sscanf(line.c_str(), "checkpoint %llu", &size) == 1) {
+      tiles = pending_tiles;
+      bigtiff = pending_bigtiff;
+      checkpoint_size = size;
+      checkpoint_end = end + 1;
+    } else {
+      fprintf(stderr, "%s:%u: invalid journal entry.\n", path, number);
+      return nullptr;
+    }
+  }
+  if (!checkpoint_size || !bigtiff) {
+    fprintf(stderr, "%s has no checkpoint.\n", path);
+    return nullptr;
+  }
+
+  // Later records are replaced by those of this run.
+  FILE *file = fopen(path, "r+");
+  if (!file || ftruncate(fileno(file), checkpoint_end) != 0 ||
+      fseek(file, 0, SEEK_END) != 0) {
+    perror(path);
+    if (file)
+      fclose(file);
+    return nullptr;
+  }
+  std::unique_ptr<ConversionJournal> journal(new ConversionJournal(path, file));
+  journal->tiles_ = std::move(tiles);
+  journal->bigtiff_ = bigtiff;
+  journal->checkpoint_size_ = checkpoint_size;
+  return journal;
+}
+
+bool ConversionJournal::SetBigTiff(bool bigtiff) {
+  if (bigtiff_)
+    return *bigtiff_ == bigtiff;
+  bigtiff_ = bigtiff;
+  return Append("bigtiff %d\n", bigtiff ? 1 : 0);
+}
+
+const Strile *ConversionJournal::Find(unsigned page, uint32_t index) const {
+  if (page >= tiles_.size() || index >= tiles_[page].size() ||
+      !tiles_[page][index].bytecount)
+    return nullptr;
+  return &tiles_[page][index];
+}
+
+bool ConversionJournal::Record(unsigned page, uint32_t index, const Strile &strile) {
+  if (!Append("tile %u %" PRIu32 " %llu %llu\n", page, index,
+              static_cast<unsigned long long>(strile.offset),
+              static_cast<unsigned long long>(strile.bytecount)))
+    return false;
+  ++num_pending_;
+  const std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - last_checkpoint_;
+  if (num_pending_ < CHECKPOINT_TILES && elapsed.count() < CHECKPOINT_SECONDS)
+    return true;
+  return Checkpoint();
+}
+
+bool ConversionJournal::Checkpoint() {
+  last_checkpoint_ = std::chrono::steady_clock::now();
+  if (!num_pending_)
+    return true;
+  num_pending_ = 0;
+  // The tiles must be on disk before the records pointing at them.
+  if (!sink_->Sync())
+    return false;
+  if (!Append("checkpoint %llu\n", static_cast<unsigned long long>(sink_->Size())) ||
+      fflush(file_) != 0 || fsync(fileno(file_)) != 0) {
+    perror(path_.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ConversionJournal::Append(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  const int written = vfprintf(file_, format, args);
+  va_end(args);
+  if (written < 0) {
+    perror(path_.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,97 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __CONVERSION_JOURNAL_H_
+#define __CONVERSION_JOURNAL_H_
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "output-sink.h"
+#include "tiff-utils.h"
+
+// Records where the tiles of a pyramid went in its output file, so that an
+// interrupted conversion can continue from the last checkpoint.
+// Tiles are recorded as they are written, and made durable in batches: the
+// output is synced first, then the batch is appended to the journal and
+// synced, closed by a checkpoint line. Anything after the last checkpoint
+// is dropped when resuming.
+//
+// The journal is a text file:
+//   svg2svs-journal 1
+//   fingerprint <what the tiles depend on>
+//   bigtiff <0|1>
+//   tile <page> <index> <offset> <bytecount>
+//   ...
+//   checkpoint <bytes of the output it covers>
+class ConversionJournal {
+public:
+  ~ConversionJournal();
+
+  // Starts a new journal at `path`. `fingerprint` describes what the tiles
+  // depend on, on a single line.
+  // Returns nullptr after reporting the error.
+  static std::unique_ptr<ConversionJournal> Create(const char *path,
+                                                   const std::string &fingerprint);
+
+  // Loads the checkpointed tiles of the journal at `path` to continue it.
+  // Returns nullptr when there is no journal, or one for another
+  // fingerprint or without checkpoint, which are reported.
+  static std::unique_ptr<ConversionJournal> Resume(const char *path,
+                                                   const std::string &fingerprint);
+
+  // The output the tiles are written to, synced at each checkpoint. Must be
+  // set before the first record, and outlive the journal.
+  void set_sink(OutputSink *sink) { sink_ = sink; }
+
+  // Bytes at the start of the output covered by the last checkpoint.
+  uint64_t checkpoint_size() const { return checkpoint_size_; }
+
+  // The offsets size of the output, once recorded.
+  std::optional<bool> bigtiff() const { return bigtiff_; }
+  bool SetBigTiff(bool bigtiff);
+
+  // The tile `index` of page `page`, numbered from 1, when a checkpoint of
+  // the interrupted conversion has it.
+  const Strile *Find(unsigned page, uint32_t index) const;
+
+  // Records a tile just written to the sink. Checkpoints every few seconds
+  // or thousands of tiles.
+  bool Record(unsigned page, uint32_t index, const Strile &strile);
+
+  // Makes every recorded tile durable.
+  bool Checkpoint();
+
+private:
+  ConversionJournal(const char *path, FILE *file)
+    : path_(path), file_(file), sink_(nullptr), checkpoint_size_(0), num_pending_(0),
+      last_checkpoint_(std::chrono::steady_clock::now()) {}
+
+  // Appends a line, buffered until the next checkpoint.
+  bool Append(const char *format, ...);
+
+  const std::string path_;
+  FILE *file_;
+  OutputSink *sink_;
+  std::optional<bool> bigtiff_;
+  uint64_t checkpoint_size_;
+  // Checkpointed tiles by page and index, unset ones are zero.
+  std::vector<std::vector<Strile>> tiles_;
+  unsigned num_pending_;
+  std::chrono::steady_clock::time_point last_checkpoint_;
+};
+#endif // __CONVERSION_JOURNAL_H_
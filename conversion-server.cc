@@ -0,0 +1,390 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "output-sink.h"
+#include "conversion-server.h"
+
+#define MAX_HEADER_SIZE (64 * 1024)
+#define MAX_SVG_SIZE (1ULL << 30)
+// Connections still sending their request, each on its own thread.
+#define MAX_CONNECTIONS 256
+// Clients stalling in the middle of their request are dropped.
+#define RECEIVE_TIMEOUT_SECONDS 30
+// How often the accept loop checks for a stop request.
+#define ACCEPT_POLL_MILLISECONDS 200
+
+struct ConversionServer::Request {
+  int fd;
+  std::string name;  // the input path, or how the sent svg is referred to.
+  bool has_data;
+  std::string svg;  // the sent document.
+  std::string output;  // empty to send the svs back.
+  ConversionSettings settings;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+  stop_requested = 1;
+}
+
+static bool send_all(int fd, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  for (size_t done = 0; done < size; ) {
+    // Clients going away must not kill the server with SIGPIPE.
+    const ssize_t sent = send(fd, bytes + done, size - done, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+    done += sent;
+  }
+  return true;
+}
+
+static bool send_line(int fd, const std::string &line) {
+  const std::string terminated = line + "\n";
+  return send_all(fd, terminated.data(), terminated.size());
+}
+
+// Appends `size` bytes to `data`, which grows as they arrive rather than to
+// the size a client announced.
+static bool receive_appended(int fd, size_t size, std::string *data) {
+  char chunk[64 * 1024];
+  while (size > 0) {
+    const ssize_t received = recv(fd, chunk, std::min(size, sizeof(chunk)), 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return false;
+    data->append(chunk, received);
+    size -= received;
+  }
+  return true;
+}
+
+// Reads up to the empty line ending the header, `rest` receives the bytes
+// read past it.
+static bool receive_header(int fd, std::string *header, std::string *rest) {
+  std::string buffer;
+  char chunk[4096];
+  while (true) {
+    const size_t end = buffer.find("\n\n");
+    if (end != std::string::npos) {
+      *header = buffer.substr(0, end + 1);
+      *rest = buffer.substr(end + 2);
+      return true;
+    }
+    if (buffer.size() > MAX_HEADER_SIZE)
+      return false;
+    const ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return false;
+    buffer.append(chunk, received);
+  }
+}
+
+ConversionServer::ConversionServer(const ConversionSettings &defaults, unsigned num_threads,
+                                   unsigned max_jobs, unsigned max_queue)
+  : defaults_(defaults),
+    threads_per_job_(std::max(1u, num_threads / max_jobs)),
+    max_jobs_(max_jobs),
+    max_queue_(max_queue) {}
+
+ConversionServer::~ConversionServer() {}
+
+std::string ConversionServer::Parse(const std::string &header, Request *request,
+                                    uint64_t *svg_size) const {
+  std::istringstream lines(header);
+  std::string line;
+  bool has_input = false;
+  while (std::getline(lines, line)) {
+    const size_t space = line.find(' ');
+    const std::string key = line.substr(0, space);
+    const std::string value = (space == std::string::npos) ? "" : line.substr(space + 1);
+    char *end;
+    errno = 0;
+    if (key == "input") {
+      request->name = value;
+      has_input = true;
+    } else if (key == "svg") {
+      *svg_size = strtoull(value.c_str(), &end, 10);
+      if (*end != '\0' || *svg_size == 0 || *svg_size > MAX_SVG_SIZE)
+        return "invalid svg size";
+      request->name = "<svg data>";
+      request->has_data = true;
+    } else if (key == "output") {
+      request->output = value;
+    } else if (key == "base-width") {
+      request->settings.base_width = strtoul(value.c_str(), &end, 10);
+      if (*end != '\0' || request->settings.base_width == 0 || errno)
+        return "invalid base width";
+    } else if (key == "layers-factors") {
+      if (!parse_layers_factors(value.c_str(), &request->settings.layers_factors))
+        return "invalid factors";
+      std::sort(request->settings.layers_factors.begin(),
+                request->settings.layers_factors.end());
+    } else if (key == "codecs") {
+      if (!parse_codecs(value.c_str(), &request->settings.encoder.compressions))
+        return "invalid codecs";
+    } else if (key == "mpp") {
+      request->settings.metadata.mpp = strtod(value.c_str(), &end);
+      if (*end != '\0' || *request->settings.metadata.mpp <= 0 || errno)
+        return "invalid mpp";
+    } else if (key == "app-mag") {
+      request->settings.metadata.app_mag = strtol(value.c_str(), &end, 10);
+      if (*end != '\0' || *request->settings.metadata.app_mag <= 0 || errno)
+        return "invalid magnification";
+    } else {
+      return "unknown key " + key;
+    }
+  }
+  if (has_input == request->has_data)
+    return "expected either input or svg";
+  return "";
+}
+
+void ConversionServer::HandleConnection(int fd) {
+  std::unique_ptr<Request> request(new Request());
+  request->fd = fd;
+  request->has_data = false;
+  request->settings = defaults_;
+
+  std::string header, rest, error;
+  uint64_t svg_size = 0;
+  if (!receive_header(fd, &header, &rest))
+    error = "malformed request";
+  else
+    error = Parse(header, request.get(), &svg_size);
+  if (error.empty() && request->has_data && rest.size() > svg_size)
+    error = "data past the svg";
+
+  // Admission control, before any svg is received: waiting requests and
+  // those being received hold their svg in memory.
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error.empty() && queue_.size() + receiving_ >= max_queue_)
+      error = "busy";
+    if (error.empty())
+      ++receiving_;
+  }
+  if (!error.empty()) {
+    send_line(fd, "error " + error);
+    close(fd);
+    std::lock_guard<std::mutex> lock(mutex_);
+    --connections_;
+    // Under the lock: once it is released, the server may be gone.
+    changed_.notify_all();
+    return;
+  }
+
+  if (request->has_data) {
+    request->svg = std::move(rest);
+    if (!receive_appended(fd, svg_size - request->svg.size(), &request->svg))
+      error = "truncated svg";
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --receiving_;
+    if (error.empty()) {
+      send_line(fd, "queued " + std::to_string(queue_.size()));
+      queue_.push_back(std::move(request));
+    }
+    --connections_;
+    // Under the lock: once it is released, the server may be gone.
+    changed_.notify_all();
+  }
+
+  if (!error.empty()) {
+    send_line(fd, "error " + error);
+    close(fd);
+  }
+}
+
+void ConversionServer::RunWorker() {
+  while (true) {
+    std::unique_ptr<Request> request;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (queue_.empty())
+        return;
+      request = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    Convert(request.get());
+    close(request->fd);
+  }
+}
+
+void ConversionServer::Convert(Request *request) {
+  const int fd = request->fd;
+  send_line(fd, "started");
+
+  ConversionSettings settings = request->settings;
+  settings.encoder.threads = threads_per_job_;
+  settings.encoder.progress = false;
+  // One line per percent of each page. A client that went away does not
+  // stop the conversion.
+  unsigned last_page = 0, last_percent = 0;
+  settings.encoder.on_progress = [&](unsigned page, unsigned done, unsigned total) {
+    const unsigned percent = static_cast<uint64_t>(done) * 100 / total;
+    if (page == last_page && percent == last_percent)
+      return;
+    last_page = page;
+    last_percent = percent;
+    send_line(fd, "progress " + std::to_string(page) + " " + std::to_string(done) +
+              " " + std::to_string(total));
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  MemorySink memory;
+  std::unique_ptr<OutputSink> file;
+  OutputSink *out = &memory;
+  if (!request->output.empty()) {
+    file = open_file_sink(request->output.c_str(),
+                          settings.encoder.write_buffer_size.value_or(DEFAULT_WRITE_BUFFER_SIZE),
+                          settings.encoder.direct_io.value_or(false));
+    if (!file) {
+      send_line(fd, "error cannot create output");
+      return;
+    }
+    out = file.get();
+  }
+  bool ok = convert_svg(request->name, request->has_data ? &request->svg : nullptr,
+                        out, settings);
+  ok = out->Close() && ok;
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  fprintf(stderr, "%s %s in %.3f seconds\n", ok ? "done" : "FAILED",
+          request->name.c_str(), elapsed.count());
+  if (!ok) {
+    send_line(fd, "error conversion failed");
+    return;
+  }
+
+  char line[64];
+  snprintf(line, sizeof(line), "ok %.6f %llu", elapsed.count(),
+           static_cast<unsigned long long>(out->Size()));
+  if (send_line(fd, line) && request->output.empty())
+    send_all(fd, memory.data().data(), memory.data().size());
+}
+
+bool ConversionServer::Serve(const char *socket_path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s: socket path too long.\n", socket_path);
+    return false;
+  }
+  strcpy(address.sun_path, socket_path);
+  stop_requested = 0;
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) {
+    perror("socket()");
+    return false;
+  }
+  // Replace the socket of a previous run, but nothing else.
+  struct stat st;
+  if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(socket_path);
+  // Requests name files read and written with the server's privileges, only
+  // its user may connect.
+  const mode_t old_umask = umask(0177);
+  const bool bound =
+    bind(listener, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0;
+  umask(old_umask);
+  if (!bound || listen(listener, SOMAXCONN) != 0) {
+    perror(socket_path);
+    close(listener);
+    return false;
+  }
+
+  // Without SA_RESTART, so that poll() returns on a stop request.
+  struct sigaction stop = {}, old_int, old_term;
+  stop.sa_handler = request_stop;
+  sigaction(SIGINT, &stop, &old_int);
+  sigaction(SIGTERM, &stop, &old_term);
+
+  for (unsigned i = 0; i < max_jobs_; ++i)
+    workers_.emplace_back(&ConversionServer::RunWorker, this);
+  fprintf(stderr, "Listening on %s, %u conversions at once with %u threads each.\n",
+          socket_path, max_jobs_, threads_per_job_);
+
+  while (!stop_requested) {
+    struct pollfd incoming = { listener, POLLIN, 0 };
+    if (poll(&incoming, 1, ACCEPT_POLL_MILLISECONDS) <= 0)
+      continue;
+    const int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0)
+      continue;
+    struct ucred peer = {};
+    socklen_t peer_size = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) != 0 ||
+        peer.uid != getuid()) {
+      send_line(fd, "error permission denied");
+      close(fd);
+      continue;
+    }
+    struct timeval timeout = { RECEIVE_TIMEOUT_SECONDS, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    bool busy;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      busy = connections_ >= MAX_CONNECTIONS;
+      if (!busy)
+        ++connections_;
+    }
+    if (busy) {
+      send_line(fd, "error busy");
+      close(fd);
+      continue;
+    }
+    std::thread(&ConversionServer::HandleConnection, this, fd).detach();
+  }
+
+  close(listener);
+  unlink(socket_path);
+  sigaction(SIGINT, &old_int, nullptr);
+  sigaction(SIGTERM, &old_term, nullptr);
+  fprintf(stderr, "Stopping after the accepted requests.\n");
+
+  // Requests being received still get queued, and every queued one is
+  // converted.
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return connections_ == 0; });
+    stopping_ = true;
+  }
+  changed_.notify_all();
+  for (std::thread &worker : workers_)
+    worker.join();
+  workers_.clear();
+  return true;
+}
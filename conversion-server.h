@@ -0,0 +1,84 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __CONVERSION_SERVER_H_
+#define __CONVERSION_SERVER_H_
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "conversion.h"
+
+// Converts svg documents sent over a Unix domain socket, one request per
+// connection, keeping libvips and its caches warm between requests.
+//
+// A request is a header of "<key> <value>" lines ended by an empty line:
+//   input <path>            svg file to convert, or
+//   svg <size>              size of the svg document following the header.
+//   output <path>           where to write the svs, sent back when missing.
+//   base-width <width>      overrides the server's settings.
+//   layers-factors <factor>[,<factor>...]
+//   codecs <codec>[,<codec>...]
+//   mpp <microns>
+//   app-mag <magnification>
+//
+// The server answers with lines:
+//   queued <ahead>          accepted, behind <ahead> waiting requests.
+//   started
+//   progress <page> <done> <total>
+//   ok <seconds> <size>     followed by <size> bytes of svs without output.
+//   error <message>         ends the response, e.g. "error busy".
+class ConversionServer {
+public:
+  // Runs up to `max_jobs` conversions at once, sharing `num_threads`
+  // encoding threads. Requests beyond `max_queue` waiting or being received
+  // are turned down right after their header, before their svg is read.
+  // `max_queue` must be positive.
+  ConversionServer(const ConversionSettings &defaults, unsigned num_threads,
+                   unsigned max_jobs, unsigned max_queue);
+  ~ConversionServer();
+
+  // Serves requests on `socket_path` until SIGINT or SIGTERM, then
+  // finishes the accepted ones. The socket is only accessible to the user
+  // running the server. `vips` must be initialized.
+  bool Serve(const char *socket_path);
+
+private:
+  struct Request;
+
+  // Returns why the request is invalid, empty when it is valid.
+  std::string Parse(const std::string &header, Request *request, uint64_t *svg_size) const;
+  void HandleConnection(int fd);
+  void RunWorker();
+  void Convert(Request *request);
+
+  const ConversionSettings defaults_;
+  const unsigned threads_per_job_;
+  const unsigned max_jobs_;
+  const unsigned max_queue_;
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<std::unique_ptr<Request>> queue_;
+  unsigned connections_ = 0;  // still reading their request.
+  unsigned receiving_ = 0;  // admitted, receiving their svg.
+  bool stopping_ = false;  // no more requests will be queued.
+  std::vector<std::thread> workers_;
+};
+#endif // __CONVERSION_SERVER_H_
@@ -0,0 +1,661 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tiffio.h>
+#include <vips/vips8>
+
+#include "utils.h"
+#include "checkerboard-source.h"
+#include "conversion-journal.h"
+#include "raster-cache.h"
+#include "svs-update.h"
+#include "tile-pipeline.h"
+#include "conversion.h"
+#ifdef WITH_RSVG
+#include "svg-rasterizer.h"
+#endif
+
+// Native tiles per encoding thread granted to a file in a batch.
+#define TILES_PER_THREAD 256
+// Rows of the old and new renderings compared at once.
+#define DIFF_STRIP_ROWS 256
+// Native pixels tracked together by the dirty map, a power of two.
+#define DIRTY_CELL_SIZE 16
+
+using namespace vips;
+
+// We interpret the whole svg canvas as 100.
+static const unsigned kNumSubDivisions = 10 * 10;
+
+// An svg document, in a file or in memory.
+typedef struct {
+  const std::string &name;  // the path, or how to refer to the bytes in messages.
+  const std::string *data;  // nullptr to read the file.
+} SvgDocument;
+
+static VImage load_svg(const SvgDocument &svg, VOption *options) {
+  options->set("unlimited", true);
+  if (!svg.data)
+    return VImage::svgload(svg.name.c_str(), options);
+  // A copy, as libvips' operation cache may keep the image past the document.
+  VipsBlob *blob = vips_blob_copy(svg.data->data(), svg.data->size());
+  VImage image = VImage::svgload_buffer(blob, options);
+  vips_area_unref(VIPS_AREA(blob));
+  return image;
+}
+
+// Whether `svg` is a file libvips reads as a raster image rather than an
+// svg document.
+static bool is_raster(const SvgDocument &svg) {
+  if (svg.data)
+    return false;
+  const char *loader = vips_foreign_find_load(svg.name.c_str());
+  if (!loader) {
+    // Reported when it is opened as an svg.
+    vips_error_clear();
+    return false;
+  }
+  return !strstr(loader, "Svg");
+}
+
+// Size of the svg canvas at its default resolution, or of a raster image.
+static bool query_svg_size(const SvgDocument &svg, double *width, double *height) {
+  CheckerboardSpec checkerboard;
+  if (!svg.data && parse_checkerboard(svg.name, &checkerboard)) {
+    *width = *height = CHECKERBOARD_SIDE;
+    return true;
+  }
+  try {
+    const VImage image = is_raster(svg) ? VImage::new_from_file(svg.name.c_str())
+                                        : load_svg(svg, VImage::option());
+    *width = image.width();
+    *height = image.height();
+  } catch (const VError &error) {
+    fprintf(stderr, "%s: %s\n", svg.name.c_str(), error.what());
+    return false;
+  }
+  return true;
+}
+
+// The bytes of `svg`, read into `contents` when it is a file.
+static const std::string *svg_bytes(const SvgDocument &svg, std::string *contents) {
+  if (svg.data)
+    return svg.data;
+  std::ifstream file(svg.name, std::ios::binary);
+  std::ostringstream bytes;
+  if (!file || !(bytes << file.rdbuf())) {
+    perror(svg.name.c_str());
+    return nullptr;
+  }
+  *contents = bytes.str();
+  return contents;
+}
+
+static bool threaded_rasterizer(const ConversionSettings &settings) {
+#ifdef WITH_RSVG
+  return settings.rasterizer.value_or(SvgRasterizer::kThreaded) == SvgRasterizer::kThreaded;
+#else
+  return false;
+#endif
+}
+
+// Renders `svg`, whose bytes are `bytes` when already read,
+// `settings.base_width` pixels wide, without alpha.
+static bool rasterize_svg(const SvgDocument &svg, const std::string *bytes,
+                          const ConversionSettings &settings, VImage *out) {
+#ifdef WITH_RSVG
+  if (threaded_rasterizer(settings)) {
+    // Parsed once, for its size and by the first rendering thread.
+    std::unique_ptr<ThreadedSvg> document =
+      ThreadedSvg::Parse(*bytes, svg.data ? nullptr : svg.name.c_str());
+    return document && document->Render(settings.base_width * 72 / document->width(), out);
+  }
+#endif
+  double default_resolution_width, default_resolution_height;
+  if (!query_svg_size(svg, &default_resolution_width, &default_resolution_height))
+    return false;
+  const double dpi = settings.base_width * 72 / default_resolution_width;
+  VImage in = load_svg(svg, VImage::option()->set("dpi", dpi));
+  if (in.has_alpha())
+    in = in.extract_band(0, VImage::option()->set("n", 3));
+  *out = in;
+  return true;
+}
+
+// Opens the raster image at `path` as 8-bit RGB. Its pixels are only
+// decoded as the pyramid is written, once and from top to bottom when
+// `sequential`.
+static VImage load_raster(const std::string &path, bool sequential) {
+  VImage image = VImage::new_from_file(
+    path.c_str(), VImage::option()
+    ->set("access", sequential ? VIPS_ACCESS_SEQUENTIAL : VIPS_ACCESS_RANDOM));
+  // 8-bit sRGB first, alpha included, so that white is 255 whatever the
+  // depth of the input.
+  if (image.interpretation() != VIPS_INTERPRETATION_sRGB)
+    image = image.colourspace(VIPS_INTERPRETATION_sRGB);
+  // Scans are on white.
+  if (image.has_alpha())
+    image = image.flatten(VImage::option()->set("background", std::vector<double>{255}));
+  if (image.format() != VIPS_FORMAT_UCHAR)
+    image = image.cast(VIPS_FORMAT_UCHAR);
+  if (image.bands() != 3)
+    throw VError("cannot convert to RGB");
+  return image;
+}
+
+// Whether the first page of the raster image at `path` is a tiled TIFF,
+// e.g. an existing slide, whose tiles can be copied as they are. Its Aperio
+// metadata, when it has some, are read into `metadata`.
+static bool transcodable(const std::string &path, SvsMetadata *metadata) {
+  const char *loader = vips_foreign_find_load(path.c_str());
+  if (!loader || !(strstr(loader, "Tiff") || strstr(loader, "Openslide"))) {
+    vips_error_clear();
+    return false;
+  }
+  std::unique_ptr<TIFF, decltype(&TIFFClose)> tiff(TIFFOpen(path.c_str(), "r"), TIFFClose);
+  if (!tiff || !TIFFIsTiled(tiff.get()))
+    return false;
+  const char *description = nullptr;
+  if (TIFFGetField(tiff.get(), TIFFTAG_IMAGEDESCRIPTION, &description)) {
+    const char *mpp = strstr(description, "MPP = ");
+    const char *app_mag = strstr(description, "AppMag = ");
+    if (mpp && atof(mpp + 6) > 0)
+      metadata->mpp = atof(mpp + 6);
+    if (app_mag && atoi(app_mag + 9) > 0)
+      metadata->app_mag = atoi(app_mag + 9);
+  }
+  return true;
+}
+
+// Renders `svg` `settings.base_width` pixels wide and hands it to `encode`
+// with its metadata and the encoder options to use. Raster images keep
+// their size, and are read sequentially with `settings.sequential`.
+static bool render_svg(const SvgDocument &svg, const ConversionSettings &settings,
+                       EncodingStats *stats,
+                       const std::function<bool(const VImage &, const SvsMetadata &,
+                                                const SvsEncoderOptions &)> &encode) {
+  const auto start = std::chrono::steady_clock::now();
+  // Generated inputs are faster to draw again than to cache.
+  CheckerboardSpec checkerboard;
+  const bool generated = !svg.data && parse_checkerboard(svg.name, &checkerboard);
+  const bool raster = !generated && is_raster(svg);
+  std::string contents;
+  const std::string *bytes = svg.data;
+  if (!bytes && !generated && !raster && (settings.raster_cache || threaded_rasterizer(settings)) &&
+      !(bytes = svg_bytes(svg, &contents)))
+    return false;
+
+  try {
+    std::string key;
+    VImage in;
+    // Documents rendering what they reference are not cached, the
+    // references may change.
+    const bool cached = settings.raster_cache && !generated && !raster &&
+                        !references_external_resources(*bytes);
+    if (cached) {
+      key = raster_cache_key(*bytes, settings.base_width,
+                             threaded_rasterizer(settings) ? "threaded" : "libvips");
+      if (open_cached_raster(*settings.raster_cache, key, &in) && stats)
+        stats->raster_cached = true;
+    }
+    SvsEncoderOptions options = settings.encoder;
+    SvsMetadata slide_metadata = {};
+    if (generated) {
+      if (!checkerboard_image(checkerboard, settings.base_width, &in))
+        return false;
+    } else if (raster) {
+      in = load_raster(svg.name, settings.sequential);
+      options.sequential = settings.sequential;
+      if (settings.transcode && transcodable(svg.name, &slide_metadata))
+        options.transcode_from = svg.name;
+      else if (settings.transcode)
+        fprintf(stderr, "%s: not a tiled TIFF, its tiles are encoded again.\n",
+                svg.name.c_str());
+    } else if (in.is_null()) {
+      if (!rasterize_svg(svg, bytes, settings, &in))
+        return false;
+      // Falls back to the lazy rendering when the cache cannot take it.
+      if (cached)
+        cache_raster(*settings.raster_cache, key, in,
+                     settings.raster_cache_size.value_or(DEFAULT_RASTER_CACHE_SIZE), &in);
+    }
+
+    // Rendering itself is lazy, and accounted to the pages, unless it went
+    // into the cache.
+    if (stats) {
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      stats->load_seconds = elapsed.count();
+    }
+
+    SvsMetadata svs_metadata = {};
+    const double width = raster ? in.width() : settings.base_width;
+    // Scans know their resolution, in pixels per millimetre, slides tell it
+    // in their description.
+    svs_metadata.mpp = settings.metadata.mpp.value_or(slide_metadata.mpp.value_or(
+      raster && in.xres() > 1 ? 1000 / in.xres() : 10.0 * kNumSubDivisions / width));
+    svs_metadata.app_mag = settings.metadata.app_mag.value_or(
+      slide_metadata.app_mag.value_or(40));
+
+    if (!encode(in, svs_metadata, options)) {
+      fprintf(stderr, "Error while generating svs pyramid file.\n");
+      return false;
+    }
+  } catch (const VError &error) {
+    fprintf(stderr, "%s: %s\n", svg.name.c_str(), error.what());
+    return false;
+  }
+  return true;
+}
+
+// What the tiles of a conversion depend on: the input, as far as its size
+// and modification time tell, and every setting changing their pixels, their
+// layout or the directories.
+static bool journal_fingerprint(const std::string &input_svg,
+                                const ConversionSettings &settings, std::string *out) {
+  std::ostringstream fingerprint;
+  CheckerboardSpec checkerboard;
+  struct stat st;
+  if (parse_checkerboard(input_svg, &checkerboard)) {
+    fingerprint << "input=" << input_svg;
+  } else if (stat(input_svg.c_str(), &st) == 0) {
+    fingerprint << "size=" << st.st_size << " mtime=" << st.st_mtim.tv_sec << "."
+                << st.st_mtim.tv_nsec;
+  } else {
+    perror(input_svg.c_str());
+    return false;
+  }
+  const SvsEncoderOptions &options = settings.encoder;
+  fingerprint << " width=" << settings.base_width << " factors=";
+  for (const double factor : settings.layers_factors)
+    fingerprint << factor << ",";
+  fingerprint << " codecs=";
+  for (const TileCompression compression : options.compressions)
+    fingerprint << static_cast<int>(compression) << ",";
+  fingerprint << " encoder=" << static_cast<int>(options.encoder.value_or(TileEncoderType::kLibjpeg))
+              << " colorspace="
+              << static_cast<int>(options.jpeg_colorspace.value_or(JpegColorspace::kYCbCr))
+              << " optimize=" << options.optimize_coding.value_or(false)
+              << " cascade=" << options.cascade.value_or(false)
+              << " bigtiff=" << (options.bigtiff ? static_cast<int>(*options.bigtiff) : -1)
+              << " dedup=" << options.dedup.value_or(true)
+              << " order="
+              << static_cast<int>(options.tile_order.value_or(TileOrder::kRowMajor))
+              << " rasterizer=" << (threaded_rasterizer(settings) ? "threaded" : "libvips")
+              << " mpp=" << settings.metadata.mpp.value_or(0)
+              << " app_mag=" << settings.metadata.app_mag.value_or(0);
+  *out = fingerprint.str();
+  return true;
+}
+
+// Converts into "<output_svs>.partial", continuing it when its journal
+// matches, and renames it once complete.
+static bool convert_resumable(const std::string &input_svg, const std::string &output_svs,
+                              const ConversionSettings &settings, EncodingStats *stats) {
+  const std::string partial = output_svs + ".partial";
+  const std::string journal_path = output_svs + ".journal";
+  std::string fingerprint;
+  if (!journal_fingerprint(input_svg, settings, &fingerprint))
+    return false;
+
+  const size_t buffer_size = settings.encoder.write_buffer_size.value_or(DEFAULT_WRITE_BUFFER_SIZE);
+  const bool direct_io = settings.encoder.direct_io.value_or(false);
+  std::unique_ptr<ConversionJournal> journal =
+    ConversionJournal::Resume(journal_path.c_str(), fingerprint);
+  std::unique_ptr<OutputSink> sink;
+  if (journal) {
+    sink = open_file_sink(partial.c_str(), buffer_size, direct_io, journal->checkpoint_size());
+    if (sink)
+      fprintf(stderr, "Resuming %s after %.1f MiB.\n", output_svs.c_str(),
+              journal->checkpoint_size() / 1048576.0);
+  }
+  if (!sink) {
+    journal = ConversionJournal::Create(journal_path.c_str(), fingerprint);
+    if (!journal)
+      return false;
+    sink = open_file_sink(partial.c_str(), buffer_size, direct_io);
+    if (!sink)
+      return false;
+  }
+  journal->set_sink(sink.get());
+
+  ConversionSettings journaled = settings;
+  journaled.encoder.journal = journal.get();
+  bool ok = render_svg({input_svg, nullptr}, journaled, stats,
+                       [&](const VImage &in, const SvsMetadata &metadata,
+                           const SvsEncoderOptions &options) {
+    return vips2svs_encoder(in, sink.get(), journaled.layers_factors, metadata, options,
+                            stats);
+  });
+  ok = sink->Close() && ok;
+  journal.reset();
+  if (!ok) {
+    fprintf(stderr, "Run again with the same settings to resume %s.\n", output_svs.c_str());
+    return false;
+  }
+  if (rename(partial.c_str(), output_svs.c_str()) != 0) {
+    perror(output_svs.c_str());
+    return false;
+  }
+  unlink(journal_path.c_str());
+  return true;
+}
+
+bool convert_svg(const std::string &input_svg, const std::string &output_svs,
+                 const ConversionSettings &settings, EncodingStats *stats) {
+  if (settings.resume)
+    return convert_resumable(input_svg, output_svs, settings, stats);
+  return render_svg({input_svg, nullptr}, settings, stats,
+                    [&](const VImage &in, const SvsMetadata &metadata,
+                        const SvsEncoderOptions &options) {
+    return vips2svs_encoder(in, output_svs.c_str(), settings.layers_factors,
+                            metadata, options, stats);
+  });
+}
+
+bool convert_svg(const std::string &input_svg, const std::string *svg_data,
+                 OutputSink *out, const ConversionSettings &settings,
+                 EncodingStats *stats) {
+  return render_svg({input_svg, svg_data}, settings, stats,
+                    [&](const VImage &in, const SvsMetadata &metadata,
+                        const SvsEncoderOptions &options) {
+    return vips2svs_encoder(in, out, settings.layers_factors, metadata, options, stats);
+  });
+}
+
+// Renders `svg` at `dpi`, without its alpha channel.
+static VImage render_rgb(const SvgDocument &svg, double dpi) {
+  VImage image = load_svg(svg, VImage::option()->set("dpi", dpi));
+  if (image.has_alpha())
+    image = image.extract_band(0, VImage::option()->set("n", 3));
+  return image;
+}
+
+// Marks the native areas of `in` rendered differently from `old_svg`,
+// which is rendered the same way. Both are compared at native resolution,
+// strip by strip, so that no change is averaged away.
+static bool mark_changes(const SvgDocument &svg, const SvgDocument &old_svg,
+                         const ConversionSettings &settings, const VImage &in,
+                         DirtyMap *dirty) {
+  double width, height, old_width, old_height;
+  if (!query_svg_size(svg, &width, &height) ||
+      !query_svg_size(old_svg, &old_width, &old_height))
+    return false;
+  if (width != old_width || height != old_height) {
+    fprintf(stderr, "%s: the canvas size changed, the pyramid must be converted again.\n",
+            svg.name.c_str());
+    return false;
+  }
+
+  std::string contents;
+  const std::string *bytes = nullptr;
+  if (threaded_rasterizer(settings) && !(bytes = svg_bytes(old_svg, &contents)))
+    return false;
+  VImage old;
+  if (!rasterize_svg(old_svg, bytes, settings, &old))
+    return false;
+  if (old.width() != in.width() || old.height() != in.height()) {
+    fprintf(stderr, "%s: renders at a different size, the pyramid must be converted again.\n",
+            old_svg.name.c_str());
+    return false;
+  }
+
+  for (int top = 0; top < in.height(); top += DIFF_STRIP_ROWS) {
+    const int rows = std::min(DIFF_STRIP_ROWS, in.height() - top);
+    const VImage diff = (in.extract_area(0, top, in.width(), rows) !=
+                         old.extract_area(0, top, in.width(), rows)).bandor();
+    size_t size;
+    uint8_t *pixels = static_cast<uint8_t *>(diff.write_to_memory(&size));
+    for (int y = 0; y < rows; ++y) {
+      const uint8_t *line = pixels + static_cast<size_t>(y) * in.width();
+      for (int x = 0; x < in.width(); ++x)
+        if (line[x]) {
+          dirty->Mark(x, top + y, 1, 1);
+          // The rest of the cell is marked already.
+          x |= DIRTY_CELL_SIZE - 1;
+        }
+    }
+    g_free(pixels);
+  }
+  return true;
+}
+
+bool update_svg(const std::string &input_svg, const std::string &previous_svs,
+                const std::string &output_svs, const std::string &old_svg,
+                const std::vector<SvgRect> &dirty_rects, const ConversionSettings &settings,
+                EncodingStats *stats) {
+  const SvgDocument svg = {input_svg, nullptr};
+  double default_resolution_width, default_resolution_height;
+  if (!query_svg_size(svg, &default_resolution_width, &default_resolution_height))
+    return false;
+  const double dpi = settings.base_width * 72 / default_resolution_width;
+
+  return render_svg(svg, settings, stats, [&](const VImage &in, const SvsMetadata &,
+                                               const SvsEncoderOptions &options) {
+    DirtyMap dirty(in.width(), in.height(), DIRTY_CELL_SIZE);
+    if (!old_svg.empty() && !mark_changes(svg, {old_svg, nullptr}, settings, in, &dirty))
+      return false;
+    const double scale = settings.base_width / default_resolution_width;
+    for (const SvgRect &rect : dirty_rects) {
+      const int64_t x = std::floor(rect.x * scale);
+      const int64_t y = std::floor(rect.y * scale);
+      dirty.Mark(x, y, std::ceil((rect.x + rect.width) * scale) - x,
+                 std::ceil((rect.y + rect.height) * scale) - y);
+    }
+
+    // Rendered small directly, rather than resampled from the whole of `in`.
+    const double thumbnail_scale = (in.height() > in.width())
+      ? 768.0 / in.height()
+      : 1024.0 / in.width();
+    const VImage thumbnail = render_rgb(svg, dpi * std::min(1.0, thumbnail_scale * 2));
+    return vips2svs_update(in, thumbnail, previous_svs.c_str(), output_svs.c_str(),
+                           settings.layers_factors, dirty, options, stats);
+  });
+}
+
+bool parse_svg_rect(const char *rect, SvgRect *out) {
+  char end;
+  return sscanf(rect, "%lf,%lf,%lf,%lf%c", &out->x, &out->y, &out->width, &out->height,
+                &end) == 4 && out->width > 0 && out->height > 0;
+}
+
+// A rough upper bound of what converting a `width` x `height` native layer
+// holds in memory: the tiles cached in front of the rasterizer, the tiles in
+// flight in the pipeline, and the sublayers when they are materialized.
+static uint64_t conversion_memory(uint64_t width, uint64_t height,
+                                  const ConversionSettings &settings, unsigned threads) {
+  const uint64_t tiles_across = partition(width, 256);
+  const uint64_t cache = std::min<uint64_t>(VIPS_TILECACHE_TILES, tiles_across * 2) * TILE_BYTES;
+  const uint64_t in_flight = settings.encoder.max_tiles_in_flight.value_or(threads * 4);
+  // Encoded tiles are smaller than their pixels, count both.
+  const uint64_t pipeline = in_flight * TILE_BYTES * 2;
+  uint64_t layers = 0;
+  for (const double factor : settings.layers_factors)
+    layers += std::min<uint64_t>(width * height * 3 / (factor * factor),
+                                 MAX_IN_MEMORY_LEVEL_SIZE);
+  return cache + pipeline + layers;
+}
+
+std::vector<JobResult> convert_batch(const std::vector<ConversionJob> &jobs,
+                                     const ConversionSettings &settings,
+                                     unsigned num_threads, uint64_t memory_budget,
+                                     std::vector<EncodingStats> *stats) {
+  if (stats)
+    stats->assign(jobs.size(), {});
+
+  // Files that cannot even be parsed are failed right away.
+  std::vector<JobCost> costs(jobs.size());
+  std::vector<bool> readable(jobs.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    double width, height;
+    readable[i] = query_svg_size({jobs[i].input_svg, nullptr}, &width, &height);
+    if (!readable[i]) {
+      costs[i] = {1, 0};
+      continue;
+    }
+    // Raster images keep their size.
+    const bool raster = is_raster({jobs[i].input_svg, nullptr});
+    const uint64_t native_width = raster ? width : settings.base_width;
+    const uint64_t native_height =
+      raster ? height : std::max(1.0, std::round(height * native_width / width));
+    const uint64_t num_tiles = partition(native_width, 256) * partition(native_height, 256);
+    const unsigned threads = std::clamp<uint64_t>(num_tiles / TILES_PER_THREAD, 1, num_threads);
+    costs[i] = {threads, conversion_memory(native_width, native_height, settings, threads)};
+  }
+
+  JobScheduler scheduler(num_threads, memory_budget);
+  return scheduler.Run(costs, [&](size_t index, unsigned threads) {
+    if (!readable[index])
+      return false;
+    ConversionSettings job_settings = settings;
+    job_settings.encoder.threads = threads;
+    job_settings.encoder.progress = false;
+    // At least its share of the budget by threads, or what it was admitted
+    // with when it needs more.
+    job_settings.encoder.max_memory = std::min(
+      memory_budget, std::max(costs[index].memory, memory_budget * threads / num_threads));
+    // Each job only touches its own entry.
+    const bool ok = convert_svg(jobs[index].input_svg, jobs[index].output_svs, job_settings,
+                                stats ? &(*stats)[index] : nullptr);
+    fprintf(stderr, "%s %s\n", ok ? "done" : "FAILED", jobs[index].output_svs.c_str());
+    return ok;
+  });
+}
+
+bool read_manifest(const char *path, std::vector<ConversionJob> *jobs) {
+  std::ifstream manifest(path);
+  if (!manifest) {
+    perror(path);
+    return false;
+  }
+
+  std::string line;
+  for (unsigned number = 1; std::getline(manifest, line); ++number) {
+    std::istringstream fields(line);
+    ConversionJob job;
+    if (!(fields >> job.input_svg) || job.input_svg[0] == '#')
+      continue;
+    std::string extra;
+    if (!(fields >> job.output_svs) || (fields >> extra)) {
+      fprintf(stderr, "%s:%u: expected \"<input-svg> <output-svs>\".\n", path, number);
+      return false;
+    }
+    jobs->push_back(job);
+  }
+  return true;
+}
+
+void print_batch_report(FILE *out, const std::vector<ConversionJob> &jobs,
+                        const std::vector<JobResult> &results) {
+  unsigned failed = 0;
+  double total_seconds = 0;
+  fprintf(out, "%-6s %10s %8s  %s\n", "status", "seconds", "threads", "input -> output");
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const JobResult &result = results[i];
+    failed += !result.ok;
+    total_seconds += result.seconds;
+    fprintf(out, "%-6s %10.3f %8u  %s -> %s\n", result.ok ? "ok" : "FAILED",
+            result.seconds, result.threads, jobs[i].input_svg.c_str(),
+            jobs[i].output_svs.c_str());
+  }
+  fprintf(out, "%zu files, %u failed, %.3f seconds of conversions.\n",
+          jobs.size(), failed, total_seconds);
+}
+
+// Paths are written as is, only quotes and backslashes are escaped.
+static void write_json_string(FILE *out, const std::string &value) {
+  fputc('"', out);
+  for (const char c : value) {
+    if (c == '"' || c == '\\')
+      fputc('\\', out);
+    fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+bool write_run_report(const char *path, const std::vector<ConversionJob> &jobs,
+                      const std::vector<JobResult> &results,
+                      const std::vector<EncodingStats> &stats) {
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror(path);
+    return false;
+  }
+
+  fprintf(out, "{\n  \"files\": [\n");
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    fprintf(out, "    {\n      \"input\": ");
+    write_json_string(out, jobs[i].input_svg);
+    fprintf(out, ",\n      \"output\": ");
+    write_json_string(out, jobs[i].output_svs);
+    fprintf(out, ",\n      \"ok\": %s,\n      \"seconds\": %.6f,\n"
+            "      \"threads\": %u,\n      \"stats\": ",
+            results[i].ok ? "true" : "false", results[i].seconds, results[i].threads);
+    write_stats_json(out, stats[i], "      ");
+    fprintf(out, "\n    }%s\n", (i + 1 < jobs.size()) ? "," : "");
+  }
+  fprintf(out, "  ],\n  \"peak_rss_bytes\": %llu\n}\n",
+          static_cast<unsigned long long>(peak_rss_bytes()));
+
+  if (fclose(out) != 0) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+bool parse_layers_factors(const char *layers_factors, std::vector<double> *out) {
+  out->clear();
+  const char *pos = layers_factors;
+  while (*pos != '\0') {
+    errno = 0;
+    char *end;
+    const double factor = strtod(pos, &end);
+    if (factor == 0.0 || errno > 0) {
+      return false;
+    }
+    pos = end;
+    if (*pos == ',')
+      pos++;
+    out->push_back(factor);
+  }
+  return true;
+}
+
+bool parse_codecs(const char *codecs, std::vector<TileCompression> *out) {
+  out->clear();
+  std::string list(codecs);
+  size_t begin = 0;
+  while (begin <= list.size()) {
+    size_t end = list.find(',', begin);
+    if (end == std::string::npos)
+      end = list.size();
+    TileCompression compression;
+    if (!parse_tile_compression(list.substr(begin, end - begin).c_str(), &compression))
+      return false;
+    out->push_back(compression);
+    begin = end + 1;
+  }
+  return true;
+}
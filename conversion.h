@@ -0,0 +1,120 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __CONVERSION_H_
+#define __CONVERSION_H_
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "aperio-svs-encoding.h"
+#include "job-scheduler.h"
+
+// How svg documents are rendered.
+enum class SvgRasterizer {
+  kThreaded,  // a librsvg handle per thread, when built with librsvg.
+  kLibvips,   // libvips' svgload, which renders on one thread at a time.
+};
+
+// Settings shared by every file of a run.
+typedef struct {
+  unsigned long base_width;  // width of the native layer of svg inputs.
+  std::vector<double> layers_factors;  // sorted.
+  SvsEncoderOptions encoder;
+  SvsMetadata metadata;  // unset values are derived from the base width.
+  std::optional<SvgRasterizer> rasterizer;  // threaded by default.
+  // Raster inputs are read once, top to bottom, as their pyramid is
+  // written, holding a few rows of tiles rather than the whole image.
+  bool sequential;
+  // Directory of native layers rasterized by earlier conversions.
+  std::optional<std::string> raster_cache;
+  std::optional<uint64_t> raster_cache_size;  // bytes, DEFAULT_RASTER_CACHE_SIZE by default.
+  // Output files are written aside with a journal, and a conversion
+  // interrupted with the same settings continues from its last checkpoint.
+  bool resume;
+  // Tiled TIFF inputs, such as existing slides, keep the compressed tiles
+  // of their first page as the native layer, with their Aperio metadata.
+  bool transcode;
+} ConversionSettings;
+
+typedef struct {
+  std::string input_svg;
+  std::string output_svs;
+} ConversionJob;
+
+// A rectangle of the svg canvas, in user units.
+typedef struct {
+  double x;
+  double y;
+  double width;
+  double height;
+} SvgRect;
+
+// Renders `input_svg` `settings.base_width` pixels wide and encodes it as
+// an Aperio pyramid in `output_svs`. Raster images libvips can read are
+// encoded at their own size instead. Errors are reported on stderr.
+// With `settings.resume`, the pyramid is written to "<output_svs>.partial",
+// journaled in "<output_svs>.journal", and renamed once complete.
+// `vips` must be initialized. `stats`, when set, receives the timings.
+bool convert_svg(const std::string &input_svg, const std::string &output_svs,
+                 const ConversionSettings &settings, EncodingStats *stats = nullptr);
+
+// Same, writing to `out` which is not closed. The document is read from
+// `svg_data` when it is set, `input_svg` then only names it in messages.
+bool convert_svg(const std::string &input_svg, const std::string *svg_data,
+                 OutputSink *out, const ConversionSettings &settings,
+                 EncodingStats *stats = nullptr);
+
+// Writes `output_svs` from `previous_svs`, converted by convert_svg with the
+// same settings from an older version of `input_svg`. Only the tiles
+// covering what changed are encoded again: the areas rendering differently
+// from `old_svg` when it is not empty, and the `dirty` rectangles.
+bool update_svg(const std::string &input_svg, const std::string &previous_svs,
+                const std::string &output_svs, const std::string &old_svg,
+                const std::vector<SvgRect> &dirty, const ConversionSettings &settings,
+                EncodingStats *stats = nullptr);
+
+// Parses a "<x>,<y>,<width>,<height>" rectangle.
+bool parse_svg_rect(const char *rect, SvgRect *out);
+
+// Converts every job in one process, several files at once within
+// `num_threads` threads and `memory_budget` bytes. Small files get a single
+// thread, large ones up to all of them, and each a part of the budget.
+// Returns the result of each job, in order, and their timings in `stats`
+// when it is set.
+std::vector<JobResult> convert_batch(const std::vector<ConversionJob> &jobs,
+                                     const ConversionSettings &settings,
+                                     unsigned num_threads, uint64_t memory_budget,
+                                     std::vector<EncodingStats> *stats = nullptr);
+
+// Reads a batch manifest: one "<input-svg> <output-svs>" pair per line,
+// blank lines and lines starting with '#' are ignored.
+bool read_manifest(const char *path, std::vector<ConversionJob> *jobs);
+
+// Parses comma separated downsampling factors, e.g. "4,16,64".
+bool parse_layers_factors(const char *layers_factors, std::vector<double> *out);
+
+// Parses comma separated compression names, e.g. "jpeg,webp".
+bool parse_codecs(const char *codecs, std::vector<TileCompression> *out);
+
+// Prints the outcome of every job and a summary.
+void print_batch_report(FILE *out, const std::vector<ConversionJob> &jobs,
+                        const std::vector<JobResult> &results);
+
+// Writes the outcome and timings of every job as JSON.
+bool write_run_report(const char *path, const std::vector<ConversionJob> &jobs,
+                      const std::vector<JobResult> &results,
+                      const std::vector<EncodingStats> &stats);
+#endif // __CONVERSION_H_
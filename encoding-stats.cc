@@ -0,0 +1,55 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cstdio>
+#include <sys/resource.h>
+
+#include "encoding-stats.h"
+
+uint64_t peak_rss_bytes() {
+  struct rusage usage = {};
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+void write_stats_json(FILE *out, const EncodingStats &stats, const char *indent) {
+  fprintf(out, "{\n");
+  fprintf(out, "%s  \"load_seconds\": %.6f,\n", indent, stats.load_seconds);
+  fprintf(out, "%s  \"raster_cached\": %s,\n", indent, stats.raster_cached ? "true" : "false");
+  fprintf(out, "%s  \"total_seconds\": %.6f,\n", indent, stats.total_seconds);
+  fprintf(out, "%s  \"peak_rss_bytes\": %llu,\n", indent,
+          static_cast<unsigned long long>(stats.peak_rss_bytes));
+  fprintf(out, "%s  \"pages\": [\n", indent);
+  for (size_t i = 0; i < stats.pages.size(); ++i) {
+    const PageStats &page = stats.pages[i];
+    const double seconds = page.wall_seconds > 0 ? page.wall_seconds : 1e-9;
+    fprintf(out, "%s    {\"kind\": \"%s\", \"width\": %u, \"height\": %u, "
+            "\"tiles\": %u, \"duplicates\": %u, \"copied\": %u, \"resumed\": %u, \"raw_bytes\": %llu, \"encoded_bytes\": %llu, "
+            "\"extract_seconds\": %.6f, \"reduce_seconds\": %.6f, \"encode_seconds\": %.6f, "
+            "\"write_seconds\": %.6f, \"wall_seconds\": %.6f, "
+            "\"tiles_per_second\": %.3f, \"mb_per_second\": %.3f}%s\n",
+            indent, page.kind.c_str(), page.width, page.height, page.tiles,
+            page.duplicates, page.copied, page.resumed,
+            static_cast<unsigned long long>(page.raw_bytes),
+            static_cast<unsigned long long>(page.encoded_bytes),
+            page.extract_seconds, page.reduce_seconds, page.encode_seconds,
+            page.write_seconds, page.wall_seconds, page.tiles / seconds,
+            page.raw_bytes / seconds / 1e6, (i + 1 < stats.pages.size()) ? "," : "");
+  }
+  fprintf(out, "%s  ]\n%s}", indent, indent);
+}
@@ -0,0 +1,91 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __ENCODING_STATS_H_
+#define __ENCODING_STATS_H_
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Where the time of one page went. Stage times are summed over the threads
+// running them, so they can exceed `wall_seconds`.
+typedef struct {
+  std::string kind;  // "native", "thumbnail" or "sublayer".
+  unsigned width;
+  unsigned height;
+  unsigned tiles;
+  unsigned duplicates;
+  unsigned copied;  // from a previous version of the file.
+  unsigned resumed;  // written by an interrupted conversion.
+  uint64_t raw_bytes;  // pixels fed to the encoders.
+  uint64_t encoded_bytes;  // written to the file.
+  // Pixels coming out of libvips. Rendering is lazy, so this includes
+  // rasterizing or resampling the source of the page.
+  double extract_seconds;
+  double reduce_seconds;  // single pass pyramid accumulation.
+  double encode_seconds;
+  double write_seconds;
+  double wall_seconds;
+} PageStats;
+
+typedef struct {
+  double load_seconds;  // opening and parsing the input.
+  bool raster_cached;  // the input was rasterized by an earlier conversion.
+  double total_seconds;
+  std::vector<PageStats> pages;
+  uint64_t peak_rss_bytes;  // of the whole process, when the pyramid was done.
+} EncodingStats;
+
+// Counters updated concurrently by the workers of a page.
+struct PageCounters {
+  std::atomic<uint64_t> extract_ns{0};
+  std::atomic<uint64_t> reduce_ns{0};
+  std::atomic<uint64_t> encode_ns{0};
+  std::atomic<uint64_t> write_ns{0};
+  std::atomic<uint64_t> encoded_bytes{0};
+};
+
+// Adds the lifetime of the timer to a counter.
+class StageTimer {
+public:
+  explicit StageTimer(std::atomic<uint64_t> *counter)
+    : counter_(counter), start_(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    const auto elapsed = std::chrono::steady_clock::now() - start_;
+    counter_->fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+      std::memory_order_relaxed);
+  }
+
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+  std::atomic<uint64_t> *counter_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+inline double to_seconds(const std::atomic<uint64_t> &nanoseconds) {
+  return nanoseconds.load(std::memory_order_relaxed) / 1e9;
+}
+
+// Peak resident set size of the process, in bytes.
+uint64_t peak_rss_bytes();
+
+// Writes `stats` as a JSON object, every line but the first prefixed with
+// `indent`.
+void write_stats_json(FILE *out, const EncodingStats &stats, const char *indent);
+#endif // __ENCODING_STATS_H_
@@ -0,0 +1,106 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+#include "job-scheduler.h"
+
+JobScheduler::JobScheduler(unsigned num_threads, uint64_t memory_budget)
+  : num_threads_(std::max(1u, num_threads)), memory_budget_(memory_budget) {}
+
+std::vector<JobResult> JobScheduler::Run(const std::vector<JobCost> &costs,
+                                         const Job &job) {
+  std::vector<JobResult> results(costs.size());
+  std::list<size_t> pending;
+  for (size_t i = 0; i < costs.size(); ++i)
+    pending.push_back(i);
+  pending.sort([&](size_t a, size_t b) {
+    if (costs[a].threads != costs[b].threads)
+      return costs[a].threads > costs[b].threads;
+    return costs[a].memory > costs[b].memory;
+  });
+
+  std::mutex mutex;
+  std::condition_variable released;
+  unsigned free_threads = num_threads_;
+  uint64_t free_memory = memory_budget_;
+  unsigned running = 0;
+
+  // Each runner takes the largest pending job that fits, so there are never
+  // more jobs running than threads.
+  auto runner = [&]() {
+    for (;;) {
+      size_t index = 0;
+      unsigned threads = 0;
+      uint64_t memory = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::list<size_t>::iterator next = pending.end();
+        released.wait(lock, [&] {
+          if (pending.empty())
+            return true;
+          next = std::find_if(pending.begin(), pending.end(), [&](size_t i) {
+            return running == 0 ||
+              (costs[i].threads <= free_threads && costs[i].memory <= free_memory);
+          });
+          return next != pending.end();
+        });
+        if (pending.empty())
+          return;
+
+        index = *next;
+        pending.erase(next);
+        // Only a job running alone can ask for more than what is free.
+        threads = std::max(1u, std::min(costs[index].threads, free_threads));
+        memory = std::min(costs[index].memory, free_memory);
+        free_threads -= threads;
+        free_memory -= memory;
+        ++running;
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      const bool ok = job(index, threads);
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      results[index] = {ok, elapsed.count(), threads};
+      free_threads += threads;
+      free_memory += memory;
+      --running;
+      released.notify_all();
+    }
+  };
+
+  const unsigned num_runners = std::min<size_t>(num_threads_, costs.size());
+  std::vector<std::thread> runners;
+  runners.reserve(num_runners);
+  for (unsigned i = 0; i < num_runners; ++i)
+    runners.emplace_back(runner);
+  for (std::thread &thread : runners)
+    thread.join();
+  return results;
+}
+
+uint64_t default_memory_budget() {
+  const long pages = sysconf(_SC_PHYS_PAGES);
+  const long page_size = sysconf(_SC_PAGE_SIZE);
+  if (pages <= 0 || page_size <= 0)
+    return 4ULL << 30;
+  return static_cast<uint64_t>(pages) * page_size / 2;
+}
@@ -0,0 +1,56 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __JOB_SCHEDULER_H_
+#define __JOB_SCHEDULER_H_
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Resources a job needs to run.
+typedef struct {
+  unsigned threads;
+  uint64_t memory;  // bytes.
+} JobCost;
+
+typedef struct {
+  bool ok;
+  double seconds;
+  unsigned threads;  // granted to the job.
+} JobResult;
+
+// Runs independent jobs concurrently within a global thread and memory
+// budget.
+// Jobs are started largest first, smaller ones fill the remaining budget as
+// long as they fit. A job larger than the whole budget runs alone.
+class JobScheduler {
+public:
+  // `index` is the job's position in `costs`, `threads` the number of
+  // threads it may use.
+  using Job = std::function<bool(size_t index, unsigned threads)>;
+
+  JobScheduler(unsigned num_threads, uint64_t memory_budget);
+
+  // Runs every job and returns their results, in the order of `costs`.
+  // A failing job does not stop the others.
+  std::vector<JobResult> Run(const std::vector<JobCost> &costs, const Job &job);
+
+private:
+  const unsigned num_threads_;
+  const uint64_t memory_budget_;
+};
+
+// Half of the physical memory, leaving room for the page cache.
+uint64_t default_memory_budget();
+#endif // __JOB_SCHEDULER_H_
@@ -0,0 +1,150 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <openjpeg.h>
+
+#include "utils.h"
+#include "color-convert.h"
+#include "jp2k-encoder.h"
+
+// OpenJPEG's default number of resolutions, lowered for small blocks.
+#define MAX_RESOLUTIONS 6
+
+// The codestream is written into a growable vector. J2K writers seek back
+// to patch marker lengths, so the position is tracked separately.
+typedef struct {
+  std::vector<uint8_t> data;
+  size_t position;
+} MemoryStream;
+
+static OPJ_SIZE_T write_stream(void *buffer, OPJ_SIZE_T size, void *user_data) {
+  MemoryStream *stream = static_cast<MemoryStream *>(user_data);
+  if (stream->position + size > stream->data.size())
+    stream->data.resize(stream->position + size);
+  memcpy(stream->data.data() + stream->position, buffer, size);
+  stream->position += size;
+  return size;
+}
+
+static OPJ_OFF_T skip_stream(OPJ_OFF_T size, void *user_data) {
+  MemoryStream *stream = static_cast<MemoryStream *>(user_data);
+  stream->position += size;
+  if (stream->position > stream->data.size())
+    stream->data.resize(stream->position);
+  return size;
+}
+
+static OPJ_BOOL seek_stream(OPJ_OFF_T position, void *user_data) {
+  MemoryStream *stream = static_cast<MemoryStream *>(user_data);
+  stream->position = position;
+  if (stream->position > stream->data.size())
+    stream->data.resize(stream->position);
+  return OPJ_TRUE;
+}
+
+static void on_opj_error(const char *message, void *) {
+  fprintf(stderr, "openjpeg: %s", message);
+}
+
+// Enough resolutions for the transform, at most one per halving of the
+// smallest side.
+static unsigned num_resolutions(unsigned width, unsigned height) {
+  unsigned resolutions = 1;
+  for (unsigned side = std::min(width, height); side > 1 && resolutions < MAX_RESOLUTIONS;
+       side /= 2)
+    ++resolutions;
+  return resolutions;
+}
+
+Jp2kEncoder::Jp2kEncoder(int quality, bool ycbcr)
+  : psnr_(30.0f + std::clamp(quality, 0, 100) / 4.0f), ycbcr_(ycbcr) {}
+
+bool Jp2kEncoder::Encode(const uint8_t *pixels, unsigned width, unsigned height,
+                         size_t stride, Buffer *out) {
+  opj_image_cmptparm_t components[3];
+  memset(components, 0, sizeof(components));
+  for (opj_image_cmptparm_t &component : components) {
+    component.dx = 1;
+    component.dy = 1;
+    component.w = width;
+    component.h = height;
+    component.prec = 8;
+    component.sgnd = 0;
+  }
+  opj_image_t *image = opj_image_create(3, components,
+                                        ycbcr_ ? OPJ_CLRSPC_SYCC : OPJ_CLRSPC_SRGB);
+  if (!image)
+    return false;
+  image->x1 = width;
+  image->y1 = height;
+
+  // OpenJPEG takes one array per component.
+  const size_t plane_size = static_cast<size_t>(width) * height;
+  const uint8_t *source = pixels;
+  size_t source_stride = stride;
+  unsigned step = 3;
+  if (ycbcr_) {
+    planes_.resize(plane_size * 3);
+    const YCbCrPlanes planes = {planes_.data(), width, planes_.data() + plane_size,
+                                planes_.data() + plane_size * 2, width};
+    rgb_to_ycbcr444(pixels, stride, width, height, planes);
+    source = planes_.data();
+    source_stride = width;
+    step = 1;
+  }
+  for (unsigned c = 0; c < 3; ++c) {
+    OPJ_INT32 *data = image->comps[c].data;
+    const uint8_t *plane = ycbcr_ ? source + c * plane_size : source + c;
+    for (unsigned y = 0; y < height; ++y) {
+      const uint8_t *row = plane + y * source_stride;
+      for (unsigned x = 0; x < width; ++x)
+        data[y * width + x] = row[x * step];
+    }
+  }
+
+  opj_cparameters_t parameters;
+  opj_set_default_encoder_parameters(&parameters);
+  parameters.tcp_numlayers = 1;
+  parameters.cp_fixed_quality = 1;
+  parameters.tcp_distoratio[0] = psnr_;
+  parameters.irreversible = 1;
+  parameters.tcp_mct = ycbcr_ ? 0 : 1;
+  parameters.numresolution = num_resolutions(width, height);
+
+  MemoryStream output = {};
+  opj_codec_t *codec = opj_create_compress(OPJ_CODEC_J2K);
+  opj_set_error_handler(codec, on_opj_error, nullptr);
+  opj_stream_t *stream = opj_stream_default_create(OPJ_FALSE);
+  opj_stream_set_user_data(stream, &output, nullptr);
+  opj_stream_set_write_function(stream, write_stream);
+  opj_stream_set_skip_function(stream, skip_stream);
+  opj_stream_set_seek_function(stream, seek_stream);
+
+  const bool ok = opj_setup_encoder(codec, &parameters, image) &&
+    opj_start_compress(codec, image, stream) &&
+    opj_encode(codec, stream) &&
+    opj_end_compress(codec, stream);
+
+  opj_stream_destroy(stream);
+  opj_destroy_codec(codec);
+  opj_image_destroy(image);
+  if (!ok)
+    return false;
+
+  *out = allocate_buffer(output.data.size());
+  memcpy(out->data.get(), output.data.data(), output.data.size());
+  return true;
+}
@@ -0,0 +1,39 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __JP2K_ENCODER_H_
+#define __JP2K_ENCODER_H_
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+#include "tile-encoder.h"
+
+// Compresses RGB pixel blocks into raw JPEG 2000 codestreams, as stored by
+// Aperio in pages with compression 33003 (YCbCr components) or 33005 (RGB
+// components with the irreversible colour transform).
+// `quality` is mapped to a target PSNR, from 30dB at 0 to 55dB at 100.
+class Jp2kEncoder : public TileEncoder {
+public:
+  Jp2kEncoder(int quality, bool ycbcr);
+
+  bool Encode(const uint8_t *pixels, unsigned width, unsigned height,
+              size_t stride, Buffer *out) override;
+
+private:
+  const float psnr_;
+  const bool ycbcr_;
+  std::vector<uint8_t> planes_;
+};
+#endif // __JP2K_ENCODER_H_
@@ -0,0 +1,203 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <jpeglib.h>
+
+#include "utils.h"
+#include "color-convert.h"
+#include "jpeg-encoder.h"
+
+// Initial size of the output stream, grown on demand.
+#define OUTPUT_CHUNK_SIZE (64 * 1024)
+// Luma rows and columns of a 4:2:0 MCU.
+#define MCU_SIZE (2 * DCTSIZE)
+
+static void on_jpeg_error(j_common_ptr cinfo) {
+  JpegEncoder::ErrorManager *error =
+    reinterpret_cast<JpegEncoder::ErrorManager *>(cinfo->err);
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  fprintf(stderr, "libjpeg: %s\n", message);
+  longjmp(error->jump, 1);
+}
+
+// The destination manager writes into the encoder's growable `output_`.
+static std::vector<uint8_t> *destination_output(j_compress_ptr cinfo) {
+  return static_cast<std::vector<uint8_t> *>(cinfo->client_data);
+}
+
+static void init_destination(j_compress_ptr cinfo) {
+  std::vector<uint8_t> *output = destination_output(cinfo);
+  output->resize(std::max<size_t>(output->capacity(), OUTPUT_CHUNK_SIZE));
+  cinfo->dest->next_output_byte = output->data();
+  cinfo->dest->free_in_buffer = output->size();
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo) {
+  std::vector<uint8_t> *output = destination_output(cinfo);
+  const size_t used = output->size();
+  output->resize(used * 2);
+  cinfo->dest->next_output_byte = output->data() + used;
+  cinfo->dest->free_in_buffer = output->size() - used;
+  return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo) {
+  std::vector<uint8_t> *output = destination_output(cinfo);
+  output->resize(output->size() - cinfo->dest->free_in_buffer);
+}
+
+static void copy_output(const std::vector<uint8_t> &output, Buffer *out) {
+  *out = allocate_buffer(output.size());
+  memcpy(out->data.get(), output.data(), output.size());
+}
+
+JpegEncoder::JpegEncoder(int quality, bool optimize_coding,
+                         JpegColorspace colorspace)
+  : quality_(quality), optimize_coding_(optimize_coding),
+    colorspace_(colorspace) {
+  cinfo_.err = jpeg_std_error(&error_.pub);
+  error_.pub.error_exit = on_jpeg_error;
+  jpeg_create_compress(&cinfo_);
+
+  cinfo_.client_data = &output_;
+  destination_.init_destination = init_destination;
+  destination_.empty_output_buffer = empty_output_buffer;
+  destination_.term_destination = term_destination;
+  cinfo_.dest = &destination_;
+}
+
+JpegEncoder::~JpegEncoder() {
+  jpeg_destroy_compress(&cinfo_);
+}
+
+// Mirrors libtiff's JPEG codec setup: components are stored as RGB, or as
+// YCbCr with 2x2 subsampled chroma, without JFIF or Adobe markers.
+void JpegEncoder::Configure(unsigned width, unsigned height) {
+  const bool ycbcr = colorspace_ == JpegColorspace::kYCbCr;
+  cinfo_.image_width = width;
+  cinfo_.image_height = height;
+  cinfo_.input_components = 3;
+  cinfo_.in_color_space = ycbcr ? JCS_YCbCr : JCS_RGB;
+  jpeg_set_defaults(&cinfo_);
+  // The defaults for YCbCr are already 2x2 luma, 1x1 chroma.
+  jpeg_set_colorspace(&cinfo_, ycbcr ? JCS_YCbCr : JCS_RGB);
+  cinfo_.raw_data_in = ycbcr;
+  cinfo_.write_JFIF_header = FALSE;
+  cinfo_.write_Adobe_marker = FALSE;
+  jpeg_set_quality(&cinfo_, quality_, TRUE);
+  cinfo_.optimize_coding = optimize_coding_;
+}
+
+// Marks the Huffman tables as already written, so they stay out of a stream.
+static void suppress_huffman_tables(j_compress_ptr cinfo) {
+  for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+    if (cinfo->dc_huff_tbl_ptrs[i])
+      cinfo->dc_huff_tbl_ptrs[i]->sent_table = TRUE;
+    if (cinfo->ac_huff_tbl_ptrs[i])
+      cinfo->ac_huff_tbl_ptrs[i]->sent_table = TRUE;
+  }
+}
+
+// Repeats the last column and row of a `width` x `height` plane up to its
+// padded size.
+static void pad_plane(uint8_t *plane, size_t stride, unsigned width,
+                      unsigned height, unsigned padded_height) {
+  for (unsigned y = 0; y < height; ++y) {
+    uint8_t *row = plane + y * stride;
+    memset(row + width, row[width - 1], stride - width);
+  }
+  for (unsigned y = height; y < padded_height; ++y)
+    memcpy(plane + y * stride, plane + (height - 1) * stride, stride);
+}
+
+// Feeds the block to libjpeg as 4:2:0 planes, one MCU row at a time. libjpeg
+// reads whole MCUs, so planes are padded by repeating their edges.
+void JpegEncoder::WriteYCbCr(const uint8_t *pixels, unsigned width,
+                             unsigned height, size_t stride) {
+  const size_t luma_stride = (width + MCU_SIZE - 1) / MCU_SIZE * MCU_SIZE;
+  const unsigned luma_rows = (height + MCU_SIZE - 1) / MCU_SIZE * MCU_SIZE;
+  const size_t chroma_stride = luma_stride / 2;
+  const unsigned chroma_rows = luma_rows / 2;
+  luma_.resize(luma_stride * luma_rows);
+  cb_.resize(chroma_stride * chroma_rows);
+  cr_.resize(chroma_stride * chroma_rows);
+
+  const YCbCrPlanes planes = {luma_.data(), luma_stride, cb_.data(), cr_.data(),
+                              chroma_stride};
+  rgb_to_ycbcr420(pixels, stride, width, height, planes);
+  pad_plane(luma_.data(), luma_stride, width, height, luma_rows);
+  pad_plane(cb_.data(), chroma_stride, (width + 1) / 2, (height + 1) / 2, chroma_rows);
+  pad_plane(cr_.data(), chroma_stride, (width + 1) / 2, (height + 1) / 2, chroma_rows);
+
+  JSAMPROW luma_rows_ptr[MCU_SIZE];
+  JSAMPROW cb_rows_ptr[DCTSIZE];
+  JSAMPROW cr_rows_ptr[DCTSIZE];
+  JSAMPARRAY data[3] = {luma_rows_ptr, cb_rows_ptr, cr_rows_ptr};
+  while (cinfo_.next_scanline < cinfo_.image_height) {
+    const unsigned y = cinfo_.next_scanline;
+    for (unsigned i = 0; i < MCU_SIZE; ++i)
+      luma_rows_ptr[i] = luma_.data() + (y + i) * luma_stride;
+    for (unsigned i = 0; i < DCTSIZE; ++i) {
+      cb_rows_ptr[i] = cb_.data() + (y / 2 + i) * chroma_stride;
+      cr_rows_ptr[i] = cr_.data() + (y / 2 + i) * chroma_stride;
+    }
+    jpeg_write_raw_data(&cinfo_, data, MCU_SIZE);
+  }
+}
+
+bool JpegEncoder::Encode(const uint8_t *pixels, unsigned width, unsigned height,
+                         size_t stride, Buffer *out) {
+  if (setjmp(error_.jump)) {
+    jpeg_abort_compress(&cinfo_);
+    return false;
+  }
+
+  // Tables already stored in TIFFTAG_JPEGTABLES are left out. Optimal
+  // Huffman tables are computed per block and always written.
+  Configure(width, height);
+  jpeg_suppress_tables(&cinfo_, TRUE);
+  jpeg_start_compress(&cinfo_, FALSE);
+  if (colorspace_ == JpegColorspace::kYCbCr) {
+    WriteYCbCr(pixels, width, height, stride);
+  } else {
+    while (cinfo_.next_scanline < cinfo_.image_height) {
+      JSAMPROW row = const_cast<JSAMPROW>(pixels + cinfo_.next_scanline * stride);
+      jpeg_write_scanlines(&cinfo_, &row, 1);
+    }
+  }
+  jpeg_finish_compress(&cinfo_);
+
+  copy_output(output_, out);
+  return true;
+}
+
+bool JpegEncoder::Tables(Buffer *out) {
+  if (setjmp(error_.jump)) {
+    jpeg_abort_compress(&cinfo_);
+    return false;
+  }
+
+  // Any geometry will do, tables only depend on the quality.
+  Configure(16, 16);
+  if (optimize_coding_)
+    suppress_huffman_tables(&cinfo_);
+  jpeg_write_tables(&cinfo_);
+
+  copy_output(output_, out);
+  return true;
+}
@@ -0,0 +1,77 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __JPEG_ENCODER_H_
+#define __JPEG_ENCODER_H_
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <jpeglib.h>
+
+#include "utils.h"
+#include "tile-encoder.h"
+
+// libtiff's own default when no quality is set.
+#define DEFAULT_JPEG_QUALITY 75
+
+// Compresses RGB pixel blocks into abbreviated JPEG streams suitable for
+// TIFFWriteRawTile/TIFFWriteRawStrip on a PHOTOMETRIC_YCBCR or
+// PHOTOMETRIC_RGB page: the tables are left out of every block and stored
+// once in TIFFTAG_JPEGTABLES.
+// In YCbCr, pixels are converted and subsampled to 4:2:0 by our own SIMD
+// kernel and handed to libjpeg as raw planes.
+// The libjpeg compressor is created once and reused for every block, so an
+// encoder should be owned by a single thread.
+class JpegEncoder : public TileEncoder {
+public:
+  // With `optimize_coding`, every block carries its own optimal Huffman
+  // tables and only the quantization tables are shared.
+  explicit JpegEncoder(int quality = DEFAULT_JPEG_QUALITY,
+                       bool optimize_coding = false,
+                       JpegColorspace colorspace = JpegColorspace::kYCbCr);
+  ~JpegEncoder();
+
+  JpegEncoder(const JpegEncoder &) = delete;
+  JpegEncoder &operator=(const JpegEncoder &) = delete;
+
+  bool Encode(const uint8_t *pixels, unsigned width, unsigned height,
+              size_t stride, Buffer *out) override;
+
+  // Writes the tables-only stream to be stored as TIFFTAG_JPEGTABLES.
+  bool Tables(Buffer *out);
+
+  struct ErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+  };
+
+private:
+  void Configure(unsigned width, unsigned height);
+  void WriteYCbCr(const uint8_t *pixels, unsigned width, unsigned height,
+                  size_t stride);
+
+  jpeg_compress_struct cinfo_;
+  ErrorManager error_;
+  jpeg_destination_mgr destination_;
+  std::vector<uint8_t> output_;
+  const int quality_;
+  const bool optimize_coding_;
+  const JpegColorspace colorspace_;
+  // Padded 4:2:0 planes, reused across blocks.
+  std::vector<uint8_t> luma_;
+  std::vector<uint8_t> cb_;
+  std::vector<uint8_t> cr_;
+};
+#endif // __JPEG_ENCODER_H_
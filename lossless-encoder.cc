@@ -0,0 +1,97 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cstdio>
+#include <cstring>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "utils.h"
+#include "lossless-encoder.h"
+
+// zstd's own default, libtiff picks a slower 9.
+#define ZSTD_LEVEL 3
+
+LosslessEncoder::LosslessEncoder(TileCompression compression)
+  : compression_(compression), deflate_(), deflate_ready_(false) {
+  deflate_ready_ = deflateInit(&deflate_, Z_DEFAULT_COMPRESSION) == Z_OK;
+#ifdef WITH_ZSTD
+  zstd_ = ZSTD_createCCtx();
+#endif
+}
+
+LosslessEncoder::~LosslessEncoder() {
+  if (deflate_ready_)
+    deflateEnd(&deflate_);
+#ifdef WITH_ZSTD
+  ZSTD_freeCCtx(zstd_);
+#endif
+}
+
+bool LosslessEncoder::Encode(const uint8_t *pixels, unsigned width, unsigned height,
+                             size_t stride, Buffer *out) {
+  const size_t line_size = static_cast<size_t>(width) * 3;
+  differences_.resize(line_size * height);
+  for (unsigned y = 0; y < height; ++y) {
+    const uint8_t *row = pixels + y * stride;
+    uint8_t *difference = differences_.data() + y * line_size;
+    memcpy(difference, row, 3);
+    for (size_t i = 3; i < line_size; ++i)
+      difference[i] = row[i] - row[i - 3];
+  }
+
+#ifdef WITH_ZSTD
+  if (compression_ == TileCompression::kZstd)
+    return Zstd(out);
+#endif
+  return Deflate(out);
+}
+
+bool LosslessEncoder::Deflate(Buffer *out) {
+  if (!deflate_ready_ || deflateReset(&deflate_) != Z_OK)
+    return false;
+
+  Buffer compressed = allocate_buffer(deflateBound(&deflate_, differences_.size()));
+  deflate_.next_in = differences_.data();
+  deflate_.avail_in = differences_.size();
+  deflate_.next_out = compressed.data.get();
+  deflate_.avail_out = compressed.size;
+  if (deflate(&deflate_, Z_FINISH) != Z_STREAM_END) {
+    fprintf(stderr, "deflate() failed: %s\n", deflate_.msg ? deflate_.msg : "unknown error");
+    return false;
+  }
+  compressed.size = deflate_.total_out;
+  *out = std::move(compressed);
+  return true;
+}
+
+#ifdef WITH_ZSTD
+bool LosslessEncoder::Zstd(Buffer *out) {
+  if (!zstd_)
+    return false;
+
+  Buffer compressed = allocate_buffer(ZSTD_compressBound(differences_.size()));
+  const size_t size = ZSTD_compressCCtx(zstd_, compressed.data.get(), compressed.size,
+                                        differences_.data(), differences_.size(),
+                                        ZSTD_LEVEL);
+  if (ZSTD_isError(size)) {
+    fprintf(stderr, "ZSTD_compressCCtx() failed: %s\n", ZSTD_getErrorName(size));
+    return false;
+  }
+  compressed.size = size;
+  *out = std::move(compressed);
+  return true;
+}
+#endif
@@ -0,0 +1,57 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __LOSSLESS_ENCODER_H_
+#define __LOSSLESS_ENCODER_H_
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "utils.h"
+#include "tile-encoder.h"
+
+// Compresses RGB pixel blocks losslessly, as libtiff would with
+// PREDICTOR_HORIZONTAL: every sample is replaced by its difference with the
+// same sample of the previous pixel, then deflated or zstd compressed.
+// Compression contexts are reused, an encoder belongs to a single thread.
+class LosslessEncoder : public TileEncoder {
+public:
+  // `compression` is either kDeflate or kZstd.
+  explicit LosslessEncoder(TileCompression compression);
+  ~LosslessEncoder();
+
+  LosslessEncoder(const LosslessEncoder &) = delete;
+  LosslessEncoder &operator=(const LosslessEncoder &) = delete;
+
+  bool Encode(const uint8_t *pixels, unsigned width, unsigned height,
+              size_t stride, Buffer *out) override;
+
+private:
+  bool Deflate(Buffer *out);
+#ifdef WITH_ZSTD
+  bool Zstd(Buffer *out);
+#endif
+
+  const TileCompression compression_;
+  z_stream deflate_;
+  bool deflate_ready_;
+#ifdef WITH_ZSTD
+  ZSTD_CCtx *zstd_;
+#endif
+  std::vector<uint8_t> differences_;
+};
+#endif // __LOSSLESS_ENCODER_H_
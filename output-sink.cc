@@ -0,0 +1,291 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "output-sink.h"
+
+FileSink::~FileSink() {
+  if (fd_ >= 0)
+    Close();
+}
+
+std::unique_ptr<FileSink> FileSink::Create(const char *path, bool direct_io, uint64_t keep) {
+  errno = 0;
+  const int fd = open(path, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC) | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    perror(path);
+    return nullptr;
+  }
+  if (keep) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < keep ||
+        ftruncate(fd, keep) != 0) {
+      fprintf(stderr, "%s: cannot continue the file from byte %llu.\n", path,
+              static_cast<unsigned long long>(keep));
+      close(fd);
+      return nullptr;
+    }
+  }
+
+  // A second descriptor, as O_DIRECT applies to every access made with it.
+  int direct_fd = -1;
+  if (direct_io) {
+#ifdef O_DIRECT
+    direct_fd = open(path, O_RDWR | O_DIRECT | O_CLOEXEC);
+    if (direct_fd < 0)
+      fprintf(stderr, "%s: direct I/O unavailable (%s), writing through the page cache.\n",
+              path, strerror(errno));
+#else
+    fprintf(stderr, "Direct I/O is not supported on this platform.\n");
+#endif
+  }
+  return std::unique_ptr<FileSink>(new FileSink(path, fd, direct_fd, keep));
+}
+
+bool FileSink::Write(uint64_t offset, const void *data, size_t size) {
+  const bool aligned = offset % kDirectAlignment == 0 && size % kDirectAlignment == 0 &&
+    reinterpret_cast<uintptr_t>(data) % kDirectAlignment == 0;
+  const int fd = (direct_fd_ >= 0 && aligned) ? direct_fd_ : fd_;
+
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  for (size_t done = 0; done < size; ) {
+    const ssize_t written = pwrite(fd, bytes + done, size - done, offset + done);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      perror(path_.c_str());
+      return false;
+    }
+    done += written;
+  }
+  size_ = std::max(size_, offset + size);
+  return true;
+}
+
+bool FileSink::Read(uint64_t offset, void *data, size_t size) {
+  if (offset + size > size_)
+    return false;
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+  for (size_t done = 0; done < size; ) {
+    const ssize_t read = pread(fd_, bytes + done, size - done, offset + done);
+    if (read < 0 && errno == EINTR)
+      continue;
+    if (read <= 0) {
+      perror(path_.c_str());
+      return false;
+    }
+    done += read;
+  }
+  return true;
+}
+
+void FileSink::Reserve(uint64_t size) {
+  // Only a hint: filesystems without preallocation still work.
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+    reserved_ = size;
+  else if (errno != EOPNOTSUPP)
+    fprintf(stderr, "%s: could not preallocate %llu bytes (%s).\n", path_.c_str(),
+            static_cast<unsigned long long>(size), strerror(errno));
+#endif
+}
+
+bool FileSink::Close() {
+  bool ok = true;
+  // Truncating to the current size frees the blocks reserved past it.
+  if (fd_ >= 0 && reserved_ > size_ && ftruncate(fd_, size_) != 0)
+    ok = false;
+  if (direct_fd_ >= 0 && close(direct_fd_) != 0)
+    ok = false;
+  if (fd_ >= 0 && close(fd_) != 0)
+    ok = false;
+  if (!ok)
+    perror(path_.c_str());
+  fd_ = direct_fd_ = -1;
+  return ok;
+}
+
+bool FileSink::Sync() {
+  if (fdatasync(fd_) != 0) {
+    perror(path_.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool MemorySink::Write(uint64_t offset, const void *data, size_t size) {
+  if (offset + size > data_.size())
+    data_.resize(offset + size);
+  memcpy(data_.data() + offset, data, size);
+  return true;
+}
+
+bool MemorySink::Read(uint64_t offset, void *data, size_t size) {
+  if (offset + size > data_.size())
+    return false;
+  memcpy(data, data_.data() + offset, size);
+  return true;
+}
+
+CoalescingSink::CoalescingSink(OutputSink *sink, size_t buffer_size, size_t alignment)
+  : sink_(sink),
+    capacity_((std::max(buffer_size, alignment) + alignment - 1) / alignment * alignment),
+    alignment_(alignment),
+    buffer_(static_cast<uint8_t *>(
+      aligned_alloc(std::max<size_t>(alignment, 64),
+                    (capacity_ + 63) / 64 * 64))),
+    start_(0),
+    used_(0) {}
+
+CoalescingSink::CoalescingSink(std::unique_ptr<OutputSink> sink, size_t buffer_size,
+                               size_t alignment)
+  : CoalescingSink(sink.get(), buffer_size, alignment) {
+  owned_ = std::move(sink);
+}
+
+CoalescingSink::~CoalescingSink() {
+  free(buffer_);
+}
+
+bool CoalescingSink::Restart(uint64_t offset) {
+  start_ = offset - offset % alignment_;
+  used_ = offset - start_;
+  if (!used_)
+    return true;
+
+  // Carry the head of the block along, so that it is rewritten unchanged.
+  const uint64_t size = sink_->Size();
+  const size_t available = (start_ < size) ? std::min<uint64_t>(used_, size - start_) : 0;
+  memset(buffer_ + available, 0, used_ - available);
+  return sink_->Read(start_, buffer_, available);
+}
+
+bool CoalescingSink::Write(uint64_t offset, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  while (size) {
+    if (!used_ && !Restart(offset))
+      return false;
+    // Only writes overlapping or extending the buffer are gathered.
+    if (offset < start_ || offset > start_ + used_) {
+      if (!Flush())
+        return false;
+      continue;
+    }
+    const size_t position = offset - start_;
+    const size_t count = std::min(size, capacity_ - position);
+    memcpy(buffer_ + position, bytes, count);
+    used_ = std::max(used_, position + count);
+    offset += count;
+    bytes += count;
+    size -= count;
+    if (used_ == capacity_ && !Flush())
+      return false;
+  }
+  return true;
+}
+
+bool CoalescingSink::Read(uint64_t offset, void *data, size_t size) {
+  // Reads are rare, libtiff only reads back directories it patches.
+  return Flush() && sink_->Read(offset, data, size);
+}
+
+uint64_t CoalescingSink::Size() const {
+  return used_ ? std::max(sink_->Size(), start_ + used_) : sink_->Size();
+}
+
+bool CoalescingSink::Flush() {
+  if (!used_)
+    return true;
+  const size_t size = used_;
+  used_ = 0;
+  return sink_->Write(start_, buffer_, size);
+}
+
+bool CoalescingSink::Close() {
+  const bool flushed = Flush();
+  return sink_->Close() && flushed;
+}
+
+std::unique_ptr<OutputSink> open_file_sink(const char *path, size_t buffer_size,
+                                           bool direct_io, uint64_t keep) {
+  std::unique_ptr<FileSink> file = FileSink::Create(path, direct_io, keep);
+  if (!file)
+    return nullptr;
+  return std::unique_ptr<OutputSink>(new CoalescingSink(
+    std::move(file), buffer_size, direct_io ? FileSink::kDirectAlignment : 1));
+}
+
+// libtiff's I/O callbacks, writing to the sink passed as client data.
+class TiffSinkProcs {
+public:
+  static tmsize_t Read(thandle_t handle, void *data, tmsize_t size) {
+    OutputSink *sink = static_cast<OutputSink *>(handle);
+    const uint64_t end = sink->Size();
+    const uint64_t offset = sink->tiff_offset_;
+    const size_t count = (offset < end) ? std::min<uint64_t>(size, end - offset) : 0;
+    if (!sink->Read(offset, data, count))
+      return -1;
+    sink->tiff_offset_ += count;
+    return count;
+  }
+
+  static tmsize_t Write(thandle_t handle, void *data, tmsize_t size) {
+    OutputSink *sink = static_cast<OutputSink *>(handle);
+    if (!sink->Write(sink->tiff_offset_, data, size))
+      return -1;
+    sink->tiff_offset_ += size;
+    return size;
+  }
+
+  static toff_t Seek(thandle_t handle, toff_t offset, int whence) {
+    OutputSink *sink = static_cast<OutputSink *>(handle);
+    switch (whence) {
+      case SEEK_SET:
+        sink->tiff_offset_ = offset;
+        break;
+      case SEEK_CUR:
+        sink->tiff_offset_ += offset;
+        break;
+      case SEEK_END:
+        sink->tiff_offset_ = sink->Size() + offset;
+        break;
+      default:
+        return static_cast<toff_t>(-1);
+    }
+    return sink->tiff_offset_;
+  }
+
+  static int Close(thandle_t) { return 0; }
+
+  static toff_t Size(thandle_t handle) {
+    return static_cast<OutputSink *>(handle)->Size();
+  }
+
+  static int Map(thandle_t, void **, toff_t *) { return 0; }
+  static void Unmap(thandle_t, void *, toff_t) {}
+};
+
+TIFF *open_tiff_sink(OutputSink *sink, const char *name, const char *mode) {
+  sink->tiff_offset_ = 0;
+  return TIFFClientOpen(name, mode, sink, TiffSinkProcs::Read, TiffSinkProcs::Write,
+                        TiffSinkProcs::Seek, TiffSinkProcs::Close, TiffSinkProcs::Size,
+                        TiffSinkProcs::Map, TiffSinkProcs::Unmap);
+}
@@ -0,0 +1,150 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __OUTPUT_SINK_H_
+#define __OUTPUT_SINK_H_
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tiffio.h>
+
+// Default size of the buffer coalescing libtiff's writes.
+#define DEFAULT_WRITE_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Random access byte store a TIFF is written to. libtiff mostly appends,
+// but also reads and patches directories it already wrote.
+class OutputSink {
+public:
+  virtual ~OutputSink() {}
+
+  virtual bool Write(uint64_t offset, const void *data, size_t size) = 0;
+  // Fails when the range is not entirely written.
+  virtual bool Read(uint64_t offset, void *data, size_t size) = 0;
+  virtual uint64_t Size() const = 0;
+  // Makes every write durable, once the TIFF is closed.
+  virtual bool Close() = 0;
+  // Makes the bytes written so far durable, e.g. before recording them.
+  virtual bool Sync() { return true; }
+  // Hints at the final size of the file.
+  virtual void Reserve(uint64_t size) {}
+
+private:
+  // libtiff's file offset, only one TIFF may write to a sink.
+  friend class TiffSinkProcs;
+  friend TIFF *open_tiff_sink(OutputSink *sink, const char *name, const char *mode);
+  uint64_t tiff_offset_ = 0;
+};
+
+// A file on disk. Writes and reads are positioned, there is no shared
+// file offset.
+class FileSink : public OutputSink {
+public:
+  ~FileSink() override;
+
+  // With `direct_io`, aligned writes bypass the page cache (O_DIRECT) and
+  // the others go through it. With `keep`, the first `keep` bytes of an
+  // existing file are kept and the rest dropped, to continue writing it.
+  // Returns nullptr after reporting the error.
+  static std::unique_ptr<FileSink> Create(const char *path, bool direct_io = false,
+                                          uint64_t keep = 0);
+
+  bool Write(uint64_t offset, const void *data, size_t size) override;
+  bool Read(uint64_t offset, void *data, size_t size) override;
+  uint64_t Size() const override { return size_; }
+  bool Close() override;
+  bool Sync() override;
+  // Preallocates the blocks without changing the file size, the ones left
+  // unused are released by Close().
+  void Reserve(uint64_t size) override;
+
+  // Offsets, sizes and addresses of O_DIRECT writes must be multiples of it.
+  static const size_t kDirectAlignment = 4096;
+
+private:
+  FileSink(const char *path, int fd, int direct_fd, uint64_t size)
+    : path_(path), fd_(fd), direct_fd_(direct_fd), size_(size), reserved_(0) {}
+
+  const std::string path_;
+  int fd_;
+  int direct_fd_;  // -1 without direct I/O.
+  uint64_t size_;
+  uint64_t reserved_;
+};
+
+// The whole file in memory, for callers that do not need it on disk.
+class MemorySink : public OutputSink {
+public:
+  bool Write(uint64_t offset, const void *data, size_t size) override;
+  bool Read(uint64_t offset, void *data, size_t size) override;
+  uint64_t Size() const override { return data_.size(); }
+  bool Close() override { return true; }
+  void Reserve(uint64_t size) override { data_.reserve(size); }
+
+  const std::vector<uint8_t> &data() const { return data_; }
+  // Hands the file over, leaving the sink empty.
+  std::vector<uint8_t> Release() { return std::move(data_); }
+
+private:
+  std::vector<uint8_t> data_;
+};
+
+// Gathers consecutive writes into large ones before passing them to
+// `sink`, which must outlive it. With an `alignment`, the buffer starts
+// on aligned offsets so that full buffers are written aligned.
+class CoalescingSink : public OutputSink {
+public:
+  CoalescingSink(OutputSink *sink, size_t buffer_size = DEFAULT_WRITE_BUFFER_SIZE,
+                 size_t alignment = 1);
+  // Same, owning `sink`.
+  CoalescingSink(std::unique_ptr<OutputSink> sink,
+                 size_t buffer_size = DEFAULT_WRITE_BUFFER_SIZE, size_t alignment = 1);
+  ~CoalescingSink() override;
+
+  bool Write(uint64_t offset, const void *data, size_t size) override;
+  bool Read(uint64_t offset, void *data, size_t size) override;
+  uint64_t Size() const override;
+  bool Close() override;
+  bool Sync() override { return Flush() && sink_->Sync(); }
+  void Reserve(uint64_t size) override { sink_->Reserve(size); }
+
+  // Writes the buffered bytes to the underlying sink.
+  bool Flush();
+
+private:
+  // Starts buffering at `offset`, aligned down with the bytes before it.
+  bool Restart(uint64_t offset);
+
+  std::unique_ptr<OutputSink> owned_;
+  OutputSink *sink_;
+  const size_t capacity_;
+  const size_t alignment_;
+  uint8_t *buffer_;
+  uint64_t start_;  // offset of the first buffered byte.
+  size_t used_;
+};
+
+// Creates `path`, written through a coalescing buffer of `buffer_size` bytes,
+// full buffers bypassing the page cache with `direct_io`. With `keep`, an
+// existing file is continued after its first `keep` bytes instead.
+// Returns nullptr after reporting the error.
+std::unique_ptr<OutputSink> open_file_sink(const char *path,
+                                           size_t buffer_size = DEFAULT_WRITE_BUFFER_SIZE,
+                                           bool direct_io = false, uint64_t keep = 0);
+
+// Opens a TIFF for writing to `sink`, which must outlive it. `name` only
+// appears in libtiff's messages, `mode` is "w" or "w8".
+// TIFFClose() does not close the sink, call its Close() afterwards.
+TIFF *open_tiff_sink(OutputSink *sink, const char *name, const char *mode);
+#endif // __OUTPUT_SINK_H_
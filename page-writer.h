@@ -0,0 +1,92 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __PAGE_WRITER_H_
+#define __PAGE_WRITER_H_
+#include <functional>
+#include <optional>
+#include <vector>
+#include <tiffio.h>
+#include <vips/vips8>
+
+#include "aperio-svs-encoding.h"
+#include "conversion-journal.h"
+#include "encoding-stats.h"
+#include "pyramid-builder.h"
+#include "tile-encoder.h"
+#include "tile-order.h"
+#ifdef WITH_SPINNER
+#include "spinners.h"
+#endif
+
+enum class PageType { kTiled, kStriped };
+
+// Tiles copied, as they are compressed, from the same page of a previous
+// version of the file instead of being encoded again.
+typedef struct {
+  TIFF *previous;  // on the directory of the page.
+  std::vector<bool> dirty;  // tiles to encode, by tile index.
+} PageReuse;
+
+// Settings shared by every page of a pyramid.
+typedef struct {
+  unsigned num_threads;
+  unsigned max_tiles_in_flight;
+  uint64_t tile_cache_bytes;  // of the cache in front of each page, 0 for the default.
+  uint64_t max_in_memory_level;  // larger materialized levels go to scratch files.
+  bool dedup;
+  TileEncoderType encoder;
+  bool optimize_coding;
+  JpegColorspace colorspace;
+#ifdef WITH_SPINNER
+  spinners::Spinner *spinner;  // nullptr without progress display.
+#endif
+  // Called as the tiles of the page are written, may be empty.
+  std::function<void(unsigned done, unsigned total)> on_progress;
+  ConversionJournal *journal;  // may be nullptr.
+  unsigned page;  // being written, numbered from 1.
+  // The page being written can only be read once, top to bottom.
+  bool sequential;
+  TileOrder tile_order;  // of tiled pages, unless a pyramid is accumulated.
+  // The directory of the page was already written, with its tile arrays
+  // deferred, and is the current one of `out`.
+  bool directory_written;
+} EncodingContext;
+
+// Writes `in` as the next directory of `out`, in `tile_size` square tiles
+// or in strips of `tile_size` rows. The description and any other tag must
+// be set beforehand.
+// When `pyramid` is set, every tile of the page is also accumulated into it.
+// When `stats` is set, it receives the measurements of the page, but its
+// `kind`.
+// When `reuse` is set, only its dirty tiles are read from `in`. The page
+// must be compressed the same way as the previous one.
+// With a journal in `context`, the tiles it has are not written again.
+// When `context` has the directory already written, the tags are not set
+// again and only its tile arrays are updated, in place.
+bool write_page(const vips::VImage &in, unsigned tile_size,
+                TileCompression compression, std::optional<int> quality,
+                PageType page_type, const EncodingContext &context,
+                TIFF *out, PyramidBuilder *pyramid = nullptr,
+                PageStats *stats = nullptr, const PageReuse *reuse = nullptr);
+
+// Resamples `from` to exactly `width` x `height`.
+vips::VImage resize_to(const vips::VImage &from, uint32_t width, uint32_t height);
+
+// `in` reduced `scaling` times: averaged by whole blocks when the scaling is
+// integral, resampled otherwise.
+vips::VImage downsample(const vips::VImage &in, double scaling);
+
+// The context of `options`, with their defaults applied.
+EncodingContext encoding_context(const SvsEncoderOptions &options);
+#endif // __PAGE_WRITER_H_
@@ -0,0 +1,253 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <vips/vips.h>
+#include <vips/vips8>
+
+#include "utils.h"
+#include "pyramid-builder.h"
+
+// Above this factor a box sum could overflow 32 bits.
+#define MAX_FACTOR 4096
+
+static std::string scratch_directory() {
+  const char *tmpdir = getenv("TMPDIR");
+  return (tmpdir && *tmpdir) ? tmpdir : "/tmp";
+}
+
+PyramidBuilder::PyramidBuilder(unsigned width, unsigned height, unsigned tile_size,
+                               const std::vector<unsigned> &factors,
+                               uint64_t max_in_memory_size)
+  : width_(width), height_(height), tile_size_(tile_size),
+    num_tiles_width_(partition(width, tile_size)) {
+  levels_.reserve(factors.size());
+  for (const unsigned factor : factors) {
+    Level level = {};
+    level.factor = factor;
+    level.width = partition(width, factor);
+    level.height = partition(height, factor);
+    // A row of native tiles touches at most this many level rows, one of
+    // which may be carried over from the previous row of tiles.
+    level.band_rows = tile_size / factor + 2;
+    level.band.assign(static_cast<size_t>(level.band_rows) * level.width * 3, 0);
+    level.first_row = 0;
+    level.scratch = nullptr;
+
+    const size_t size = static_cast<size_t>(level.width) * level.height * 3;
+    if (size <= max_in_memory_size) {
+      level.pixels.reserve(size);
+    } else {
+      std::string path = scratch_directory() + "/svg2svs-level-XXXXXX";
+      const int fd = mkstemp(&path[0]);
+      if (fd >= 0) {
+        level.scratch = fdopen(fd, "wb");
+        level.scratch_path = path;
+      } else {
+        perror("mkstemp()");
+      }
+    }
+    levels_.push_back(std::move(level));
+  }
+}
+
+PyramidBuilder::~PyramidBuilder() {
+  for (Level &level : levels_) {
+    if (level.scratch)
+      fclose(level.scratch);
+    if (!level.scratch_path.empty())
+      unlink(level.scratch_path.c_str());
+  }
+}
+
+bool PyramidBuilder::Supports(const std::vector<double> &scalings) {
+  for (const double scaling : scalings)
+    if (scaling < 1.0 || scaling > MAX_FACTOR || std::floor(scaling) != scaling)
+      return false;
+  return true;
+}
+
+PyramidBuilder::Rect PyramidBuilder::TileRect(unsigned index) const {
+  const unsigned x = (index % num_tiles_width_) * tile_size_;
+  const unsigned y = (index / num_tiles_width_) * tile_size_;
+  return { x, y, std::min(tile_size_, width_ - x), std::min(tile_size_, height_ - y) };
+}
+
+// Level pixels that the `native` rectangle contributes to.
+PyramidBuilder::Rect PyramidBuilder::BlockRect(const Rect &native, unsigned factor) {
+  const unsigned x = native.x / factor;
+  const unsigned y = native.y / factor;
+  return { x, y,
+           (native.x + native.width - 1) / factor + 1 - x,
+           (native.y + native.height - 1) / factor + 1 - y };
+}
+
+void PyramidBuilder::Reduce(unsigned index, const uint8_t *pixels, size_t stride,
+                            TileReduction *out) const {
+  const Rect tile = TileRect(index);
+  out->resize(levels_.size());
+
+  for (size_t l = 0; l < levels_.size(); ++l) {
+    const unsigned factor = levels_[l].factor;
+    const Rect block = BlockRect(tile, factor);
+    std::vector<uint32_t> &sums = (*out)[l];
+    sums.assign(static_cast<size_t>(block.width) * block.height * 3, 0);
+
+    // Levels whose factor is a multiple of a finer level's are summed from
+    // its block, which covers exactly the same native pixels.
+    unsigned previous_factor = 0;
+    size_t previous_level = 0;
+    for (size_t j = 0; j < l; ++j) {
+      if (factor % levels_[j].factor == 0 && levels_[j].factor > previous_factor) {
+        previous_factor = levels_[j].factor;
+        previous_level = j;
+      }
+    }
+    if (previous_factor) {
+      const Rect previous = BlockRect(tile, previous_factor);
+      const std::vector<uint32_t> &previous_sums = (*out)[previous_level];
+      for (unsigned y = 0; y < previous.height; ++y) {
+        const unsigned by = (previous.y + y) * previous_factor / factor - block.y;
+        for (unsigned x = 0; x < previous.width; ++x) {
+          const unsigned bx = (previous.x + x) * previous_factor / factor - block.x;
+          const uint32_t *src = &previous_sums[(y * previous.width + x) * 3];
+          uint32_t *dst = &sums[(by * block.width + bx) * 3];
+          dst[0] += src[0];
+          dst[1] += src[1];
+          dst[2] += src[2];
+        }
+      }
+      continue;
+    }
+
+    for (unsigned y = 0; y < tile.height; ++y) {
+      const uint8_t *row = pixels + y * stride;
+      uint32_t *dst_row = &sums[((tile.y + y) / factor - block.y) * block.width * 3];
+      // Walk the row one level pixel at a time.
+      unsigned x = 0;
+      for (unsigned bx = 0; bx < block.width; ++bx) {
+        const unsigned x_end = std::min(tile.width, (block.x + bx + 1) * factor - tile.x);
+        uint32_t r = 0, g = 0, b = 0;
+        for (; x < x_end; ++x) {
+          r += row[x * 3];
+          g += row[x * 3 + 1];
+          b += row[x * 3 + 2];
+        }
+        dst_row[bx * 3] += r;
+        dst_row[bx * 3 + 1] += g;
+        dst_row[bx * 3 + 2] += b;
+      }
+    }
+  }
+}
+
+bool PyramidBuilder::Accumulate(unsigned index, const TileReduction &reduction) {
+  assert(reduction.size() == levels_.size());
+  const Rect tile = TileRect(index);
+  const bool last_in_row = (index % num_tiles_width_) == num_tiles_width_ - 1;
+
+  for (size_t l = 0; l < levels_.size(); ++l) {
+    Level &level = levels_[l];
+    const Rect block = BlockRect(tile, level.factor);
+    const std::vector<uint32_t> &sums = reduction[l];
+
+    assert(block.y >= level.first_row);
+    assert(block.y + block.height <= level.first_row + level.band_rows);
+    for (unsigned y = 0; y < block.height; ++y) {
+      const uint32_t *src = &sums[y * block.width * 3];
+      uint32_t *dst = &level.band[((block.y + y - level.first_row) * level.width + block.x) * 3];
+      for (unsigned i = 0; i < block.width * 3; ++i)
+        dst[i] += src[i];
+    }
+
+    if (last_in_row) {
+      // Level rows entirely covered by the native rows seen so far.
+      const unsigned native_end = tile.y + tile.height;
+      const unsigned end_row = (native_end == height_)
+        ? level.height
+        : native_end / level.factor;
+      if (!EmitRows(&level, end_row))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool PyramidBuilder::EmitRows(Level *level, unsigned end_row) {
+  if (end_row <= level->first_row)
+    return true;
+
+  const unsigned factor = level->factor;
+  const size_t band_line_size = static_cast<size_t>(level->width) * 3;
+  std::vector<uint8_t> line(band_line_size);
+
+  for (unsigned y = level->first_row; y < end_row; ++y) {
+    const uint32_t *sums = &level->band[(y - level->first_row) * band_line_size];
+    const unsigned rows = std::min((y + 1) * factor, height_) - y * factor;
+    for (unsigned x = 0; x < level->width; ++x) {
+      const unsigned columns = std::min((x + 1) * factor, width_) - x * factor;
+      const uint32_t count = rows * columns;
+      for (unsigned c = 0; c < 3; ++c)
+        line[x * 3 + c] = (sums[x * 3 + c] + count / 2) / count;
+    }
+
+    if (level->scratch) {
+      if (fwrite(line.data(), 1, line.size(), level->scratch) != line.size()) {
+        perror("fwrite()");
+        return false;
+      }
+    } else if (!level->scratch_path.empty()) {
+      return false;  // the scratch file could not be created.
+    } else {
+      level->pixels.insert(level->pixels.end(), line.begin(), line.end());
+    }
+  }
+
+  // Carry the rows still being accumulated to the top of the band.
+  const unsigned emitted = end_row - level->first_row;
+  std::copy(level->band.begin() + emitted * band_line_size, level->band.end(),
+            level->band.begin());
+  std::fill(level->band.end() - emitted * band_line_size, level->band.end(), 0);
+  level->first_row = end_row;
+  return true;
+}
+
+bool PyramidBuilder::Finish() {
+  bool ok = true;
+  for (Level &level : levels_) {
+    ok = ok && level.first_row == level.height;
+    if (level.scratch) {
+      ok = (fclose(level.scratch) == 0) && ok;
+      level.scratch = nullptr;
+    }
+  }
+  if (!ok)
+    fprintf(stderr, "Unable to build pyramid levels.\n");
+  return ok;
+}
+
+VImage PyramidBuilder::Layer(size_t i) const {
+  const Level &level = levels_[i];
+  if (!level.scratch_path.empty())
+    return VImage::rawload(level.scratch_path.c_str(), level.width, level.height, 3);
+
+  return VImage::new_from_memory(const_cast<uint8_t *>(level.pixels.data()),
+                                 level.pixels.size(), level.width, level.height,
+                                 3, VIPS_FORMAT_UCHAR);
+}
@@ -0,0 +1,98 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __PYRAMID_BUILDER_H_
+#define __PYRAMID_BUILDER_H_
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <vips/vips.h>
+#include <vips/vips8>
+
+#include "utils.h"
+
+using namespace vips;
+
+// Box-filter sums of one native tile, one block per pyramid level.
+using TileReduction = std::vector<std::vector<uint32_t>>;
+
+// Computes every level of a pyramid from a single, row-ordered traversal of
+// the native tiles.
+// Tiles are first reduced into per-level box sums (`Reduce`, thread safe),
+// then merged in tile index order (`Accumulate`). Only the few level rows
+// that the current row of native tiles contributes to are kept in memory,
+// finished rows are spilled to memory or to a scratch file depending on the
+// size of the level.
+class PyramidBuilder {
+public:
+  // `factors` are the integral downsampling factors of each level. Levels
+  // larger than `max_in_memory_size` bytes are spilled to scratch files.
+  PyramidBuilder(unsigned width, unsigned height, unsigned tile_size,
+                 const std::vector<unsigned> &factors,
+                 uint64_t max_in_memory_size = MAX_IN_MEMORY_LEVEL_SIZE);
+  ~PyramidBuilder();
+
+  PyramidBuilder(const PyramidBuilder &) = delete;
+  PyramidBuilder &operator=(const PyramidBuilder &) = delete;
+
+  // Whether `scalings` can be computed by the builder.
+  static bool Supports(const std::vector<double> &scalings);
+
+  // Sums the `tile_size` x `tile_size` RGB `pixels` of the native tile
+  // `index`, rows `stride` bytes apart, into one block per level.
+  void Reduce(unsigned index, const uint8_t *pixels, size_t stride,
+              TileReduction *out) const;
+
+  // Merges the reduction of tile `index`. Tiles must come in index order.
+  bool Accumulate(unsigned index, const TileReduction &reduction);
+
+  // Must be called once every native tile has been accumulated.
+  bool Finish();
+
+  // The `i`-th level, available after `Finish`. It stays valid as long as
+  // the builder is alive.
+  VImage Layer(size_t i) const;
+
+private:
+  struct Level {
+    unsigned factor;
+    unsigned width;
+    unsigned height;
+
+    // Sums of the rows not yet emitted, starting at `first_row`.
+    std::vector<uint32_t> band;
+    unsigned band_rows;
+    unsigned first_row;
+
+    // Finished pixels, either in memory or in a raw scratch file.
+    std::vector<uint8_t> pixels;
+    std::string scratch_path;
+    FILE *scratch;
+  };
+
+  typedef struct {
+    unsigned x, y, width, height;
+  } Rect;
+
+  Rect TileRect(unsigned index) const;
+  static Rect BlockRect(const Rect &native, unsigned factor);
+  bool EmitRows(Level *level, unsigned end_row);
+
+  const unsigned width_;
+  const unsigned height_;
+  const unsigned tile_size_;
+  const unsigned num_tiles_width_;
+  std::vector<Level> levels_;
+};
+#endif // __PYRAMID_BUILDER_H_
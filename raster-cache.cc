@@ -0,0 +1,163 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "raster-cache.h"
+
+// Bumped when the pixels of an entry would change for the same settings.
+#define RASTER_CACHE_VERSION 1
+
+using namespace vips;
+
+static std::string entry_path(const std::string &directory, const std::string &name) {
+  return directory + "/" + name + ".v";
+}
+
+std::string raster_cache_key(const std::string &svg, int base_width, const char *rasterizer) {
+  gchar *digest = g_compute_checksum_for_data(
+    G_CHECKSUM_SHA256, reinterpret_cast<const unsigned char *>(svg.data()), svg.size());
+  const std::string key = std::string(digest) + "-" + std::to_string(base_width) + "-" +
+    rasterizer + "-" + std::to_string(RASTER_CACHE_VERSION);
+  g_free(digest);
+  return key;
+}
+
+// Whether the value starting at `position`, past spaces and quotes, refers
+// to the document itself.
+static bool internal_reference(const std::string &svg, size_t position) {
+  while (position < svg.size() && (isspace(static_cast<unsigned char>(svg[position])) ||
+                                   svg[position] == '"' || svg[position] == '\''))
+    ++position;
+  return svg.compare(position, 1, "#") == 0 || svg.compare(position, 5, "data:") == 0;
+}
+
+bool references_external_resources(const std::string &svg) {
+  // Stylesheets may import anything.
+  if (svg.find("@import") != std::string::npos ||
+      svg.find("xml-stylesheet") != std::string::npos)
+    return true;
+  // href and xlink:href attributes.
+  for (size_t at = svg.find("href"); at != std::string::npos; at = svg.find("href", at + 4)) {
+    size_t position = at + 4;
+    while (position < svg.size() && isspace(static_cast<unsigned char>(svg[position])))
+      ++position;
+    if (position < svg.size() && svg[position] == '=' && !internal_reference(svg, position + 1))
+      return true;
+  }
+  // url() in styles, @font-face sources included.
+  for (size_t at = svg.find("url("); at != std::string::npos; at = svg.find("url(", at + 4))
+    if (!internal_reference(svg, at + 4))
+      return true;
+  return false;
+}
+
+// Removes the least recently used entries of `directory` but `keep` until
+// they take `max_bytes` at most.
+static void evict(const std::string &directory, const std::string &keep, uint64_t max_bytes) {
+  DIR *dir = opendir(directory.c_str());
+  if (!dir) {
+    perror(directory.c_str());
+    return;
+  }
+  // Last use and size of each entry, by name.
+  std::vector<std::pair<struct timespec, std::pair<uint64_t, std::string>>> entries;
+  uint64_t total = 0;
+  for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    struct stat st;
+    if (name.size() < 2 || name.compare(name.size() - 2, 2, ".v") != 0 ||
+        fstatat(dirfd(dir), name.c_str(), &st, 0) != 0)
+      continue;
+    total += st.st_size;
+    if (directory + "/" + name != keep)
+      entries.push_back({st.st_mtim, {static_cast<uint64_t>(st.st_size), name}});
+  }
+  closedir(dir);
+
+  std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+    return a.first.tv_sec != b.first.tv_sec ? a.first.tv_sec < b.first.tv_sec
+                                            : a.first.tv_nsec < b.first.tv_nsec;
+  });
+  // Conversions still mapping a removed entry keep reading it.
+  for (size_t i = 0; i < entries.size() && total > max_bytes; ++i) {
+    const std::string path = directory + "/" + entries[i].second.second;
+    if (unlink(path.c_str()) == 0)
+      total -= entries[i].second.first;
+    else if (errno != ENOENT)
+      perror(path.c_str());
+  }
+}
+
+bool open_cached_raster(const std::string &directory, const std::string &key,
+                        VImage *out) {
+  const std::string path = entry_path(directory, key);
+  if (access(path.c_str(), R_OK) != 0) {
+    if (errno != ENOENT)
+      perror(path.c_str());
+    return false;
+  }
+  try {
+    *out = VImage::new_from_file(path.c_str());
+  } catch (const VError &error) {
+    fprintf(stderr, "%s: %s\n", path.c_str(), error.what());
+    return false;
+  }
+  // Its modification time tells when it was last used.
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  return true;
+}
+
+bool cache_raster(const std::string &directory, const std::string &key,
+                  const VImage &image, uint64_t max_bytes, VImage *out) {
+  const uint64_t size = static_cast<uint64_t>(image.width()) * image.height() * image.bands();
+  if (size > max_bytes) {
+    fprintf(stderr, "%s: the rasterized svg does not fit in the cache.\n", directory.c_str());
+    return false;
+  }
+  if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST) {
+    perror(directory.c_str());
+    return false;
+  }
+  // Unique among the threads and processes filling the cache.
+  static std::atomic<unsigned> counter(0);
+  const std::string partial = entry_path(
+    directory, key + "." + std::to_string(getpid()) + "-" + std::to_string(counter++) +
+    ".part");
+  const std::string path = entry_path(directory, key);
+  try {
+    // Rasterizes on every thread.
+    image.write_to_file(partial.c_str());
+  } catch (const VError &error) {
+    fprintf(stderr, "%s: %s\n", partial.c_str(), error.what());
+    unlink(partial.c_str());
+    return false;
+  }
+  if (rename(partial.c_str(), path.c_str()) != 0) {
+    perror(path.c_str());
+    unlink(partial.c_str());
+    return false;
+  }
+  evict(directory, path, max_bytes);
+  return open_cached_raster(directory, key, out);
+}
@@ -0,0 +1,53 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __RASTER_CACHE_H_
+#define __RASTER_CACHE_H_
+#include <cstdint>
+#include <string>
+#include <vips/vips8>
+
+// Bytes a cache directory holds by default.
+#define DEFAULT_RASTER_CACHE_SIZE (16ULL << 30)
+
+// A directory of rasterized svg documents, reused across conversions.
+// Each entry is a whole native layer in libvips' own uncompressed format,
+// which is memory mapped back, so a hit skips rasterization and the pyramid
+// reads its tiles straight from the page cache. Entries are written under a
+// temporary name and renamed, so concurrent conversions never see a partial
+// one. Once the entries exceed the size of the cache, the least recently
+// used ones are removed. The directory is only accessible to its owner.
+
+// Names the rendering of `svg` `base_width` pixels wide by `rasterizer`:
+// a digest of the document and the settings the pixels depend on.
+std::string raster_cache_key(const std::string &svg, int base_width, const char *rasterizer);
+
+// Whether `svg` may render differently while its bytes stay the same: it
+// references images, stylesheets or fonts outside of itself. Such documents
+// are not cached. Fragments and data: URLs are part of the document.
+bool references_external_resources(const std::string &svg);
+
+// Maps the entry `key` of `directory` into `out`, which becomes its most
+// recently used one. Returns false when there is none, or when it cannot be
+// read, which is reported.
+bool open_cached_raster(const std::string &directory, const std::string &key,
+                        vips::VImage *out);
+
+// Renders `image` into the entry `key` of `directory`, and maps it into
+// `out`. Older entries are evicted so that the directory holds `max_bytes`
+// at most, and images larger than that are not cached. Returns false after
+// reporting the error, leaving `out` alone: the conversion goes on without
+// the cache.
+bool cache_raster(const std::string &directory, const std::string &key,
+                  const vips::VImage &image, uint64_t max_bytes, vips::VImage *out);
+#endif // __RASTER_CACHE_H_
@@ -39,8 +39,14 @@
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
 #include <thread>
+#include <unistd.h>
 
 namespace spinners {
   inline std::map<const char *, const char *> SpinnerType = {
@@ -71,30 +77,54 @@ namespace spinners {
     }
   }
 
+  // Displays a spinner, a text and a progress count on stderr.
+  // Text and progress may be updated from any thread: the text is guarded by
+  // a mutex and progress is a pair of relaxed atomic counters, read only when
+  // a frame is drawn.
   class Spinner {
   public:
-    Spinner() : interval_(80), text_(""), stop_spinner_(false), symbols_(GetSpinner("dots")) {}
+    Spinner() : interval_(100), text_(""), stop_spinner_(false), symbols_(GetSpinner("dots")) {}
     Spinner(int interval, std::string text, const char *symbols)
       : interval_(interval), text_(text), stop_spinner_(false), symbols_(GetSpinner(symbols)) {}
     ~Spinner() { Stop(); };
 
     void SetInterval(int interval) { interval_ = interval; }
-    void SetText(std::string text) { text_ = text; }
+    void SetText(std::string text) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      text_ = text;
+    }
     void SetSymbols(const char *symbols) { symbols_ = GetSpinner(symbols); }
 
+    // Starts counting towards `total` items, hiding the count when 0.
+    void SetTotal(uint64_t total) {
+      done_.store(0, std::memory_order_relaxed);
+      total_.store(total, std::memory_order_relaxed);
+    }
+    void Advance(uint64_t count = 1) { done_.fetch_add(count, std::memory_order_relaxed); }
+
     void StartSpinner() {
       int len = strlen(symbols_) / 3;
       int i = 0;
       char ch[4] = {};
 
       HideCursor();
+      std::unique_lock<std::mutex> lock(mutex_);
       while (!stop_spinner_) {
         i = (i >= (len - 1)) ? 0 : i + 1;
-        std::cout << "\u001b[K";
         strncpy(ch, symbols_ + i * 3, 3);
-        std::cout << ch << " " << text_ << " \r";
-        std::cout.flush();
-        std::this_thread::sleep_for(std::chrono::milliseconds(interval_));
+        std::ostringstream frame;
+        frame << "\u001b[K" << ch << " " << text_;
+        const uint64_t total = total_.load(std::memory_order_relaxed);
+        if (total) {
+          const uint64_t done = done_.load(std::memory_order_relaxed);
+          frame << " " << done << "/" << total << " (" << done * 100 / total << "%)";
+        }
+        frame << " \r";
+        fputs(frame.str().c_str(), stderr);
+        fflush(stderr);
+        // Stop() wakes the loop up instead of waiting for the next frame.
+        stopped_.wait_for(lock, std::chrono::milliseconds(interval_),
+                          [this] { return stop_spinner_.load(); });
       }
       ShowCursor();
     }
@@ -104,26 +134,44 @@ namespace spinners {
     }
 
     void Stop() {
-      stop_spinner_ = true;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_spinner_ = true;
+      }
+      stopped_.notify_all();
       if (t_.joinable()) {
         t_.join();
       }
     }
 
+    // Stops drawing and shows the cursor again from a signal handler, which
+    // can neither take the mutex nor join the drawing thread.
+    void Interrupt() {
+      static const char show_cursor[] = "\u001b[?25h";
+      stop_spinner_ = true;
+      if (write(STDERR_FILENO, show_cursor, sizeof(show_cursor) - 1) < 0) {
+        // Nothing more can be done from the handler.
+      }
+    }
+
   private:
     int interval_;
     std::string text_;
-    bool stop_spinner_;
+    std::atomic<bool> stop_spinner_;
     const char *symbols_;
     std::thread t_;
+    std::mutex mutex_;
+    std::condition_variable stopped_;
+    std::atomic<uint64_t> done_{0};
+    std::atomic<uint64_t> total_{0};
 
     void HideCursor() {
-      std::cout << "\u001b[?25l";
+      fputs("\u001b[?25l", stderr);
     }
 
     void ShowCursor() {
-      std::cout << "\u001b[?25h";
-      std::cout.flush();
+      fputs("\u001b[?25h", stderr);
+      fflush(stderr);
     }
   };
 }
@@ -0,0 +1,200 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <atomic>
+#include <cairo.h>
+#include <cmath>
+#include <cstdio>
+#include <librsvg/rsvg.h>
+#include <vector>
+
+#include "svg-rasterizer.h"
+
+using namespace vips;
+
+// What every thread renders, freed with the image.
+struct SvgSource {
+  std::string svg;
+  std::string path;  // empty for documents without a file.
+  int width;
+  int height;
+  std::atomic<RsvgHandle *> parsed;  // until a thread takes it.
+};
+
+// The state of one thread.
+typedef struct {
+  RsvgHandle *handle;
+  std::vector<uint32_t> argb;  // cairo's premultiplied pixels of a region.
+} SvgRenderer;
+
+static void free_source(SvgSource *source) {
+  if (RsvgHandle *handle = source->parsed.exchange(nullptr))
+    g_object_unref(handle);
+  delete source;
+}
+
+static void close_source(VipsImage *image, SvgSource *source) {
+  free_source(source);
+}
+
+static RsvgHandle *parse_svg(const SvgSource *source, GError **error) {
+  GInputStream *stream = g_memory_input_stream_new_from_data(source->svg.data(),
+                                                              source->svg.size(), nullptr);
+  GFile *base = source->path.empty() ? nullptr : g_file_new_for_path(source->path.c_str());
+  RsvgHandle *handle = rsvg_handle_new_from_stream_sync(
+    stream, base, RSVG_HANDLE_FLAG_UNLIMITED, nullptr, error);
+  g_object_unref(stream);
+  if (base)
+    g_object_unref(base);
+  return handle;
+}
+
+static void *start_renderer(VipsImage *out, void *a, void *b) {
+  SvgSource *source = static_cast<SvgSource *>(a);
+  GError *error = nullptr;
+  RsvgHandle *handle = source->parsed.exchange(nullptr);
+  if (!handle)
+    handle = parse_svg(source, &error);
+  if (!handle) {
+    vips_error("svgload", "%s", error ? error->message : "invalid document");
+    if (error)
+      g_error_free(error);
+    return nullptr;
+  }
+  return new SvgRenderer{handle, {}};
+}
+
+static int stop_renderer(void *seq, void *a, void *b) {
+  SvgRenderer *renderer = static_cast<SvgRenderer *>(seq);
+  g_object_unref(renderer->handle);
+  delete renderer;
+  return 0;
+}
+
+// Converts premultiplied ARGB to RGB, as svgload's unpremultiplied RGBA
+// without its alpha.
+static void argb_to_rgb(const uint32_t *argb, unsigned count, uint8_t *rgb) {
+  for (unsigned i = 0; i < count; ++i, rgb += 3) {
+    const uint32_t pixel = argb[i];
+    const unsigned alpha = pixel >> 24;
+    if (alpha == 255) {
+      rgb[0] = pixel >> 16;
+      rgb[1] = pixel >> 8;
+      rgb[2] = pixel;
+    } else if (alpha == 0) {
+      rgb[0] = rgb[1] = rgb[2] = 0;
+    } else {
+      rgb[0] = (((pixel >> 16) & 0xff) * 255 + alpha / 2) / alpha;
+      rgb[1] = (((pixel >> 8) & 0xff) * 255 + alpha / 2) / alpha;
+      rgb[2] = ((pixel & 0xff) * 255 + alpha / 2) / alpha;
+    }
+  }
+}
+
+static int render_region(VipsRegion *out, void *seq, void *a, void *b, gboolean *stop) {
+  SvgRenderer *renderer = static_cast<SvgRenderer *>(seq);
+  const SvgSource *source = static_cast<const SvgSource *>(a);
+  const VipsRect &rect = out->valid;
+
+  renderer->argb.assign(static_cast<size_t>(rect.width) * rect.height, 0);
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+    reinterpret_cast<unsigned char *>(renderer->argb.data()), CAIRO_FORMAT_ARGB32,
+    rect.width, rect.height, rect.width * 4);
+  cairo_t *cr = cairo_create(surface);
+  // The whole document fits the image, this region is a window on it.
+  const RsvgRectangle viewport = {
+    static_cast<double>(-rect.left), static_cast<double>(-rect.top),
+    static_cast<double>(source->width), static_cast<double>(source->height)
+  };
+  GError *error = nullptr;
+  const bool ok = rsvg_handle_render_document(renderer->handle, cr, &viewport, &error);
+  cairo_destroy(cr);
+  cairo_surface_flush(surface);
+  cairo_surface_destroy(surface);
+  if (!ok) {
+    vips_error("svgload", "%s", error ? error->message : "rendering failed");
+    if (error)
+      g_error_free(error);
+    return -1;
+  }
+
+  for (int y = 0; y < rect.height; ++y)
+    argb_to_rgb(&renderer->argb[static_cast<size_t>(y) * rect.width], rect.width,
+                VIPS_REGION_ADDR(out, rect.left, rect.top + y));
+  return 0;
+}
+
+ThreadedSvg::~ThreadedSvg() {
+  if (source_)
+    free_source(source_);
+}
+
+std::unique_ptr<ThreadedSvg> ThreadedSvg::Parse(const std::string &svg, const char *path) {
+  SvgSource *source = new SvgSource{svg, path ? path : "", 0, 0, {nullptr}};
+  GError *error = nullptr;
+  RsvgHandle *handle = parse_svg(source, &error);
+  if (!handle) {
+    fprintf(stderr, "%s: %s\n", path ? path : "svg", error ? error->message : "invalid document");
+    if (error)
+      g_error_free(error);
+    delete source;
+    return nullptr;
+  }
+  source->parsed = handle;
+
+  double width = 0, height = 0;
+#if LIBRSVG_CHECK_VERSION(2, 52, 0)
+  if (!rsvg_handle_get_intrinsic_size_in_pixels(handle, &width, &height))
+#endif
+  {
+    RsvgDimensionData dimensions;
+    rsvg_handle_get_dimensions(handle, &dimensions);
+    width = dimensions.width;
+    height = dimensions.height;
+  }
+  if (width <= 0 || height <= 0) {
+    fprintf(stderr, "%s: the document has no size.\n", path ? path : "svg");
+    free_source(source);
+    return nullptr;
+  }
+  return std::unique_ptr<ThreadedSvg>(new ThreadedSvg(source, width, height));
+}
+
+bool ThreadedSvg::Render(double dpi, VImage *out) {
+  if (!source_) {
+    fprintf(stderr, "The document was already rendered.\n");
+    return false;
+  }
+  const double scale = dpi / 72;
+  source_->width = std::max(1L, std::lround(width_ * scale));
+  source_->height = std::max(1L, std::lround(height_ * scale));
+
+  VipsImage *image = vips_image_new();
+  // Pixels per millimetre.
+  vips_image_init_fields(image, source_->width, source_->height, 3, VIPS_FORMAT_UCHAR,
+                         VIPS_CODING_NONE, VIPS_INTERPRETATION_sRGB, dpi / 25.4, dpi / 25.4);
+  SvgSource *source = source_;
+  source_ = nullptr;
+  g_signal_connect(image, "close", G_CALLBACK(close_source), source);
+  if (vips_image_pipelinev(image, VIPS_DEMAND_STYLE_SMALLTILE, nullptr) ||
+      vips_image_generate(image, start_renderer, render_region, stop_renderer, source,
+                          nullptr)) {
+    fprintf(stderr, "%s: %s\n", source->path.empty() ? "svg" : source->path.c_str(),
+            vips_error_buffer());
+    vips_error_clear();
+    g_object_unref(image);
+    return false;
+  }
+  *out = VImage(image);
+  return true;
+}
@@ -0,0 +1,52 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __SVG_RASTERIZER_H_
+#define __SVG_RASTERIZER_H_
+#include <memory>
+#include <string>
+#include <vips/vips8>
+
+struct SvgSource;
+
+// An svg document rendered with librsvg on every libvips thread at once.
+// libvips' svgload shares a single librsvg handle between its threads,
+// which serializes rasterization. Instead, each thread computing the image
+// parses the document into its own handle and renders its regions with it.
+class ThreadedSvg {
+public:
+  ~ThreadedSvg();
+
+  // Parses `svg`. `path` is its file when it has one, for relative
+  // references. Returns nullptr after reporting why.
+  static std::unique_ptr<ThreadedSvg> Parse(const std::string &svg, const char *path);
+
+  // Size of the canvas at 72 dpi.
+  double width() const { return width_; }
+  double height() const { return height_; }
+
+  // The document scaled to `dpi`, RGB, its alpha removed like the
+  // conversion does. The first thread rendering it reuses the parsed
+  // document. The image keeps a copy of the document.
+  // Returns false after reporting why.
+  bool Render(double dpi, vips::VImage *out);
+
+private:
+  ThreadedSvg(SvgSource *source, double width, double height)
+    : source_(source), width_(width), height_(height) {}
+
+  SvgSource *source_;  // handed over to the first image rendered.
+  const double width_;
+  const double height_;
+};
+#endif // __SVG_RASTERIZER_H_
@@ -12,9 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cmath>
 #include <climits>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -30,6 +32,10 @@
 #include <cassert>
 
 #include "aperio-svs-encoding.h"
+#include "conversion.h"
+#include "conversion-server.h"
+#include "job-scheduler.h"
+#include "tile-pipeline.h"
 
 using namespace vips;
 
@@ -37,48 +43,149 @@ static int usage(const char *prog, const char *msg = nullptr) {
   if (msg && strlen(msg))
     fprintf(stderr, "\033[1m\033[31m%s\033[0m\n\n", msg);
   fprintf(stderr, "Usage: %s [options] <input-svg-filename> <output-svs-filename>\n"
-          "Options:\n", prog);
+          "       %s [options] <input-svg-filename> <output-svs-filename> [<input> <output>...]\n"
+          "       %s [options] --batch <manifest>\n"
+          "       %s [options] --serve <socket>\n"
+          "       %s [options] --update <previous-svs> <input-svg-filename> <output-svs-filename>\n"
+          "Inputs libvips reads as raster images (PNG, TIFF, JPEG...) are converted at their own size.\n"
+          "An input named checkerboard:<divisions>x<subdivisions> is generated rather than read, like\n"
+          "generate_svg_checkerboard.py would draw it.\n"
+          "Options:\n", prog, prog, prog, prog, prog);
   fprintf(stderr,
           "  -b, --base-width <width>                    : Width of the base of the pyramid. (Default 16000)\n"
           "  -l, --layers-factors <factor> [<factor>,...]: Downsampling factors for each layer of the pyramid. (Default 4,16,64)\n"
+          "  -t, --threads <count>                       : Number of tile encoding threads, shared by all files in a batch. (Default one per core)\n"
+          "  -c, --cascade                               : Build each layer from the previous one instead of from the base.\n"
+          "  -s, --single-pass                           : Build all layers while reading the base once. (Integral factors only)\n"
+          "      --bigtiff                               : Always write a BigTIFF. (Default when the output may exceed 4GiB)\n"
+          "      --no-bigtiff                            : Always write a classic TIFF.\n"
+          "      --no-dedup                              : Compress and store identical tiles separately.\n"
+          "      --encoder <libjpeg|libtiff>             : Compress tiles in parallel with libjpeg, or with libtiff's codec. (Default libjpeg)\n"
+          "      --optimize-coding                       : Compute optimal Huffman tables for each tile. (libjpeg only)\n"
+          "      --jpeg-colorspace <ycbcr|rgb>           : Store YCbCr with 4:2:0 chroma, or full resolution RGB. (Default ycbcr)\n"
+          "      --codecs <codec> [<codec>,...]          : Compression of the base, then of each layer, the last one repeating.\n"
+          "                                                jpeg, jp2k, jp2k-rgb, webp, zstd or deflate. (Default jpeg)\n"
+          "      --batch <manifest>                      : Convert the \"<input-svg> <output-svs>\" pairs listed one per line.\n"
+          "      --max-memory <MiB>                      : Memory budget, shared by the files converted at once. Caches, tiles in\n"
+          "                                                flight and threads are sized to fit it. (Default half the RAM)\n"
+          "      --report <path>                         : Write the timings and throughput of every page as JSON.\n"
+          "      --viewer-layout                         : Put every directory first, then the tiles, lowest resolution first,\n"
+          "                                                for viewers reading slides over the network. (libjpeg encoder)\n"
+          "      --tile-order <row|z|hilbert>            : Order of the tiles stored in each layer. (Default row)\n"
+          "      --preallocate                           : Reserve the estimated size of each output file up front.\n"
+          "      --direct-io                             : Write output files bypassing the page cache.\n"
+          "      --serve <socket>                        : Convert the requests received on a Unix socket until interrupted.\n"
+          "      --jobs <count>                          : Conversions the server runs at once. (Default a quarter of the threads)\n"
+          "      --max-queue <count>                     : Waiting requests beyond which the server turns new ones down. (Default 64)\n"
+          "      --update <previous-svs>                 : Reuse the tiles of a pyramid converted from an older version of the svg.\n"
+          "      --old-svg <path>                        : The older version, compared to find what changed. (With --update)\n"
+          "      --dirty <x>,<y>,<width>,<height>        : An area of the svg that changed, in user units. (With --update, repeatable)\n"
+          "      --rasterizer <threaded|libvips>         : Render the svg on every thread, or with libvips' svgload. (Default threaded)\n"
+          "      --raster-cache <dir>                    : Keep rasterized native layers in a directory, reused by conversions of the same svg.\n"
+          "      --raster-cache-size <MiB>               : Size of the raster cache, least recently used layers are removed. (Default 16GiB)\n"
+          "      --sequential                            : Read raster inputs once, top to bottom, holding only a few rows of tiles. (Integral factors)\n"
+          "      --transcode                             : Keep the compressed tiles of tiled TIFF inputs, such as existing slides, as the\n"
+          "                                                base, and their MPP and AppMag. Only the smaller layers are encoded.\n"
+          "      --mpp <microns>                         : Microns per pixel of the base. (Default from the input or the base width)\n"
+          "      --app-mag <magnification>               : Apparent magnification of the base. (Default from the input or 40)\n"
+          "      --resume                                : Journal the conversions, continuing interrupted ones from their last checkpoint.\n"
           "  -h, --help                                  : Display this help text and exit.\n");
   return (msg) ? 1 : 0;
 }
 
+// Long options without a short equivalent.
+enum {
+  kOptionBigTiff = 256,
+  kOptionNoBigTiff,
+  kOptionNoDedup,
+  kOptionEncoder,
+  kOptionOptimizeCoding,
+  kOptionJpegColorspace,
+  kOptionCodecs,
+  kOptionBatch,
+  kOptionMaxMemory,
+  kOptionReport,
+  kOptionPreallocate,
+  kOptionDirectIo,
+  kOptionServe,
+  kOptionJobs,
+  kOptionMaxQueue,
+  kOptionUpdate,
+  kOptionOldSvg,
+  kOptionDirty,
+  kOptionResume,
+  kOptionRasterizer,
+  kOptionRasterCache,
+  kOptionRasterCacheSize,
+  kOptionSequential,
+  kOptionViewerLayout,
+  kOptionTileOrder,
+  kOptionTranscode,
+  kOptionMpp,
+  kOptionAppMag,
+};
+
 static struct option long_options[] = {
   { "help", no_argument, 0, 'h' },
   { "base-width", required_argument, 0, 'b'},
   { "layers-factors", required_argument, 0, 'l'},
+  { "threads", required_argument, 0, 't'},
+  { "cascade", no_argument, 0, 'c'},
+  { "single-pass", no_argument, 0, 's'},
+  { "bigtiff", no_argument, 0, kOptionBigTiff},
+  { "no-bigtiff", no_argument, 0, kOptionNoBigTiff},
+  { "no-dedup", no_argument, 0, kOptionNoDedup},
+  { "encoder", required_argument, 0, kOptionEncoder},
+  { "optimize-coding", no_argument, 0, kOptionOptimizeCoding},
+  { "jpeg-colorspace", required_argument, 0, kOptionJpegColorspace},
+  { "codecs", required_argument, 0, kOptionCodecs},
+  { "batch", required_argument, 0, kOptionBatch},
+  { "max-memory", required_argument, 0, kOptionMaxMemory},
+  { "report", required_argument, 0, kOptionReport},
+  { "preallocate", no_argument, 0, kOptionPreallocate},
+  { "direct-io", no_argument, 0, kOptionDirectIo},
+  { "serve", required_argument, 0, kOptionServe},
+  { "jobs", required_argument, 0, kOptionJobs},
+  { "max-queue", required_argument, 0, kOptionMaxQueue},
+  { "update", required_argument, 0, kOptionUpdate},
+  { "old-svg", required_argument, 0, kOptionOldSvg},
+  { "dirty", required_argument, 0, kOptionDirty},
+  { "resume", no_argument, 0, kOptionResume},
+  { "rasterizer", required_argument, 0, kOptionRasterizer},
+  { "raster-cache", required_argument, 0, kOptionRasterCache},
+  { "raster-cache-size", required_argument, 0, kOptionRasterCacheSize},
+  { "sequential", no_argument, 0, kOptionSequential},
+  { "viewer-layout", no_argument, 0, kOptionViewerLayout},
+  { "tile-order", required_argument, 0, kOptionTileOrder},
+  { "transcode", no_argument, 0, kOptionTranscode},
+  { "mpp", required_argument, 0, kOptionMpp},
+  { "app-mag", required_argument, 0, kOptionAppMag},
   { 0, 0, 0, 0 },
 };
 
-static bool parse_and_set_layers_factors(char *const layers_factors, std::vector<double> *out) {
-  out->clear();
-  char *pos = layers_factors;
-  while (*pos != '\0') {
-    errno = 0;
-    const double factor = strtod(pos, &pos);
-    if (factor == 0.0 || errno > 0) {
-      return false;
-    }
-    if (*pos == ',')
-      pos++;
-    out->push_back(factor);
-  }
-  return true;
-}
-
 int main(int argc, char *argv[]) {
   unsigned long base_width = 16000;
   std::vector<double> layers_factors{{ 4.0, 16.0, 64.0 }};
-  std::string input_svg;
-  std::string output_svs;
-
-  if (argc < 3)
-    return usage(argv[0], "Wrong number of positional arguments.");
+  SvsEncoderOptions encoder_options = {};
+  const char *manifest = nullptr;
+  const char *report = nullptr;
+  const char *socket_path = nullptr;
+  unsigned long max_jobs = 0;
+  unsigned long max_queue = 64;
+  uint64_t memory_budget = default_memory_budget();
+  const char *previous_svs = nullptr;
+  std::string old_svg;
+  std::vector<SvgRect> dirty;
+  bool resume = false;
+  std::optional<SvgRasterizer> rasterizer;
+  std::optional<std::string> raster_cache;
+  std::optional<uint64_t> raster_cache_size;
+  bool sequential = false;
+  bool transcode = false;
+  SvsMetadata metadata = {};
 
   int opt;
-  while ((opt = getopt_long(argc - 2, argv, "hb:l:",
+  while ((opt = getopt_long(argc, argv, "hb:l:t:cs",
                             long_options, nullptr)) != -1) {
     switch (opt) {
     case 'h':
@@ -90,9 +197,158 @@ int main(int argc, char *argv[]) {
         return usage(argv[0], "Invalid width.");
       break;
     case 'l':
-      if (!parse_and_set_layers_factors(optarg, &layers_factors))
+      if (!parse_layers_factors(optarg, &layers_factors))
         return usage(argv[0], "Invalid factors.");
       break;
+    case 't': {
+      char *pos;
+      const unsigned long threads = strtoul(optarg, &pos, 10);
+      if (*pos != '\0' || threads == 0 || threads > UINT_MAX)
+        return usage(argv[0], "Invalid number of threads.");
+      encoder_options.threads = threads;
+      break;
+    }
+    case 'c':
+      encoder_options.cascade = true;
+      break;
+    case 's':
+      encoder_options.single_pass = true;
+      break;
+    case kOptionBigTiff:
+      encoder_options.bigtiff = true;
+      break;
+    case kOptionNoBigTiff:
+      encoder_options.bigtiff = false;
+      break;
+    case kOptionNoDedup:
+      encoder_options.dedup = false;
+      break;
+    case kOptionEncoder:
+      if (strcmp(optarg, "libjpeg") == 0)
+        encoder_options.encoder = TileEncoderType::kLibjpeg;
+      else if (strcmp(optarg, "libtiff") == 0)
+        encoder_options.encoder = TileEncoderType::kLibtiff;
+      else
+        return usage(argv[0], "Invalid encoder.");
+      break;
+    case kOptionOptimizeCoding:
+      encoder_options.optimize_coding = true;
+      break;
+    case kOptionJpegColorspace:
+      if (strcmp(optarg, "ycbcr") == 0)
+        encoder_options.jpeg_colorspace = JpegColorspace::kYCbCr;
+      else if (strcmp(optarg, "rgb") == 0)
+        encoder_options.jpeg_colorspace = JpegColorspace::kRgb;
+      else
+        return usage(argv[0], "Invalid JPEG colorspace.");
+      break;
+    case kOptionCodecs:
+      if (!parse_codecs(optarg, &encoder_options.compressions))
+        return usage(argv[0], "Invalid codecs.");
+      break;
+    case kOptionBatch:
+      manifest = optarg;
+      break;
+    case kOptionMaxMemory: {
+      char *pos;
+      const unsigned long long mebibytes = strtoull(optarg, &pos, 10);
+      if (*pos != '\0' || mebibytes == 0)
+        return usage(argv[0], "Invalid memory budget.");
+      memory_budget = mebibytes << 20;
+      break;
+    }
+    case kOptionReport:
+      report = optarg;
+      break;
+    case kOptionPreallocate:
+      encoder_options.preallocate = true;
+      break;
+    case kOptionDirectIo:
+      encoder_options.direct_io = true;
+      break;
+    case kOptionServe:
+      socket_path = optarg;
+      break;
+    case kOptionJobs: {
+      char *pos;
+      max_jobs = strtoul(optarg, &pos, 10);
+      if (*pos != '\0' || max_jobs == 0 || max_jobs > UINT_MAX)
+        return usage(argv[0], "Invalid number of jobs.");
+      break;
+    }
+    case kOptionMaxQueue: {
+      char *pos;
+      max_queue = strtoul(optarg, &pos, 10);
+      if (*pos != '\0' || max_queue == 0 || max_queue > UINT_MAX)
+        return usage(argv[0], "Invalid queue length.");
+      break;
+    }
+    case kOptionUpdate:
+      previous_svs = optarg;
+      break;
+    case kOptionOldSvg:
+      old_svg = optarg;
+      break;
+    case kOptionDirty: {
+      SvgRect rect;
+      if (!parse_svg_rect(optarg, &rect))
+        return usage(argv[0], "Invalid dirty rectangle.");
+      dirty.push_back(rect);
+      break;
+    }
+    case kOptionResume:
+      resume = true;
+      break;
+    case kOptionRasterizer:
+      if (strcmp(optarg, "threaded") == 0)
+        rasterizer = SvgRasterizer::kThreaded;
+      else if (strcmp(optarg, "libvips") == 0)
+        rasterizer = SvgRasterizer::kLibvips;
+      else
+        return usage(argv[0], "Invalid rasterizer.");
+      break;
+    case kOptionRasterCache:
+      raster_cache = optarg;
+      break;
+    case kOptionRasterCacheSize: {
+      char *pos;
+      const unsigned long long mebibytes = strtoull(optarg, &pos, 10);
+      if (*pos != '\0' || mebibytes == 0)
+        return usage(argv[0], "Invalid raster cache size.");
+      raster_cache_size = mebibytes << 20;
+      break;
+    }
+    case kOptionSequential:
+      sequential = true;
+      break;
+    case kOptionViewerLayout:
+      encoder_options.viewer_layout = true;
+      break;
+    case kOptionTileOrder: {
+      TileOrder order;
+      if (!parse_tile_order(optarg, &order))
+        return usage(argv[0], "Invalid tile order.");
+      encoder_options.tile_order = order;
+      break;
+    }
+    case kOptionTranscode:
+      transcode = true;
+      break;
+    case kOptionMpp: {
+      char *pos;
+      metadata.mpp = strtod(optarg, &pos);
+      if (*pos != '\0' || !(*metadata.mpp > 0))
+        return usage(argv[0], "Invalid microns per pixel.");
+      break;
+    }
+    case kOptionAppMag: {
+      char *pos;
+      const long app_mag = strtol(optarg, &pos, 10);
+      if (*pos != '\0' || app_mag <= 0 || app_mag > INT_MAX)
+        return usage(argv[0], "Invalid magnification.");
+      metadata.app_mag = app_mag;
+      break;
+    }
     case '?':
     case ':':
     default:
@@ -103,40 +359,93 @@ int main(int argc, char *argv[]) {
   // Sort layers factors.
   std::sort(layers_factors.begin(), layers_factors.end());
 
-  input_svg = std::string(argv[optind]);
-  output_svs = std::string(argv[optind + 1]);
+  std::vector<ConversionJob> jobs;
+  if (resume && (socket_path || previous_svs))
+    return usage(argv[0], "Only conversions to files can be resumed.");
+  if (resume && sequential)
+    return usage(argv[0], "Sequential reads cannot be resumed.");
+  if (encoder_options.viewer_layout && (resume || sequential))
+    return usage(argv[0], "The viewer layout cannot be resumed or read sequentially.");
+  if (transcode && (resume || sequential))
+    return usage(argv[0], "Transcoding cannot be resumed or read sequentially.");
+  if (socket_path) {
+    if (manifest || optind != argc)
+      return usage(argv[0], "Input and output files come from the requests.");
+  } else if (previous_svs) {
+    if (manifest || argc - optind != 2)
+      return usage(argv[0], "An update takes a single input and output.");
+    if (old_svg.empty() && dirty.empty())
+      return usage(argv[0], "An update needs --old-svg or --dirty.");
+    jobs.push_back({argv[optind], argv[optind + 1]});
+  } else if (manifest) {
+    if (optind != argc)
+      return usage(argv[0], "Input and output files come from the manifest.");
+    if (!read_manifest(manifest, &jobs))
+      return 1;
+  } else {
+    if (argc - optind < 2 || (argc - optind) % 2)
+      return usage(argv[0], "Wrong number of positional arguments.");
+    for (int i = optind; i < argc; i += 2)
+      jobs.push_back({argv[i], argv[i + 1]});
+  }
 
   if (VIPS_INIT(argv[0]))
     vips_error_exit(nullptr);
+  // libvips' operation cache is shared by every conversion of the process.
+  vips_cache_set_max_mem(std::min<uint64_t>(vips_cache_get_max_mem(), memory_budget / 8));
 
-  // We interpret the whole svg canvas as 100.
-  const unsigned kNumSubDivisions = 10 * 10;
-
-  // Query the svg size
-  const double default_resolution_width = VImage::svgload(
-    input_svg.c_str(), VImage::option()->set("unlimited", true)).width();
-  const double dpi = base_width * 72 / default_resolution_width;
-  VImage in = VImage::svgload(
-    input_svg.c_str(), VImage::option()
-    ->set("dpi", dpi)
-    ->set("unlimited", true));
-
-  if (in.has_alpha())
-    in = in.extract_band(0, VImage::option()->set("n", 3));
+  ConversionSettings settings = {};
+  settings.base_width = base_width;
+  settings.layers_factors = layers_factors;
+  settings.encoder = encoder_options;
+  settings.resume = resume;
+  settings.rasterizer = rasterizer;
+  settings.raster_cache = raster_cache;
+  settings.raster_cache_size = raster_cache_size;
+  settings.sequential = sequential;
+  settings.transcode = transcode;
+  settings.metadata = metadata;
+  const unsigned num_threads = encoder_options.threads.value_or(default_num_workers());
 
-#if 0
-  assert(in.interpretation() == VIPS_INTERPRETATION_sRGB);
-  assert(in.bands() == 3);
-  assert(in.width() == BASE_WIDTH);
-#endif
-
-  SvsMetadata svs_metadata = {};
-  svs_metadata.mpp = 10.0 * kNumSubDivisions / base_width;
-  svs_metadata.app_mag = 40;
+  if (socket_path) {
+    if (!max_jobs)
+      max_jobs = std::max(1u, num_threads / 4);
+    ConversionSettings server_settings = settings;
+    server_settings.encoder.max_memory = memory_budget / max_jobs;
+    ConversionServer server(server_settings, num_threads, max_jobs, max_queue);
+    const bool ok = server.Serve(socket_path);
+    vips_shutdown();
+    return ok ? 0 : 1;
+  }
 
-  if (!vips2svs_encoder(in, output_svs.c_str(), layers_factors, svs_metadata))
-    fprintf(stderr, "Error while generating svs pyramid file.\n");
+  // A single file keeps the whole machine and the progress spinner.
+  int status = 0;
+  std::vector<JobResult> results;
+  std::vector<EncodingStats> stats;
+  if (jobs.size() == 1 && !manifest) {
+    settings.encoder.max_memory = memory_budget;
+    stats.resize(1);
+    const auto start = std::chrono::steady_clock::now();
+    const bool ok = previous_svs
+      ? update_svg(jobs[0].input_svg, previous_svs, jobs[0].output_svs, old_svg, dirty,
+                   settings, &stats[0])
+      : convert_svg(jobs[0].input_svg, jobs[0].output_svs, settings, &stats[0]);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    results.push_back({ok, elapsed.count(), num_threads});
+    if (!ok)
+      status = 1;
+  } else {
+    results = convert_batch(jobs, settings, num_threads, memory_budget, &stats);
+    print_batch_report(stdout, jobs, results);
+    for (const JobResult &result : results)
+      if (!result.ok)
+        status = 1;
+  }
+  if (report && !write_run_report(report, jobs, results, stats))
+    status = 1;
+  fprintf(stderr, "Peak memory %.1f MiB, budget %.1f MiB.\n",
+          peak_rss_bytes() / 1048576.0, memory_budget / 1048576.0);
 
   vips_shutdown();
-  return 0;
+  return status;
 }
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+# Copyright 2021 Ellogon BV.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Convert an svg with a running `svg2svs --serve <socket>` server.
+
+Paths are sent as they are resolved here, so the server must see the same
+filesystem, unless the svg is uploaded and the svs downloaded.
+"""
+
+import argparse
+import os
+import socket
+import sys
+from typing import Callable, Optional, Sequence, Tuple
+
+
+class ServerError(Exception):
+    """The server turned the request down or failed to convert."""
+
+
+def _read_line(stream) -> str:
+    line = stream.readline()
+    if not line:
+        raise ServerError('connection closed')
+    return line.decode().rstrip('\n')
+
+
+def convert(socket_path: str,
+            input_svg: Optional[str] = None,
+            svg: Optional[bytes] = None,
+            output_svs: Optional[str] = None,
+            base_width: Optional[int] = None,
+            layers_factors: Optional[Sequence[float]] = None,
+            codecs: Optional[Sequence[str]] = None,
+            mpp: Optional[float] = None,
+            app_mag: Optional[int] = None,
+            on_progress: Optional[Callable[[int, int, int], None]] = None
+            ) -> Tuple[float, int, Optional[bytes]]:
+    """Run one conversion, from a path or from the svg bytes.
+
+    Returns the conversion time on the server, the size of the svs and its
+    bytes when `output_svs` is not set.
+    """
+    header = []
+    if input_svg is not None:
+        header.append(f'input {input_svg}')
+    if svg is not None:
+        header.append(f'svg {len(svg)}')
+    if output_svs is not None:
+        header.append(f'output {output_svs}')
+    if base_width is not None:
+        header.append(f'base-width {base_width}')
+    if layers_factors:
+        header.append('layers-factors ' + ','.join(str(f) for f in layers_factors))
+    if codecs:
+        header.append('codecs ' + ','.join(codecs))
+    if mpp is not None:
+        header.append(f'mpp {mpp}')
+    if app_mag is not None:
+        header.append(f'app-mag {app_mag}')
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as connection:
+        connection.connect(socket_path)
+        connection.sendall(('\n'.join(header) + '\n\n').encode() + (svg or b''))
+        stream = connection.makefile('rb')
+        while True:
+            fields = _read_line(stream).split(' ', 1)
+            if fields[0] == 'error':
+                raise ServerError(fields[1] if len(fields) > 1 else 'unknown error')
+            if fields[0] == 'progress' and on_progress:
+                on_progress(*(int(v) for v in fields[1].split()))
+            if fields[0] == 'ok':
+                seconds, size = fields[1].split()
+                data = stream.read(int(size)) if output_svs is None else None
+                if data is not None and len(data) != int(size):
+                    raise ServerError('truncated svs')
+                return float(seconds), int(size), data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('input_svg')
+    parser.add_argument('output_svs')
+    parser.add_argument('-S', '--socket', default='/tmp/svg2svs.sock',
+                        help='Socket of the server (default /tmp/svg2svs.sock).')
+    parser.add_argument('-b', '--base-width', type=int)
+    parser.add_argument('-l', '--layers-factors',
+                        type=lambda v: [float(f) for f in v.split(',')])
+    parser.add_argument('--codecs', type=lambda v: v.split(','))
+    parser.add_argument('--mpp', type=float)
+    parser.add_argument('--app-mag', type=int)
+    parser.add_argument('--upload', action='store_true',
+                        help='Send the svg instead of its path.')
+    parser.add_argument('--download', action='store_true',
+                        help='Receive the svs instead of having the server write it.')
+    args = parser.parse_args()
+
+    def progress(page: int, done: int, total: int):
+        print(f'\rpage {page}: {done}/{total}', end='', file=sys.stderr)
+
+    svg = None
+    input_svg = os.path.abspath(args.input_svg)
+    if args.upload:
+        with open(args.input_svg, 'rb') as f:
+            svg = f.read()
+        input_svg = None
+    try:
+        seconds, size, data = convert(
+            args.socket, input_svg=input_svg, svg=svg,
+            output_svs=None if args.download else os.path.abspath(args.output_svs),
+            base_width=args.base_width, layers_factors=args.layers_factors,
+            codecs=args.codecs, mpp=args.mpp, app_mag=args.app_mag,
+            on_progress=progress)
+    except (OSError, ServerError) as error:
+        print(f'\n{error}', file=sys.stderr)
+        sys.exit(1)
+    if data is not None:
+        with open(args.output_svs, 'wb') as f:
+            f.write(data)
+    print(f'\n{size} bytes in {seconds:.3f} seconds.', file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
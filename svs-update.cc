@@ -0,0 +1,279 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <tiff.h>
+#include <tiffio.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "output-sink.h"
+#include "page-writer.h"
+#include "svs-update.h"
+
+using namespace vips;
+
+// Layer pixels around a sublayer tile that still contribute to it: the
+// lobes of the lanczos3 kernel resize uses for fractional factors, and
+// rounding.
+#define RESAMPLE_MARGIN 4
+
+DirtyMap::DirtyMap(uint32_t width, uint32_t height, unsigned cell_size)
+  : width_(width),
+    height_(height),
+    cell_size_(cell_size),
+    cells_across_(partition(width, cell_size)),
+    cells_(static_cast<size_t>(cells_across_) * partition(height, cell_size)),
+    num_marked_(0) {}
+
+bool DirtyMap::Cells(int64_t x, int64_t y, int64_t width, int64_t height,
+                     unsigned *x0, unsigned *y0, unsigned *x1, unsigned *y1) const {
+  const int64_t left = std::max<int64_t>(x, 0);
+  const int64_t top = std::max<int64_t>(y, 0);
+  const int64_t right = std::min<int64_t>(x + width, width_);
+  const int64_t bottom = std::min<int64_t>(y + height, height_);
+  if (left >= right || top >= bottom)
+    return false;
+  *x0 = left / cell_size_;
+  *y0 = top / cell_size_;
+  *x1 = (right + cell_size_ - 1) / cell_size_;
+  *y1 = (bottom + cell_size_ - 1) / cell_size_;
+  return true;
+}
+
+void DirtyMap::Mark(int64_t x, int64_t y, int64_t width, int64_t height) {
+  unsigned x0, y0, x1, y1;
+  if (!Cells(x, y, width, height, &x0, &y0, &x1, &y1))
+    return;
+  for (unsigned cy = y0; cy < y1; ++cy) {
+    for (unsigned cx = x0; cx < x1; ++cx) {
+      const size_t cell = static_cast<size_t>(cy) * cells_across_ + cx;
+      num_marked_ += !cells_[cell];
+      cells_[cell] = true;
+    }
+  }
+}
+
+bool DirtyMap::Any(int64_t x, int64_t y, int64_t width, int64_t height) const {
+  unsigned x0, y0, x1, y1;
+  if (empty() || !Cells(x, y, width, height, &x0, &y0, &x1, &y1))
+    return false;
+  for (unsigned cy = y0; cy < y1; ++cy)
+    for (unsigned cx = x0; cx < x1; ++cx)
+      if (cells_[static_cast<size_t>(cy) * cells_across_ + cx])
+        return true;
+  return false;
+}
+
+// A page of the previous file.
+typedef struct {
+  uint32_t width;
+  uint32_t height;
+  bool tiled;
+  uint32_t tile_size;  // rows per strip of striped pages.
+  uint16_t compression;
+  uint16_t photometric;
+  std::string description;
+} PreviousPage;
+
+static bool read_previous_pages(TIFF *previous, std::vector<PreviousPage> *pages) {
+  do {
+    PreviousPage page = {};
+    char *description = nullptr;
+    page.tiled = TIFFIsTiled(previous);
+    if (!TIFFGetField(previous, TIFFTAG_IMAGEWIDTH, &page.width) ||
+        !TIFFGetField(previous, TIFFTAG_IMAGELENGTH, &page.height) ||
+        !TIFFGetField(previous, page.tiled ? TIFFTAG_TILEWIDTH : TIFFTAG_ROWSPERSTRIP,
+                      &page.tile_size) ||
+        !TIFFGetField(previous, TIFFTAG_COMPRESSION, &page.compression) ||
+        !TIFFGetField(previous, TIFFTAG_PHOTOMETRIC, &page.photometric) ||
+        !TIFFGetField(previous, TIFFTAG_IMAGEDESCRIPTION, &description))
+      return false;
+    page.description = description;
+    pages->push_back(page);
+  } while (TIFFReadDirectory(previous));
+  return true;
+}
+
+// The "Q=<quality>" of a layer description, written for lossy layers.
+static std::optional<int> description_quality(const std::string &description) {
+  const size_t position = description.find(" Q=");
+  if (position == std::string::npos)
+    return {};
+  return atoi(description.c_str() + position + 3);
+}
+
+// Sublayer tiles whose area of the native layer, with the margin of the
+// resampling kernel, is dirty.
+static std::vector<bool> dirty_layer_tiles(const DirtyMap &dirty, uint32_t native_width,
+                                           uint32_t native_height, uint32_t width,
+                                           uint32_t height, unsigned tile_size) {
+  const double scale_x = static_cast<double>(native_width) / width;
+  const double scale_y = static_cast<double>(native_height) / height;
+  const unsigned across = partition(width, tile_size);
+  const unsigned down = partition(height, tile_size);
+  std::vector<bool> tiles(across * down);
+  for (unsigned ty = 0; ty < down; ++ty) {
+    for (unsigned tx = 0; tx < across; ++tx) {
+      const int64_t x0 = std::floor((static_cast<int64_t>(tx) * tile_size - RESAMPLE_MARGIN) * scale_x);
+      const int64_t y0 = std::floor((static_cast<int64_t>(ty) * tile_size - RESAMPLE_MARGIN) * scale_y);
+      const int64_t x1 = std::ceil((static_cast<int64_t>(tx + 1) * tile_size + RESAMPLE_MARGIN) * scale_x);
+      const int64_t y1 = std::ceil((static_cast<int64_t>(ty + 1) * tile_size + RESAMPLE_MARGIN) * scale_y);
+      tiles[ty * across + tx] = dirty.Any(x0, y0, x1 - x0, y1 - y0);
+    }
+  }
+  return tiles;
+}
+
+// Checks that `pages` are laid out as vips2svs_encoder writes them for
+// `in` and `layers`: native, thumbnail, then the sublayers.
+static bool check_layout(const std::vector<PreviousPage> &pages, const VImage &in,
+                         const std::vector<VImage> &layers) {
+  if (pages.size() != layers.size() + 2 || !pages[0].tiled || pages[1].tiled) {
+    fprintf(stderr, "The previous file does not have the expected layers.\n");
+    return false;
+  }
+  if (pages[0].width != static_cast<uint32_t>(in.width()) ||
+      pages[0].height != static_cast<uint32_t>(in.height())) {
+    fprintf(stderr, "The previous native layer is %ux%u instead of %dx%d.\n",
+            pages[0].width, pages[0].height, in.width(), in.height());
+    return false;
+  }
+  for (size_t i = 0; i < layers.size(); ++i) {
+    const PreviousPage &page = pages[i + 2];
+    if (!page.tiled || page.width != static_cast<uint32_t>(layers[i].width()) ||
+        page.height != static_cast<uint32_t>(layers[i].height())) {
+      fprintf(stderr, "The previous layer %zu does not match the layers factors.\n", i + 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool vips2svs_update(const VImage &in, const VImage &thumbnail,
+                     const char *previous_svs, const char *output_svs,
+                     const std::vector<double> &scalings, const DirtyMap &dirty,
+                     const SvsEncoderOptions &options, EncodingStats *stats) {
+  const auto start = std::chrono::steady_clock::now();
+  std::unique_ptr<TIFF, decltype(&TIFFClose)> previous(TIFFOpen(previous_svs, "r"),
+                                                       TIFFClose);
+  std::vector<PreviousPage> pages;
+  if (!previous || !read_previous_pages(previous.get(), &pages)) {
+    fprintf(stderr, "%s: not a pyramid written by svg2svs.\n", previous_svs);
+    return false;
+  }
+  // Sublayers are resampled lazily from the native layer, like
+  // vips2svs_encoder does by default, so only the dirty areas are rendered.
+  std::vector<VImage> layers;
+  for (const double scaling : scalings)
+    layers.push_back(downsample(in, scaling));
+  if (!check_layout(pages, in, layers))
+    return false;
+
+  // Tiles are copied raw, so new ones must be compressed the same way,
+  // which libtiff's own codecs do not guarantee.
+  EncodingContext context = encoding_context(options);
+  context.encoder = TileEncoderType::kLibjpeg;
+  context.colorspace = (pages[0].photometric == PHOTOMETRIC_YCBCR)
+    ? JpegColorspace::kYCbCr
+    : JpegColorspace::kRgb;
+  unsigned page_number = 0;
+  if (options.on_progress)
+    context.on_progress = [&options, &page_number](unsigned done, unsigned total) {
+      options.on_progress(page_number, done, total);
+    };
+
+  // Written aside, then moved over the output which may be the input.
+  const std::string partial = std::string(output_svs) + ".partial";
+  std::unique_ptr<OutputSink> sink = open_file_sink(
+    partial.c_str(), options.write_buffer_size.value_or(DEFAULT_WRITE_BUFFER_SIZE),
+    options.direct_io.value_or(false));
+  if (!sink)
+    return false;
+  TIFF *out = open_tiff_sink(sink.get(), "svs", TIFFIsBigTIFF(previous.get()) ? "w8" : "w");
+  if (!out) {
+    fprintf(stderr, "Could not start the svs file.\n");
+    sink->Close();
+    unlink(partial.c_str());
+    return false;
+  }
+
+  const char *kinds[] = { "native", "thumbnail", "sublayer" };
+  bool ok = true;
+  for (size_t i = 0; ok && i < pages.size(); ++i) {
+    const PreviousPage &page = pages[i];
+    ++page_number;
+    TileCompression compression;
+    if (!TIFFSetDirectory(previous.get(), i) ||
+        !tile_compression_from_tiff(page.compression, &compression)) {
+      fprintf(stderr, "The previous page %zu cannot be reused.\n", i);
+      ok = false;
+      break;
+    }
+    TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, page.description.c_str());
+
+    PageStats *page_stats = nullptr;
+    if (stats) {
+      stats->pages.push_back({});
+      page_stats = &stats->pages.back();
+      page_stats->kind = kinds[std::min<size_t>(i, 2)];
+    }
+    const std::optional<int> quality = description_quality(page.description);
+    if (i == 1) {
+      const VImage resized = resize_to(thumbnail, page.width, page.height);
+      ok = write_page(resized, page.tile_size, compression, quality, PageType::kStriped,
+                      context, out, nullptr, page_stats);
+      continue;
+    }
+
+    const VImage &image = (i == 0) ? in : layers[i - 2];
+    PageReuse reuse = { previous.get(), {} };
+    if (i == 0) {
+      // The native layer needs no margin.
+      const unsigned across = partition(image.width(), page.tile_size);
+      reuse.dirty.resize(across * partition(image.height(), page.tile_size));
+      for (size_t t = 0; t < reuse.dirty.size(); ++t)
+        reuse.dirty[t] = dirty.Any(static_cast<int64_t>(t % across) * page.tile_size,
+                                   static_cast<int64_t>(t / across) * page.tile_size,
+                                   page.tile_size, page.tile_size);
+    } else {
+      reuse.dirty = dirty_layer_tiles(dirty, in.width(), in.height(), image.width(),
+                                      image.height(), page.tile_size);
+    }
+    ok = write_page(image, page.tile_size, compression, quality, PageType::kTiled,
+                    context, out, nullptr, page_stats, &reuse);
+  }
+
+  TIFFClose(out);
+  ok = sink->Close() && ok;
+  if (ok && rename(partial.c_str(), output_svs) != 0) {
+    perror(output_svs);
+    ok = false;
+  }
+  if (!ok)
+    unlink(partial.c_str());
+
+  if (stats) {
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    stats->total_seconds = elapsed.count();
+    stats->peak_rss_bytes = peak_rss_bytes();
+  }
+  return ok;
+}
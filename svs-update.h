@@ -0,0 +1,61 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __SVS_UPDATE_H_
+#define __SVS_UPDATE_H_
+#include <cstdint>
+#include <vector>
+#include <vips/vips8>
+
+#include "aperio-svs-encoding.h"
+#include "encoding-stats.h"
+
+// Areas of the native layer that changed, tracked on a grid of square
+// cells of `cell_size` pixels.
+class DirtyMap {
+public:
+  DirtyMap(uint32_t width, uint32_t height, unsigned cell_size);
+
+  // Marks the cells intersecting a rectangle, clipped to the image.
+  void Mark(int64_t x, int64_t y, int64_t width, int64_t height);
+  // Whether any cell intersecting the rectangle is marked.
+  bool Any(int64_t x, int64_t y, int64_t width, int64_t height) const;
+  bool empty() const { return num_marked_ == 0; }
+
+private:
+  // The cells intersecting a rectangle, as [x0, x1) x [y0, y1). Returns
+  // false when there are none.
+  bool Cells(int64_t x, int64_t y, int64_t width, int64_t height,
+             unsigned *x0, unsigned *y0, unsigned *x1, unsigned *y1) const;
+
+  const uint32_t width_;
+  const uint32_t height_;
+  const unsigned cell_size_;
+  const unsigned cells_across_;
+  std::vector<bool> cells_;
+  unsigned num_marked_;
+};
+
+// Writes `output_svs` from `previous_svs`, a pyramid written by
+// vips2svs_encoder from an older version of `in` with the same `scalings`.
+// Tiles depending on the `dirty` areas of `in` are encoded again, with the
+// compression of the previous pages; the others are copied as they are.
+// The thumbnail is always written again, from `thumbnail` resampled to the
+// previous size, so that `in` is never resampled as a whole.
+// `output_svs` may be `previous_svs`, it is replaced once complete.
+bool vips2svs_update(const vips::VImage &in, const vips::VImage &thumbnail,
+                     const char *previous_svs, const char *output_svs,
+                     const std::vector<double> &scalings, const DirtyMap &dirty,
+                     const SvsEncoderOptions &options = {},
+                     EncodingStats *stats = nullptr);
+#endif // __SVS_UPDATE_H_
@@ -0,0 +1,52 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cstdint>
+#include <tiff.h>
+#include <tiffio.h>
+
+#include "tiff-utils.h"
+
+static bool strile_arrays(TIFF *tiff, uint32_t index,
+                          uint64_t **offsets, uint64_t **bytecounts) {
+  const bool tiled = TIFFIsTiled(tiff);
+  const uint32_t count = tiled ? TIFFNumberOfTiles(tiff) : TIFFNumberOfStrips(tiff);
+  if (index >= count)
+    return false;
+  return TIFFGetField(tiff, tiled ? TIFFTAG_TILEOFFSETS : TIFFTAG_STRIPOFFSETS, offsets) &&
+    TIFFGetField(tiff, tiled ? TIFFTAG_TILEBYTECOUNTS : TIFFTAG_STRIPBYTECOUNTS, bytecounts) &&
+    *offsets && *bytecounts;
+}
+
+bool get_strile(TIFF *tiff, uint32_t index, Strile *out) {
+  uint64_t *offsets = nullptr;
+  uint64_t *bytecounts = nullptr;
+  if (!strile_arrays(tiff, index, &offsets, &bytecounts))
+    return false;
+  out->offset = offsets[index];
+  out->bytecount = bytecounts[index];
+  return true;
+}
+
+bool set_strile(TIFF *tiff, uint32_t index, const Strile &strile) {
+  uint64_t *offsets = nullptr;
+  uint64_t *bytecounts = nullptr;
+  // libtiff allocates the arrays when the first tile of a page is written.
+  if (!strile_arrays(tiff, index, &offsets, &bytecounts) &&
+      (!TIFFWriteCheck(tiff, TIFFIsTiled(tiff), "set_strile") ||
+       !strile_arrays(tiff, index, &offsets, &bytecounts)))
+    return false;
+  offsets[index] = strile.offset;
+  bytecounts[index] = strile.bytecount;
+  return true;
+}
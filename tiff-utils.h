@@ -0,0 +1,30 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __TIFF_UTILS_H_
+#define __TIFF_UTILS_H_
+#include <cstdint>
+#include <tiffio.h>
+
+// Where the bytes of a tile or strip of the current directory live.
+typedef struct {
+  uint64_t offset;
+  uint64_t bytecount;
+} Strile;
+
+// libtiff has no API to place tiles or strips at arbitrary offsets, but it
+// exposes the arrays it writes in the directory. These helpers access them
+// for the directory being written.
+bool get_strile(TIFF *tiff, uint32_t index, Strile *out);
+bool set_strile(TIFF *tiff, uint32_t index, const Strile &strile);
+#endif // __TIFF_UTILS_H_
@@ -0,0 +1,133 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+
+#include "utils.h"
+#include "tile-dedup.h"
+
+// Marks digests made of a colour rather than a hash.
+#define UNIFORM_DIGEST_TAG 0x756e69666f726d00ULL
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Finalizer of MurmurHash3.
+static inline uint64_t fmix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+bool is_uniform_tile(const uint8_t *pixels, size_t stride, unsigned width,
+                     unsigned height, unsigned bands) {
+  const size_t line_size = static_cast<size_t>(width) * bands;
+  // A line equal to itself shifted by one pixel holds a single colour.
+  if (memcmp(pixels, pixels + bands, line_size - bands) != 0)
+    return false;
+  for (unsigned y = 1; y < height; ++y)
+    if (memcmp(pixels, pixels + y * stride, line_size) != 0)
+      return false;
+  return true;
+}
+
+TileDigest digest_tile(const uint8_t *pixels, size_t stride, unsigned width,
+                       unsigned height, unsigned bands) {
+  if (is_uniform_tile(pixels, stride, width, height, bands)) {
+    uint64_t colour = 0;
+    memcpy(&colour, pixels, std::min<size_t>(bands, sizeof(colour)));
+    return { UNIFORM_DIGEST_TAG, colour };
+  }
+
+  // Two independent 64-bit lanes over 8-byte words.
+  const size_t line_size = static_cast<size_t>(width) * bands;
+  uint64_t h1 = 0x9e3779b97f4a7c15ULL;
+  uint64_t h2 = 0xc2b2ae3d27d4eb4fULL;
+  for (unsigned y = 0; y < height; ++y) {
+    const uint8_t *line = pixels + y * stride;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= line_size; i += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, line + i, sizeof(word));
+      h1 = rotl(h1 ^ (word * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+      h2 = rotl(h2 + word, 27) * 0x52dce729ULL + h1;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, line + i, line_size - i);
+    h1 ^= fmix(tail + y);
+    h2 ^= h1;
+  }
+  return { fmix(h1 ^ line_size), fmix(h2 ^ height) };
+}
+
+bool TileDeduplicator::Entry::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ready_cv_.wait(lock, [&] { return ready_; });
+  return ok_;
+}
+
+void TileDeduplicator::Entry::Publish(Buffer buffer, bool ok) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  encoded = std::move(buffer);
+  ok_ = ok;
+  ready_ = true;
+  ready_cv_.notify_all();
+}
+
+// Whether the packed `kept` pixels are those of the tile at `pixels`.
+static bool same_pixels(const std::vector<uint8_t> &kept, const uint8_t *pixels,
+                        size_t stride, size_t line_size, unsigned height) {
+  if (kept.size() != line_size * height)
+    return false;
+  for (unsigned y = 0; y < height; ++y)
+    if (memcmp(kept.data() + y * line_size, pixels + y * stride, line_size) != 0)
+      return false;
+  return true;
+}
+
+std::shared_ptr<TileDeduplicator::Entry> TileDeduplicator::Claim(
+  const TileDigest &digest, const uint8_t *pixels, size_t stride, unsigned width,
+  unsigned height, unsigned bands, bool *owner) {
+  const size_t line_size = static_cast<size_t>(width) * bands;
+  *owner = false;
+  std::shared_ptr<Entry> entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto found = entries_.find(digest);
+    if (found != entries_.end()) {
+      entry = found->second;
+    } else {
+      if (kept_bytes_ + line_size * height > max_kept_bytes_)
+        return nullptr;
+      kept_bytes_ += line_size * height;
+      entry = std::make_shared<Entry>();
+      *owner = true;
+      // Filled in before it is published to the others, under the lock.
+      entry->pixels_.resize(line_size * height);
+      for (unsigned y = 0; y < height; ++y)
+        memcpy(entry->pixels_.data() + y * line_size, pixels + y * stride, line_size);
+      entries_[digest] = entry;
+    }
+  }
+  // Kept pixels never change once the entry is in the map.
+  if (!*owner && !same_pixels(entry->pixels_, pixels, stride, line_size, height))
+    return nullptr;
+  return entry;
+}
@@ -0,0 +1,101 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __TILE_DEDUP_H_
+#define __TILE_DEDUP_H_
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "utils.h"
+#include "tiff-utils.h"
+
+// 128-bit fingerprint of the pixels of a tile.
+typedef struct {
+  uint64_t high;
+  uint64_t low;
+} TileDigest;
+
+inline bool operator<(const TileDigest &a, const TileDigest &b) {
+  return (a.high != b.high) ? a.high < b.high : a.low < b.low;
+}
+
+// Whether every pixel of the `width` x `height` tile is the same colour.
+bool is_uniform_tile(const uint8_t *pixels, size_t stride, unsigned width,
+                     unsigned height, unsigned bands);
+
+// Fingerprints a tile. Single colour tiles are recognised first and keyed
+// by their colour, without hashing the whole tile.
+TileDigest digest_tile(const uint8_t *pixels, size_t stride, unsigned width,
+                       unsigned height, unsigned bands);
+
+// Pixels of unique tiles kept by a deduplicator to compare the others with.
+#define DEDUP_MAX_KEPT_BYTES (64ULL << 20)
+
+// Makes sure identical tiles of a page are compressed and written once.
+// Workers `Claim` the digest of each tile: the first claimant encodes it and
+// `Publish`es the result, the others skip compression. The writer then
+// writes the first occurrence in tile order and points the others at it.
+// Tiles are only shared when their pixels are equal, digests merely find
+// the candidates. The first claimant's pixels are kept for comparison, up
+// to `max_kept_bytes`, beyond which new tiles are no longer shared.
+class TileDeduplicator {
+public:
+  class Entry {
+  public:
+    // Blocks until the owner published its encoded tile.
+    bool Wait();
+    void Publish(Buffer encoded, bool ok);
+
+    Buffer encoded;  // released once written.
+    std::optional<Strile> written;
+
+  private:
+    friend class TileDeduplicator;
+    std::vector<uint8_t> pixels_;  // of the first claimant, packed.
+
+    std::mutex mutex_;
+    std::condition_variable ready_cv_;
+    bool ready_ = false;
+    bool ok_ = false;
+  };
+
+  explicit TileDeduplicator(uint64_t max_kept_bytes = DEDUP_MAX_KEPT_BYTES)
+    : max_kept_bytes_(max_kept_bytes) {}
+
+  // `owner` tells whether the caller is the first to see the tile of
+  // `digest` and `pixels`. Returns nullptr when the tile cannot be shared:
+  // a different tile has the same digest, or no more pixels can be kept.
+  // The caller then compresses and writes it on its own.
+  std::shared_ptr<Entry> Claim(const TileDigest &digest, const uint8_t *pixels,
+                               size_t stride, unsigned width, unsigned height,
+                               unsigned bands, bool *owner);
+
+  // Counts the tiles which were not encoded thanks to deduplication.
+  void CountDuplicate() { ++num_duplicates_; }
+  unsigned num_duplicates() const { return num_duplicates_; }
+
+private:
+  std::mutex mutex_;
+  std::map<TileDigest, std::shared_ptr<Entry>> entries_;
+  const uint64_t max_kept_bytes_;
+  uint64_t kept_bytes_ = 0;
+  std::atomic<unsigned> num_duplicates_{0};
+};
+#endif // __TILE_DEDUP_H_
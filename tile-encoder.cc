@@ -0,0 +1,281 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <tiff.h>
+#include <tiffio.h>
+
+#include "utils.h"
+#include "jpeg-encoder.h"
+#include "lossless-encoder.h"
+#ifdef WITH_OPENJPEG
+#include "jp2k-encoder.h"
+#endif
+#ifdef WITH_WEBP
+#include "webp-encoder.h"
+#endif
+#include "tile-encoder.h"
+
+// Aperio's JPEG 2000 schemes, unknown to libtiff.
+#define COMPRESSION_APERIO_JP2K_YCBCR 33003
+#define COMPRESSION_APERIO_JP2K_RGB 33005
+// Older libtiff headers miss the newer schemes.
+#ifndef COMPRESSION_ZSTD
+#define COMPRESSION_ZSTD 50000
+#endif
+#ifndef COMPRESSION_WEBP
+#define COMPRESSION_WEBP 50001
+#endif
+
+typedef struct {
+  TileCompression compression;
+  const char *name;  // on the command line.
+  const char *aperio_name;  // in the ImageDescription.
+  uint16_t tiff_compression;
+  bool lossless;
+} CompressionInfo;
+
+static const CompressionInfo kCompressions[] = {
+  { TileCompression::kJpeg, "jpeg", "JPEG/RGB", COMPRESSION_JPEG, false },
+  { TileCompression::kJp2kYCbCr, "jp2k", "J2K/YUV16", COMPRESSION_APERIO_JP2K_YCBCR, false },
+  { TileCompression::kJp2kRgb, "jp2k-rgb", "J2K/RGB", COMPRESSION_APERIO_JP2K_RGB, false },
+  { TileCompression::kWebp, "webp", "WEBP/RGB", COMPRESSION_WEBP, false },
+  { TileCompression::kZstd, "zstd", "ZSTD/RGB", COMPRESSION_ZSTD, true },
+  { TileCompression::kDeflate, "deflate", "DEFLATE/RGB", COMPRESSION_ADOBE_DEFLATE, true },
+};
+
+static const CompressionInfo &compression_info(TileCompression compression) {
+  for (const CompressionInfo &info : kCompressions)
+    if (info.compression == compression)
+      return info;
+  return kCompressions[0];
+}
+
+// Describes how the page components are stored. libtiff converts RGB
+// tiles to YCbCr itself when it is asked for JPEGCOLORMODE_RGB.
+static bool setup_colorspace(TIFF *out, JpegColorspace colorspace) {
+  if (colorspace == JpegColorspace::kRgb)
+    return TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+
+  float reference_black_white[6] = {0.0f, 255.0f, 128.0f, 255.0f, 128.0f, 255.0f};
+  TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
+  TIFFSetField(out, TIFFTAG_YCBCRSUBSAMPLING, 2, 2);
+  return TIFFSetField(out, TIFFTAG_REFERENCEBLACKWHITE, reference_black_white);
+}
+
+// Tiles are abbreviated JPEG streams sharing the page's JPEGTABLES.
+class LibjpegCodec : public TileCodec {
+public:
+  explicit LibjpegCodec(const CodecSettings &settings) : settings_(settings) {}
+
+  bool SetupPage(TIFF *out) const override {
+    TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_JPEG);
+    TIFFSetField(out, TIFFTAG_JPEGQUALITY, settings_.quality);
+    if (!setup_colorspace(out, settings_.colorspace))
+      return false;
+
+    // Also replaces the placeholder tables libtiff reserves for its own codec.
+    JpegEncoder encoder(settings_.quality, settings_.optimize_coding,
+                        settings_.colorspace);
+    Buffer tables;
+    if (!encoder.Tables(&tables))
+      return false;
+    return TIFFSetField(out, TIFFTAG_JPEGTABLES, static_cast<uint32_t>(tables.size),
+                        tables.data.get());
+  }
+
+  std::unique_ptr<TileEncoder> NewEncoder() const override {
+    return std::unique_ptr<TileEncoder>(
+      new JpegEncoder(settings_.quality, settings_.optimize_coding,
+                      settings_.colorspace));
+  }
+
+private:
+  const CodecSettings settings_;
+};
+
+#ifdef WITH_OPENJPEG
+// Tiles are raw JPEG 2000 codestreams. libtiff does not know Aperio's
+// schemes, but still writes raw tiles for them.
+class Jp2kCodec : public TileCodec {
+public:
+  explicit Jp2kCodec(const CodecSettings &settings) : settings_(settings) {}
+
+  bool SetupPage(TIFF *out) const override {
+    return TIFFSetField(out, TIFFTAG_COMPRESSION,
+                        compression_info(settings_.compression).tiff_compression);
+  }
+
+  std::unique_ptr<TileEncoder> NewEncoder() const override {
+    return std::unique_ptr<TileEncoder>(
+      new Jp2kEncoder(settings_.quality,
+                      settings_.compression == TileCompression::kJp2kYCbCr));
+  }
+
+private:
+  const CodecSettings settings_;
+};
+#endif
+
+#ifdef WITH_WEBP
+class WebpCodec : public TileCodec {
+public:
+  explicit WebpCodec(const CodecSettings &settings) : settings_(settings) {}
+
+  bool SetupPage(TIFF *out) const override {
+    return TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_WEBP);
+  }
+
+  std::unique_ptr<TileEncoder> NewEncoder() const override {
+    return std::unique_ptr<TileEncoder>(new WebpEncoder(settings_.quality));
+  }
+
+private:
+  const CodecSettings settings_;
+};
+#endif
+
+// Horizontal differencing must be declared for readers to undo it.
+static bool setup_predictor(TIFF *out) {
+  if (!TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL)) {
+    fprintf(stderr, "libtiff does not support predictors with this compression.\n");
+    return false;
+  }
+  return true;
+}
+
+class LosslessCodec : public TileCodec {
+public:
+  explicit LosslessCodec(const CodecSettings &settings) : settings_(settings) {}
+
+  bool SetupPage(TIFF *out) const override {
+    TIFFSetField(out, TIFFTAG_COMPRESSION,
+                 compression_info(settings_.compression).tiff_compression);
+    return setup_predictor(out);
+  }
+
+  std::unique_ptr<TileEncoder> NewEncoder() const override {
+    return std::unique_ptr<TileEncoder>(new LosslessEncoder(settings_.compression));
+  }
+
+private:
+  const CodecSettings settings_;
+};
+
+// The reference path: libtiff's own codecs, run as tiles are written.
+class LibtiffCodec : public TileCodec {
+public:
+  explicit LibtiffCodec(const CodecSettings &settings) : settings_(settings) {}
+
+  bool SetupPage(TIFF *out) const override {
+    TIFFSetField(out, TIFFTAG_COMPRESSION,
+                 compression_info(settings_.compression).tiff_compression);
+    switch (settings_.compression) {
+      case TileCompression::kJpeg:
+        TIFFSetField(out, TIFFTAG_JPEGQUALITY, settings_.quality);
+        if (!setup_colorspace(out, settings_.colorspace))
+          return false;
+        // Must come after the photometric interpretation.
+        if (settings_.colorspace == JpegColorspace::kYCbCr)
+          return TIFFSetField(out, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+        return true;
+      case TileCompression::kWebp:
+#ifdef TIFFTAG_WEBP_LEVEL
+        return TIFFSetField(out, TIFFTAG_WEBP_LEVEL, settings_.quality);
+#else
+        return true;
+#endif
+      case TileCompression::kZstd:
+      case TileCompression::kDeflate:
+        return setup_predictor(out);
+      case TileCompression::kJp2kYCbCr:
+      case TileCompression::kJp2kRgb:
+        break;
+    }
+    return false;
+  }
+
+  std::unique_ptr<TileEncoder> NewEncoder() const override { return nullptr; }
+
+private:
+  const CodecSettings settings_;
+};
+
+std::unique_ptr<TileCodec> make_tile_codec(const CodecSettings &settings) {
+  const char *name = compression_info(settings.compression).name;
+  if (settings.encoder == TileEncoderType::kLibtiff) {
+    if (!TIFFIsCODECConfigured(compression_info(settings.compression).tiff_compression)) {
+      fprintf(stderr, "libtiff cannot compress %s tiles.\n", name);
+      return nullptr;
+    }
+    return std::unique_ptr<TileCodec>(new LibtiffCodec(settings));
+  }
+
+  switch (settings.compression) {
+    case TileCompression::kJpeg:
+      return std::unique_ptr<TileCodec>(new LibjpegCodec(settings));
+    case TileCompression::kJp2kYCbCr:
+    case TileCompression::kJp2kRgb:
+#ifdef WITH_OPENJPEG
+      return std::unique_ptr<TileCodec>(new Jp2kCodec(settings));
+#else
+      break;
+#endif
+    case TileCompression::kWebp:
+#ifdef WITH_WEBP
+      return std::unique_ptr<TileCodec>(new WebpCodec(settings));
+#else
+      break;
+#endif
+    case TileCompression::kZstd:
+#ifdef WITH_ZSTD
+      return std::unique_ptr<TileCodec>(new LosslessCodec(settings));
+#else
+      break;
+#endif
+    case TileCompression::kDeflate:
+      return std::unique_ptr<TileCodec>(new LosslessCodec(settings));
+  }
+  fprintf(stderr, "%s support was not compiled in.\n", name);
+  return nullptr;
+}
+
+bool parse_tile_compression(const char *name, TileCompression *out) {
+  for (const CompressionInfo &info : kCompressions) {
+    if (strcmp(name, info.name) == 0) {
+      *out = info.compression;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool tile_compression_from_tiff(uint16_t tiff_compression, TileCompression *out) {
+  for (const CompressionInfo &info : kCompressions) {
+    if (info.tiff_compression == tiff_compression) {
+      *out = info.compression;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *aperio_compression_name(TileCompression compression) {
+  return compression_info(compression).aperio_name;
+}
+
+bool is_lossless(TileCompression compression) {
+  return compression_info(compression).lossless;
+}
@@ -0,0 +1,90 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __TILE_ENCODER_H_
+#define __TILE_ENCODER_H_
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <tiffio.h>
+
+#include "utils.h"
+
+enum class TileEncoderType {
+  kLibjpeg,  // our encoders (libjpeg(-turbo) for JPEG) on the workers, raw writes.
+  kLibtiff,  // libtiff's own codec, on the writer thread.
+};
+
+// Compression of the tiles of a page.
+enum class TileCompression {
+  kJpeg,
+  kJp2kYCbCr,  // Aperio JPEG 2000 with YCbCr components (33003).
+  kJp2kRgb,    // Aperio JPEG 2000 with RGB components (33005).
+  kWebp,
+  kZstd,       // lossless, with horizontal differencing.
+  kDeflate,    // lossless, with horizontal differencing.
+};
+
+enum class JpegColorspace {
+  kYCbCr,  // PHOTOMETRIC_YCBCR with 4:2:0 chroma, as Aperio scanners write.
+  kRgb,    // PHOTOMETRIC_RGB, every component at full resolution.
+};
+
+// How the tiles of a page are compressed.
+typedef struct {
+  TileEncoderType encoder;
+  TileCompression compression;
+  int quality;  // lossy codecs only.
+  bool optimize_coding;  // per tile Huffman tables.
+  JpegColorspace colorspace;  // JPEG only.
+} CodecSettings;
+
+// Compresses pixel blocks on a single thread.
+class TileEncoder {
+public:
+  virtual ~TileEncoder() {}
+
+  // Encodes `height` rows of `width` RGB pixels, `stride` bytes apart.
+  virtual bool Encode(const uint8_t *pixels, unsigned width, unsigned height,
+                      size_t stride, Buffer *out) = 0;
+};
+
+// Compression scheme of a page.
+class TileCodec {
+public:
+  virtual ~TileCodec() {}
+
+  // Sets the compression tags of the page about to be written.
+  virtual bool SetupPage(TIFF *out) const = 0;
+
+  // A new encoder for one worker thread, or nullptr when libtiff compresses
+  // the tiles itself as they are written.
+  virtual std::unique_ptr<TileEncoder> NewEncoder() const = 0;
+};
+
+// Returns nullptr, after reporting why, when the compression is not
+// available with this build or with the requested encoder.
+std::unique_ptr<TileCodec> make_tile_codec(const CodecSettings &settings);
+
+// Parses the command line name of a compression.
+bool parse_tile_compression(const char *name, TileCompression *out);
+
+// The compression of tiles stored with the TIFF compression scheme
+// `tiff_compression`.
+bool tile_compression_from_tiff(uint16_t tiff_compression, TileCompression *out);
+
+// How Aperio's ImageDescription names the compression, e.g. "JPEG/RGB".
+const char *aperio_compression_name(TileCompression compression);
+
+bool is_lossless(TileCompression compression);
+#endif // __TILE_ENCODER_H_
@@ -18,7 +18,6 @@
 #include <type_traits>
 #include <vips/vips.h>
 #include <vips/vips8>
-#include <cstring>
 
 #include "utils.h"
 #include "tile-generator.h"
@@ -29,7 +28,8 @@ VipsImageTileGenerator::VipsImageTileGenerator(
   const VImage &source, unsigned tile_width, unsigned tile_height)
   : source_(source), tile_width_(tile_width), tile_height_(tile_height),
     num_tiles_width_(partition(source.width(), tile_width)),
-    num_total_tiles_(num_tiles_width_ * partition(source.height(), tile_height)) {}
+    num_total_tiles_(num_tiles_width_ * partition(source.height(), tile_height)),
+    pool_(BufferPool::Create(static_cast<size_t>(tile_width) * tile_height * source.bands())) {}
 
 std::optional<Tile> VipsImageTileGenerator::Next(
   const std::optional<Tile> &prev, bool *end) const {
@@ -45,8 +45,10 @@ std::optional<Tile> VipsImageTileGenerator::Next(
   return ref[tile_index];
 }
 
-const bool VipsImageTileGenerator::ExtractTile(int x, int y, Buffer *out) const {
-  UniqueVipsRegion region(vips_region_new(source_.get_image()));
+const bool VipsImageTileGenerator::ExtractTile(VipsRegion *region, unsigned i,
+                                               bool borrow, Tile *out) const {
+  const int x = (i % num_tiles_width_) * tile_width_;
+  const int y = (i / num_tiles_width_) * tile_height_;
 
   const unsigned bands = source_.bands();
   const unsigned x_end = x + tile_width_;
@@ -59,39 +61,71 @@ const bool VipsImageTileGenerator::ExtractTile(int x, int y, Buffer *out) const
 
   VipsRect r = { x, y, region_valid_width, region_valid_height };
 
-  if (vips_region_prepare(region.get(), &r))
+  if (vips_region_prepare(region, &r))
     return false;
 
   const size_t tile_line_size = tile_width_ * bands;
   const size_t tile_size = tile_line_size * tile_height_;
 
-  size_t region_line_size = VIPS_REGION_SIZEOF_LINE(region.get());
-  size_t region_stride = VIPS_REGION_LSKIP(region.get());
+  size_t region_line_size = VIPS_REGION_SIZEOF_LINE(region);
+  size_t region_stride = VIPS_REGION_LSKIP(region);
 
-  uint8_t *c = VIPS_REGION_ADDR_TOPLEFT(region.get());
-  uint8_t *data = new uint8_t[tile_size]{};
+  uint8_t *c = VIPS_REGION_ADDR_TOPLEFT(region);
+  out->index = i;
 
-  for (int i = 0; i < region_valid_height; ++i) {
-    const size_t dst_offset = tile_line_size * i;
-    const size_t src_offset = region_stride * i;
-    memcpy(data + dst_offset, c + src_offset, region_line_size);
+  // Interior tiles can be handed over as they are.
+  const bool interior = region_line_size == tile_line_size &&
+    static_cast<unsigned>(region_valid_height) == tile_height_;
+  if (interior && borrow) {
+    out->buffer = Buffer{};
+    out->pixels = c;
+    out->stride = region_stride;
+    return true;
   }
 
-  out->data.reset(data);
-  out->size = tile_size;
+  out->buffer = pool_->Acquire();
+  uint8_t *data = out->buffer.data.get();
+  if (!data)
+    return false;
+  out->pixels = data;
+  out->stride = tile_line_size;
+
+  if (interior && region_stride == tile_line_size) {
+    memcpy(data, c, tile_size);
+    return true;
+  }
+
+  // Only the padding of border tiles needs clearing.
+  for (int row = 0; row < region_valid_height; ++row) {
+    const size_t dst_offset = tile_line_size * row;
+    const size_t src_offset = region_stride * row;
+    memcpy(data + dst_offset, c + src_offset, region_line_size);
+    memset(data + dst_offset + region_line_size, 0, tile_line_size - region_line_size);
+  }
+  memset(data + tile_line_size * region_valid_height, 0,
+         tile_line_size * (tile_height_ - region_valid_height));
   return true;
 }
 
 const std::optional<Tile> VipsImageTileGenerator::operator[](unsigned int i) const {
-  const unsigned row = i / (num_tiles_width_);
-  const unsigned column = i % num_tiles_width_;
-  const int y = row * tile_height_;
-  const int x = column * tile_width_;
+  UniqueVipsRegion region(vips_region_new(source_.get_image()));
 
-  Tile tile{{}, i};
-  if (!ExtractTile(x, y, &tile.buffer)) {
+  Tile tile{{}, i, nullptr, 0};
+  if (!ExtractTile(region.get(), i, false, &tile)) {
     fprintf(stderr, "Unable to extract tile.");
     return {};
   }
   return tile;
 }
+
+VipsImageTileGenerator::Reader::Reader(const VipsImageTileGenerator &generator)
+  : generator_(generator),
+    region_(vips_region_new(generator.source_.get_image())) {}
+
+bool VipsImageTileGenerator::Reader::Read(unsigned i, Tile *out) {
+  if (!generator_.ExtractTile(region_.get(), i, true, out)) {
+    fprintf(stderr, "Unable to extract tile.");
+    return false;
+  }
+  return true;
+}
@@ -14,6 +14,7 @@
 #ifndef __TILE_GENERATOR_H_
 #define __TILE_GENERATOR_H_
 #include <cstddef>
+#include <memory>
 #include <vips/vips.h>
 #include <vips/vips8>
 
@@ -22,8 +23,10 @@
 using namespace vips;
 
 typedef struct {
-  Buffer buffer;
+  Buffer buffer;  // empty when the pixels are borrowed from a region.
   unsigned index;
+  const uint8_t *pixels;  // first row of the tile.
+  size_t stride;  // bytes between two rows of `pixels`.
 } Tile;
 
 // Lazy loads each tile.
@@ -34,10 +37,29 @@ public:
   virtual std::optional<Tile> Next(
     const std::optional<Tile> &prev, bool *end) const final;
 
+  // Tiles returned by the generator always own their pixels.
   const std::optional<Tile> operator[] (unsigned i) const;
 
+  // Total number of tiles in the image.
+  unsigned size() const { return num_total_tiles_; }
+
+  // Extracts tiles for a single thread, reusing the same region for every
+  // tile. Must be created on the thread that uses it.
+  class Reader {
+  public:
+    explicit Reader(const VipsImageTileGenerator &generator);
+
+    // Interior tiles borrow the region memory, which stays valid until the
+    // next call. Border tiles are padded in a pooled buffer.
+    bool Read(unsigned i, Tile *out);
+
+  private:
+    const VipsImageTileGenerator &generator_;
+    UniqueVipsRegion region_;
+  };
+
 private:
-  const bool ExtractTile(int x, int y, Buffer *out) const;
+  const bool ExtractTile(VipsRegion *region, unsigned i, bool borrow, Tile *out) const;
 
   const VImage &source_;
   const unsigned tile_width_;
@@ -45,5 +67,6 @@ private:
 
   const unsigned num_tiles_width_;
   const unsigned num_total_tiles_;
+  const std::shared_ptr<BufferPool> pool_;
 };
 #endif // __TILE_GENERATOR_H_
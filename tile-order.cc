@@ -0,0 +1,82 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#include "tile-order.h"
+
+// Position of (x, y) along the Morton curve: their bits interleaved.
+static uint64_t z_order_key(uint32_t x, uint32_t y) {
+  uint64_t key = 0;
+  for (unsigned bit = 0; bit < 32; ++bit) {
+    key |= static_cast<uint64_t>((x >> bit) & 1) << (2 * bit);
+    key |= static_cast<uint64_t>((y >> bit) & 1) << (2 * bit + 1);
+  }
+  return key;
+}
+
+// Position of (x, y) along the Hilbert curve filling a `side` x `side`
+// square, `side` being a power of two.
+static uint64_t hilbert_key(uint32_t side, uint32_t x, uint32_t y) {
+  uint64_t key = 0;
+  for (uint32_t s = side / 2; s > 0; s /= 2) {
+    const uint32_t rx = (x & s) ? 1 : 0;
+    const uint32_t ry = (y & s) ? 1 : 0;
+    key += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+    // Rotates the quadrant so that the curve continues from the previous one.
+    if (ry == 0) {
+      if (rx == 1) {
+        x = side - 1 - x;
+        y = side - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return key;
+}
+
+bool parse_tile_order(const char *name, TileOrder *out) {
+  if (strcmp(name, "row") == 0)
+    *out = TileOrder::kRowMajor;
+  else if (strcmp(name, "z") == 0)
+    *out = TileOrder::kZOrder;
+  else if (strcmp(name, "hilbert") == 0)
+    *out = TileOrder::kHilbert;
+  else
+    return false;
+  return true;
+}
+
+std::vector<uint32_t> tile_order(TileOrder order, uint32_t across, uint32_t down) {
+  std::vector<uint32_t> indices(static_cast<size_t>(across) * down);
+  std::iota(indices.begin(), indices.end(), 0);
+  if (order == TileOrder::kRowMajor)
+    return indices;
+
+  // Pages that are not square powers of two are covered by the curve of
+  // the smallest one that is, skipping the tiles outside the page.
+  uint32_t side = 1;
+  while (side < std::max(across, down))
+    side *= 2;
+  std::vector<uint64_t> keys(indices.size());
+  for (uint32_t index : indices) {
+    const uint32_t x = index % across;
+    const uint32_t y = index / across;
+    keys[index] = (order == TileOrder::kZOrder) ? z_order_key(x, y) : hilbert_key(side, x, y);
+  }
+  std::sort(indices.begin(), indices.end(),
+            [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+  return indices;
+}
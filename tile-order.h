@@ -0,0 +1,34 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __TILE_ORDER_H_
+#define __TILE_ORDER_H_
+#include <cstdint>
+#include <vector>
+
+// Order in which the tiles of a page are stored in the file. Curves keep
+// tiles that are close in the image close in the file, so that a viewer
+// reads a region in fewer, larger requests.
+enum class TileOrder {
+  kRowMajor,  // row after row, like libtiff numbers them.
+  kZOrder,    // Morton order, by quadrants of quadrants.
+  kHilbert,   // Hilbert curve, without the jumps of Z-order.
+};
+
+// Parses the command line name of an order: row, z or hilbert.
+bool parse_tile_order(const char *name, TileOrder *out);
+
+// The indices of the tiles of a page of `across` x `down` tiles, in the
+// order they are stored.
+std::vector<uint32_t> tile_order(TileOrder order, uint32_t across, uint32_t down);
+#endif // __TILE_ORDER_H_
@@ -0,0 +1,126 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __TILE_PIPELINE_H_
+#define __TILE_PIPELINE_H_
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Number of workers to use when the caller does not specify it.
+inline unsigned default_num_workers() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Produces items on a pool of workers and consumes them on the calling
+// thread strictly in index order.
+// At most `max_in_flight` items are produced but not yet consumed at any
+// time, which bounds the memory held by the pipeline.
+template<typename T>
+class TilePipeline {
+public:
+  // `worker` is in [0, num_workers) and lets producers keep per-thread state.
+  using Producer = std::function<bool(unsigned worker, unsigned index, T *out)>;
+  using Consumer = std::function<bool(unsigned index, T &item)>;
+
+  TilePipeline(unsigned num_workers, unsigned max_in_flight)
+    : num_workers_(std::max(1u, num_workers)),
+      max_in_flight_(std::max(num_workers_, max_in_flight)) {}
+
+  unsigned num_workers() const { return num_workers_; }
+
+  // Runs `produce` for every index in [0, num_items) and hands each result to
+  // `consume` in increasing index order.
+  // Stops early and returns false as soon as any callback fails.
+  bool Run(unsigned num_items, const Producer &produce, const Consumer &consume) {
+    std::vector<std::optional<T>> slots(max_in_flight_);
+    std::mutex mutex;
+    std::condition_variable produced;
+    std::condition_variable consumed;
+    std::atomic<unsigned> next_index{0};
+    unsigned next_to_consume = 0;
+    bool failed = false;
+
+    auto work = [&](unsigned worker) {
+      for (;;) {
+        const unsigned index = next_index.fetch_add(1);
+        if (index >= num_items)
+          return;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          consumed.wait(lock, [&] {
+            return failed || index < next_to_consume + max_in_flight_;
+          });
+          if (failed)
+            return;
+        }
+
+        T item{};
+        const bool ok = produce(worker, index, &item);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ok) {
+          failed = true;
+          consumed.notify_all();
+          produced.notify_all();
+          return;
+        }
+        slots[index % max_in_flight_] = std::move(item);
+        produced.notify_all();
+      }
+    };
+
+    const unsigned num_threads = std::min(num_workers_, std::max(1u, num_items));
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for (unsigned i = 0; i < num_threads; ++i)
+      workers.emplace_back(work, i);
+
+    for (unsigned i = 0; i < num_items; ++i) {
+      std::optional<T> &slot = slots[i % max_in_flight_];
+      T item;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        produced.wait(lock, [&] { return failed || slot.has_value(); });
+        if (failed)
+          break;
+        item = std::move(*slot);
+        slot.reset();
+      }
+
+      const bool ok = consume(i, item);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      next_to_consume = i + 1;
+      if (!ok)
+        failed = true;
+      consumed.notify_all();
+      if (failed)
+        break;
+    }
+
+    for (std::thread &worker : workers)
+      worker.join();
+    return !failed;
+  }
+
+private:
+  const unsigned num_workers_;
+  const unsigned max_in_flight_;
+};
+#endif // __TILE_PIPELINE_H_
@@ -13,18 +13,102 @@
 // limitations under the License.
 #ifndef __UTILS_H_
 #define __UTILS_H_
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <memory>
+#include <mutex>
 #include <iostream>
 #include <optional>
 #include <type_traits>
+#include <vector>
 #include <vips/vips.h>
 #include <vips/vips8>
 
+// Intermediate pyramid levels up to this size are kept in memory, larger ones
+// are spilled to a temporary file.
+#define MAX_IN_MEMORY_LEVEL_SIZE (256 * 1024 * 1024)
+
+// Tiles libvips' tilecache keeps by default.
+#define VIPS_TILECACHE_TILES 1000
+// Pixels of a native tile.
+#define TILE_BYTES (256 * 256 * 3)
+
+// Alignment of pooled buffers, a cache line.
+#define BUFFER_ALIGNMENT 64
+
+class BufferPool;
+
+// Frees a buffer, or hands it back to the pool it was taken from.
+struct BufferDeleter {
+  std::shared_ptr<BufferPool> pool;
+  void operator()(uint8_t *data) const;
+};
+
 typedef struct {
-  std::unique_ptr<uint8_t[]> data;
+  std::unique_ptr<uint8_t[], BufferDeleter> data;
   size_t size;
 } Buffer;
 
+// Recycles equally sized, aligned buffers so that steady state tile
+// processing does not allocate.
+// Buffers keep their pool alive, they can outlive the pool's owner.
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+public:
+  static std::shared_ptr<BufferPool> Create(size_t buffer_size) {
+    return std::shared_ptr<BufferPool>(new BufferPool(buffer_size));
+  }
+
+  ~BufferPool() {
+    for (uint8_t *data : free_)
+      free(data);
+  }
+
+  // The contents of the returned buffer are undefined.
+  Buffer Acquire() {
+    uint8_t *data = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_.empty()) {
+        data = free_.back();
+        free_.pop_back();
+      }
+    }
+    if (!data)
+      data = static_cast<uint8_t *>(aligned_alloc(BUFFER_ALIGNMENT, allocation_size_));
+    return Buffer{ std::unique_ptr<uint8_t[], BufferDeleter>(
+                     data, BufferDeleter{ shared_from_this() }),
+                   buffer_size_ };
+  }
+
+  void Release(uint8_t *data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(data);
+  }
+
+private:
+  explicit BufferPool(size_t buffer_size)
+    : buffer_size_(buffer_size),
+      allocation_size_((buffer_size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT) {}
+
+  const size_t buffer_size_;
+  const size_t allocation_size_;
+  std::mutex mutex_;
+  std::vector<uint8_t *> free_;
+};
+
+inline void BufferDeleter::operator()(uint8_t *data) const {
+  if (pool)
+    pool->Release(data);
+  else
+    delete[] data;
+}
+
+// Allocates an unpooled buffer.
+inline Buffer allocate_buffer(size_t size) {
+  return Buffer{ std::unique_ptr<uint8_t[], BufferDeleter>(new uint8_t[size]), size };
+}
+
 template<typename T>
 struct GDeleter {
   void operator()(T* ptr) const { g_object_unref(ptr); }
@@ -0,0 +1,33 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <cstdio>
+#include <cstring>
+#include <webp/encode.h>
+
+#include "utils.h"
+#include "webp-encoder.h"
+
+bool WebpEncoder::Encode(const uint8_t *pixels, unsigned width, unsigned height,
+                         size_t stride, Buffer *out) {
+  uint8_t *encoded = nullptr;
+  const size_t size = WebPEncodeRGB(pixels, width, height, stride, quality_, &encoded);
+  if (!size) {
+    fprintf(stderr, "WebPEncodeRGB() failed for a %ux%u block.\n", width, height);
+    return false;
+  }
+  *out = allocate_buffer(size);
+  memcpy(out->data.get(), encoded, size);
+  WebPFree(encoded);
+  return true;
+}
@@ -0,0 +1,34 @@
+// Copyright 2021 Ellogon BV.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef __WEBP_ENCODER_H_
+#define __WEBP_ENCODER_H_
+#include <cstddef>
+#include <cstdint>
+
+#include "utils.h"
+#include "tile-encoder.h"
+
+// Compresses RGB pixel blocks into lossy WebP images, stored whole in
+// COMPRESSION_WEBP pages like libtiff's own codec does.
+class WebpEncoder : public TileEncoder {
+public:
+  explicit WebpEncoder(int quality) : quality_(quality) {}
+
+  bool Encode(const uint8_t *pixels, unsigned width, unsigned height,
+              size_t stride, Buffer *out) override;
+
+private:
+  const int quality_;
+};
+#endif // __WEBP_ENCODER_H_